@@ -0,0 +1,764 @@
+/* SFTP server benchmark. Runs the server on a socketpair (or pipes) and drives
+synthetic workloads against it, reporting request rate, throughput and
+request latency percentiles:
+
+upload      sequential WRITEs of -b bytes to a -z MB file, -q outstanding
+download    sequential READs of that file, -q outstanding
+randread    -n READs at random block-aligned offsets, -q outstanding
+create      -n files created with OPEN and CLOSEd as the handles arrive
+readdir     OPENDIR/READDIR of a directory of -n files
+stat        -n STATs of the files in that directory, -q outstanding
+
+usage: nih-sftp-bench [-s server] [-d dir] [-w workload,...] [-n count]
+                      [-q outstanding] [-b block] [-z megabytes] [-p]
+                      [-- server arguments]
+
+Files are created in dir (default a new directory in /tmp, removed
+afterwards). -p connects the server with pipes rather than a socketpair.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "nih-sftp-client.h"
+
+/* Window sizes must be powers of 2 so request ids can index send times */
+#define MAX_WINDOW 1024
+/* The server has 99 handles */
+#define MAX_CREATE_WINDOW 64
+#define MAX_BLOCK (256 * 1024)
+#define MAX_HANDLE_LEN 256
+/* Leaves room in PATH_MAX for the names we put in the directory */
+#define MAX_DIR_LEN (PATH_MAX - 64)
+
+/* Defaults */
+#define DEFAULT_COUNT 10000
+#define DEFAULT_WINDOW 32
+#define DEFAULT_BLOCK 32768
+#define DEFAULT_SIZE_MB 64
+
+typedef struct bench_tag
+{
+    sftp_client_t client;
+    uint32_t next_id;
+    uint32_t outstanding;
+    uint64_t sent_ns[MAX_WINDOW];
+    uint64_t *p_latency;        /* Per-request latencies of the current workload */
+    size_t latency_count;
+    size_t latency_size;
+    uint64_t bytes;
+    uint64_t ops;
+} bench_t;
+
+typedef struct options_tag
+{
+    const char *sz_server;
+    char sz_dir[MAX_DIR_LEN];
+    uint32_t count;
+    uint32_t window;
+    uint32_t block;
+    uint64_t size;
+    int use_pipes;
+} options_t;
+
+typedef int (*workload_fn_t)(bench_t *p_bench, const options_t *p_opts);
+
+typedef struct workload_tag
+{
+    const char *sz_name;
+    workload_fn_t run;
+} workload_t;
+
+static int run_upload(bench_t *p_bench, const options_t *p_opts);
+static int run_download(bench_t *p_bench, const options_t *p_opts);
+static int run_randread(bench_t *p_bench, const options_t *p_opts);
+static int run_create(bench_t *p_bench, const options_t *p_opts);
+static int run_readdir(bench_t *p_bench, const options_t *p_opts);
+static int run_stat(bench_t *p_bench, const options_t *p_opts);
+
+static uint32_t bench_begin(bench_t *p_bench, uint8_t type);
+static int bench_send(bench_t *p_bench);
+static const uint8_t *bench_reply(bench_t *p_bench, uint32_t *p_len);
+static const uint8_t *bench_call(bench_t *p_bench, uint32_t *p_len);
+static int bench_open(bench_t *p_bench, uint8_t type, const char *sz_path, uint32_t pflags,
+    char *p_handle, uint32_t *p_handle_len);
+static int bench_close(bench_t *p_bench, const char *p_handle, uint32_t handle_len);
+static int check_status(const uint8_t *p_reply, uint32_t len, const char *sz_what);
+static void report(bench_t *p_bench, const char *sz_name, uint64_t elapsed_ns);
+static int compare_uint64(const void *p_a, const void *p_b);
+static int make_data_file(const options_t *p_opts);
+static int make_dir_files(const options_t *p_opts);
+static int remove_entry(const char *sz_path, const struct stat *p_st, int flag, struct FTW *p_ftw);
+
+static const workload_t workloads[] =
+{
+    { "upload", run_upload },
+    { "download", run_download },
+    { "randread", run_randread },
+    { "create", run_create },
+    { "readdir", run_readdir },
+    { "stat", run_stat }
+};
+
+static sftp_packet_t packet;
+static uint8_t block_data[MAX_BLOCK];
+
+int main(int argc, char **argv)
+{
+    options_t opts;
+    const char *sz_workloads = "all";
+    char sz_default_server[PATH_MAX];
+    char **server_argv;
+    int remove_dir = 0;
+    int failures = 0;
+    int opt, i;
+    size_t w;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.count = DEFAULT_COUNT;
+    opts.window = DEFAULT_WINDOW;
+    opts.block = DEFAULT_BLOCK;
+    opts.size = (uint64_t)DEFAULT_SIZE_MB * 1024 * 1024;
+
+    /* By default the server is next to us */
+    snprintf(sz_default_server, sizeof(sz_default_server), "%.*s%s",
+        strrchr(argv[0], '/') ? (int)(strrchr(argv[0], '/') - argv[0] + 1) : 0, argv[0], "nih-sftp-server");
+    opts.sz_server = sz_default_server;
+
+    while ((opt = getopt(argc, argv, "s:d:w:n:q:b:z:p")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            opts.sz_server = optarg;
+            break;
+        case 'd':
+            snprintf(opts.sz_dir, sizeof(opts.sz_dir), "%s", optarg);
+            break;
+        case 'w':
+            sz_workloads = optarg;
+            break;
+        case 'n':
+            opts.count = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            opts.window = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            opts.block = strtoul(optarg, NULL, 0);
+            break;
+        case 'z':
+            opts.size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+            break;
+        case 'p':
+            opts.use_pipes = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s server] [-d dir] [-w workload,...] [-n count] "
+                "[-q outstanding] [-b block] [-z megabytes] [-p] [-- server arguments]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.window < 1 || opts.window > MAX_WINDOW || opts.block < 1 || opts.block > MAX_BLOCK
+        || opts.count < 1 || opts.size < opts.block)
+    {
+        fprintf(stderr, "Bad parameters: need 1 <= outstanding <= %d, 1 <= block <= %d, "
+            "count >= 1, size >= block\n", MAX_WINDOW, MAX_BLOCK);
+        return EXIT_FAILURE;
+    }
+
+    if (opts.sz_dir[0] == '\0')
+    {
+        strcpy(opts.sz_dir, "/tmp/nih-sftp-bench.XXXXXX");
+        if (!mkdtemp(opts.sz_dir))
+        {
+            perror("mkdtemp()");
+            return EXIT_FAILURE;
+        }
+        remove_dir = 1;
+    }
+    else
+    {
+        /* Clients send absolute paths */
+        char *sz_real = realpath(opts.sz_dir, NULL);
+
+        if (!sz_real || strlen(sz_real) >= sizeof(opts.sz_dir))
+        {
+            fprintf(stderr, "%s: %s\n", opts.sz_dir, sz_real ? "path too long" : strerror(errno));
+            free(sz_real);
+            return EXIT_FAILURE;
+        }
+        snprintf(opts.sz_dir, sizeof(opts.sz_dir), "%s", sz_real);
+        free(sz_real);
+    }
+
+    /* Server argv: its path then anything after -- */
+    server_argv = calloc(argc - optind + 2, sizeof(*server_argv));
+    if (!server_argv)
+    {
+        return EXIT_FAILURE;
+    }
+    server_argv[0] = (char *)opts.sz_server;
+    for (i = optind; i < argc; i++)
+    {
+        server_argv[i - optind + 1] = argv[i];
+    }
+
+    for (i = 0; i < MAX_BLOCK; i++)
+    {
+        block_data[i] = (uint8_t)(rand() >> 7);
+    }
+
+    printf("%-10s %10s %12s %10s %10s %10s %10s %10s\n",
+        "workload", "requests", "requests/s", "MB/s", "p50 us", "p90 us", "p99 us", "max us");
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        const char *sz_match = strstr(sz_workloads, workloads[w].sz_name);
+        size_t len = strlen(workloads[w].sz_name);
+        bench_t bench;
+        uint64_t start;
+
+        if (strcmp(sz_workloads, "all") != 0
+            && !(sz_match && (sz_match == sz_workloads || sz_match[-1] == ',')
+                && (sz_match[len] == '\0' || sz_match[len] == ',')))
+        {
+            continue;
+        }
+
+        memset(&bench, 0, sizeof(bench));
+        if (client_spawn(&bench.client, opts.sz_server, server_argv, NULL, opts.use_pipes) < 0
+            || client_init(&bench.client, 3) < 0)
+        {
+            fprintf(stderr, "Can't start %s\n", opts.sz_server);
+            return EXIT_FAILURE;
+        }
+
+        start = client_now_ns();
+        if (workloads[w].run(&bench, &opts) < 0)
+        {
+            fprintf(stderr, "%s failed\n", workloads[w].sz_name);
+            failures++;
+        }
+        else
+        {
+            report(&bench, workloads[w].sz_name, client_now_ns() - start);
+        }
+        if (client_close(&bench.client) != 0)
+        {
+            fprintf(stderr, "%s: server exited with an error\n", workloads[w].sz_name);
+            failures++;
+        }
+        free(bench.p_latency);
+    }
+
+    if (remove_dir)
+    {
+        nftw(opts.sz_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    free(server_argv);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Sequential pipelined WRITEs */
+static int run_upload(bench_t *p_bench, const options_t *p_opts)
+{
+    char sz_path[PATH_MAX];
+    char handle[MAX_HANDLE_LEN];
+    uint32_t handle_len;
+    uint64_t offset = 0;
+
+    snprintf(sz_path, sizeof(sz_path), "%s/data", p_opts->sz_dir);
+    if (bench_open(p_bench, SSH_FXP_OPEN, sz_path, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
+        handle, &handle_len) < 0)
+    {
+        return -1;
+    }
+    while (offset < p_opts->size || p_bench->outstanding > 0)
+    {
+        const uint8_t *p_reply;
+        uint32_t len;
+
+        while (offset < p_opts->size && p_bench->outstanding < p_opts->window)
+        {
+            uint32_t block = p_opts->size - offset < p_opts->block ? (uint32_t)(p_opts->size - offset) : p_opts->block;
+
+            bench_begin(p_bench, SSH_FXP_WRITE);
+            packet_string(&packet, handle, handle_len);
+            packet_uint64(&packet, offset);
+            packet_string(&packet, block_data, block);
+            if (bench_send(p_bench) < 0)
+            {
+                return -1;
+            }
+            offset += block;
+            p_bench->bytes += block;
+        }
+        p_reply = bench_reply(p_bench, &len);
+        if (check_status(p_reply, len, "WRITE") < 0)
+        {
+            return -1;
+        }
+    }
+    return bench_close(p_bench, handle, handle_len);
+}
+
+/* Sequential pipelined READs */
+static int run_download(bench_t *p_bench, const options_t *p_opts)
+{
+    char sz_path[PATH_MAX];
+    char handle[MAX_HANDLE_LEN];
+    uint32_t handle_len;
+    uint64_t offset = 0;
+    int eof = 0;
+
+    if (make_data_file(p_opts) < 0)
+    {
+        return -1;
+    }
+    snprintf(sz_path, sizeof(sz_path), "%s/data", p_opts->sz_dir);
+    if (bench_open(p_bench, SSH_FXP_OPEN, sz_path, SSH_FXF_READ, handle, &handle_len) < 0)
+    {
+        return -1;
+    }
+    while ((!eof && offset < p_opts->size) || p_bench->outstanding > 0)
+    {
+        const uint8_t *p_reply;
+        uint32_t len;
+
+        while (!eof && offset < p_opts->size && p_bench->outstanding < p_opts->window)
+        {
+            bench_begin(p_bench, SSH_FXP_READ);
+            packet_string(&packet, handle, handle_len);
+            packet_uint64(&packet, offset);
+            packet_uint32(&packet, p_opts->block);
+            if (bench_send(p_bench) < 0)
+            {
+                return -1;
+            }
+            offset += p_opts->block;
+        }
+        p_reply = bench_reply(p_bench, &len);
+        if (!p_reply)
+        {
+            return -1;
+        }
+        if (p_reply[0] == SSH_FXP_DATA && len >= 9)
+        {
+            p_bench->bytes += reply_uint32(&p_reply[5]);
+        }
+        else if (p_reply[0] == SSH_FXP_STATUS && len >= 9 && reply_uint32(&p_reply[5]) == SSH_FX_EOF)
+        {
+            eof = 1;
+        }
+        else
+        {
+            return check_status(p_reply, len, "READ");
+        }
+    }
+    return bench_close(p_bench, handle, handle_len);
+}
+
+/* Pipelined READs at random offsets */
+static int run_randread(bench_t *p_bench, const options_t *p_opts)
+{
+    char sz_path[PATH_MAX];
+    char handle[MAX_HANDLE_LEN];
+    uint32_t handle_len;
+    uint64_t blocks = p_opts->size / p_opts->block;
+    uint32_t sent = 0;
+
+    if (make_data_file(p_opts) < 0)
+    {
+        return -1;
+    }
+    snprintf(sz_path, sizeof(sz_path), "%s/data", p_opts->sz_dir);
+    if (bench_open(p_bench, SSH_FXP_OPEN, sz_path, SSH_FXF_READ, handle, &handle_len) < 0)
+    {
+        return -1;
+    }
+    srand(1);
+    while (sent < p_opts->count || p_bench->outstanding > 0)
+    {
+        const uint8_t *p_reply;
+        uint32_t len;
+
+        while (sent < p_opts->count && p_bench->outstanding < p_opts->window)
+        {
+            uint64_t block = (((uint64_t)rand() << 16) ^ (uint64_t)rand()) % blocks;
+
+            bench_begin(p_bench, SSH_FXP_READ);
+            packet_string(&packet, handle, handle_len);
+            packet_uint64(&packet, block * p_opts->block);
+            packet_uint32(&packet, p_opts->block);
+            if (bench_send(p_bench) < 0)
+            {
+                return -1;
+            }
+            sent++;
+        }
+        p_reply = bench_reply(p_bench, &len);
+        if (!p_reply || p_reply[0] != SSH_FXP_DATA || len < 9)
+        {
+            check_status(p_reply, len, "READ");
+            return -1;
+        }
+        p_bench->bytes += reply_uint32(&p_reply[5]);
+    }
+    return bench_close(p_bench, handle, handle_len);
+}
+
+/* Create files: OPENs are pipelined and each handle is CLOSEd as it arrives */
+static int run_create(bench_t *p_bench, const options_t *p_opts)
+{
+    char sz_path[PATH_MAX];
+    uint32_t window = p_opts->window < MAX_CREATE_WINDOW ? p_opts->window : MAX_CREATE_WINDOW;
+    uint32_t opened = 0;
+
+    snprintf(sz_path, sizeof(sz_path), "%s/create", p_opts->sz_dir);
+    if (mkdir(sz_path, 0777) < 0 && errno != EEXIST)
+    {
+        perror(sz_path);
+        return -1;
+    }
+    while (opened < p_opts->count || p_bench->outstanding > 0)
+    {
+        const uint8_t *p_reply;
+        uint32_t len;
+
+        while (opened < p_opts->count && p_bench->outstanding < window)
+        {
+            snprintf(sz_path, sizeof(sz_path), "%s/create/f%lu", p_opts->sz_dir, (unsigned long)opened);
+            bench_begin(p_bench, SSH_FXP_OPEN);
+            packet_cstring(&packet, sz_path);
+            packet_uint32(&packet, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC);
+            packet_uint32(&packet, 0);
+            if (bench_send(p_bench) < 0)
+            {
+                return -1;
+            }
+            opened++;
+        }
+        p_reply = bench_reply(p_bench, &len);
+        if (!p_reply)
+        {
+            return -1;
+        }
+        if (p_reply[0] == SSH_FXP_HANDLE && len >= 9)
+        {
+            /* Close it straight away; the handle is in the reply buffer which
+            is reused by the next receive, so copy it into the request first */
+            bench_begin(p_bench, SSH_FXP_CLOSE);
+            packet_string(&packet, &p_reply[9], reply_uint32(&p_reply[5]));
+            if (bench_send(p_bench) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (check_status(p_reply, len, "OPEN/CLOSE") < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* List a large directory */
+static int run_readdir(bench_t *p_bench, const options_t *p_opts)
+{
+    char sz_path[PATH_MAX];
+    char handle[MAX_HANDLE_LEN];
+    uint32_t handle_len;
+
+    if (make_dir_files(p_opts) < 0)
+    {
+        return -1;
+    }
+    snprintf(sz_path, sizeof(sz_path), "%s/dir", p_opts->sz_dir);
+    if (bench_open(p_bench, SSH_FXP_OPENDIR, sz_path, 0, handle, &handle_len) < 0)
+    {
+        return -1;
+    }
+    for (;;)
+    {
+        const uint8_t *p_reply;
+        uint32_t len;
+
+        bench_begin(p_bench, SSH_FXP_READDIR);
+        packet_string(&packet, handle, handle_len);
+        p_reply = bench_call(p_bench, &len);
+        if (!p_reply)
+        {
+            return -1;
+        }
+        if (p_reply[0] == SSH_FXP_NAME && len >= 9)
+        {
+            /* Listing throughput is measured in reply bytes */
+            p_bench->bytes += len;
+            continue;
+        }
+        if (p_reply[0] == SSH_FXP_STATUS && len >= 9 && reply_uint32(&p_reply[5]) == SSH_FX_EOF)
+        {
+            break;
+        }
+        return check_status(p_reply, len, "READDIR");
+    }
+    return bench_close(p_bench, handle, handle_len);
+}
+
+/* Pipelined STATs of files in the directory */
+static int run_stat(bench_t *p_bench, const options_t *p_opts)
+{
+    char sz_path[PATH_MAX];
+    uint32_t sent = 0;
+
+    if (make_dir_files(p_opts) < 0)
+    {
+        return -1;
+    }
+    while (sent < p_opts->count || p_bench->outstanding > 0)
+    {
+        const uint8_t *p_reply;
+        uint32_t len;
+
+        while (sent < p_opts->count && p_bench->outstanding < p_opts->window)
+        {
+            snprintf(sz_path, sizeof(sz_path), "%s/dir/f%lu", p_opts->sz_dir, (unsigned long)sent);
+            bench_begin(p_bench, SSH_FXP_STAT);
+            packet_cstring(&packet, sz_path);
+            if (bench_send(p_bench) < 0)
+            {
+                return -1;
+            }
+            sent++;
+        }
+        p_reply = bench_reply(p_bench, &len);
+        if (!p_reply || p_reply[0] != SSH_FXP_ATTRS)
+        {
+            check_status(p_reply, len, "STAT");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Start building a request in the packet buffer. Returns its id */
+static uint32_t bench_begin(bench_t *p_bench, uint8_t type)
+{
+    uint32_t id = p_bench->next_id++;
+
+    packet_begin(&packet, type, id);
+    return id;
+}
+
+static int bench_send(bench_t *p_bench)
+{
+    /* The id follows the length and type */
+    uint32_t id = reply_uint32(&packet.data[5]);
+
+    p_bench->sent_ns[id & (MAX_WINDOW - 1)] = client_now_ns();
+    p_bench->outstanding++;
+    return client_send(&p_bench->client, &packet);
+}
+
+/* Receive a reply and record its latency */
+static const uint8_t *bench_reply(bench_t *p_bench, uint32_t *p_len)
+{
+    const uint8_t *p_reply = client_recv(&p_bench->client, p_len);
+    uint64_t now = client_now_ns();
+
+    if (!p_reply || *p_len < 5)
+    {
+        fprintf(stderr, "Lost connection to server\n");
+        return NULL;
+    }
+    if (p_bench->latency_count == p_bench->latency_size)
+    {
+        size_t size = p_bench->latency_size ? p_bench->latency_size * 2 : 4096;
+        uint64_t *p_new = realloc(p_bench->p_latency, size * sizeof(*p_new));
+
+        if (!p_new)
+        {
+            return NULL;
+        }
+        p_bench->p_latency = p_new;
+        p_bench->latency_size = size;
+    }
+    p_bench->p_latency[p_bench->latency_count++] =
+        now - p_bench->sent_ns[reply_uint32(&p_reply[1]) & (MAX_WINDOW - 1)];
+    p_bench->outstanding--;
+    p_bench->ops++;
+    return p_reply;
+}
+
+static const uint8_t *bench_call(bench_t *p_bench, uint32_t *p_len)
+{
+    if (bench_send(p_bench) < 0)
+    {
+        return NULL;
+    }
+    return bench_reply(p_bench, p_len);
+}
+
+static int bench_open(bench_t *p_bench, uint8_t type, const char *sz_path, uint32_t pflags,
+    char *p_handle, uint32_t *p_handle_len)
+{
+    const uint8_t *p_reply;
+    uint32_t len;
+
+    bench_begin(p_bench, type);
+    packet_cstring(&packet, sz_path);
+    if (type == SSH_FXP_OPEN)
+    {
+        packet_uint32(&packet, pflags);
+        packet_uint32(&packet, 0);  /* No attrs */
+    }
+    p_reply = bench_call(p_bench, &len);
+    if (!p_reply || p_reply[0] != SSH_FXP_HANDLE || len < 9
+        || reply_uint32(&p_reply[5]) > MAX_HANDLE_LEN || len < 9 + reply_uint32(&p_reply[5]))
+    {
+        check_status(p_reply, len, sz_path);
+        return -1;
+    }
+    *p_handle_len = reply_uint32(&p_reply[5]);
+    memcpy(p_handle, &p_reply[9], *p_handle_len);
+    return 0;
+}
+
+static int bench_close(bench_t *p_bench, const char *p_handle, uint32_t handle_len)
+{
+    const uint8_t *p_reply;
+    uint32_t len;
+
+    bench_begin(p_bench, SSH_FXP_CLOSE);
+    packet_string(&packet, p_handle, handle_len);
+    p_reply = bench_call(p_bench, &len);
+    return check_status(p_reply, len, "CLOSE");
+}
+
+/* Returns 0 for a STATUS of OK, otherwise reports the problem and returns -1 */
+static int check_status(const uint8_t *p_reply, uint32_t len, const char *sz_what)
+{
+    if (!p_reply)
+    {
+        return -1;
+    }
+    if (p_reply[0] != SSH_FXP_STATUS || len < 9)
+    {
+        fprintf(stderr, "%s: unexpected reply type %u\n", sz_what, p_reply[0]);
+        return -1;
+    }
+    if (reply_uint32(&p_reply[5]) != SSH_FX_OK)
+    {
+        fprintf(stderr, "%s: status %lu\n", sz_what, (unsigned long)reply_uint32(&p_reply[5]));
+        return -1;
+    }
+    return 0;
+}
+
+static void report(bench_t *p_bench, const char *sz_name, uint64_t elapsed_ns)
+{
+    double seconds = elapsed_ns / 1e9;
+    uint64_t *p_lat = p_bench->p_latency;
+    size_t n = p_bench->latency_count;
+
+    if (n == 0)
+    {
+        return;
+    }
+    qsort(p_lat, n, sizeof(*p_lat), compare_uint64);
+    printf("%-10s %10lu %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+        sz_name, (unsigned long)p_bench->ops, p_bench->ops / seconds,
+        p_bench->bytes / seconds / (1024 * 1024),
+        p_lat[n / 2] / 1e3, p_lat[n * 9 / 10] / 1e3, p_lat[n * 99 / 100] / 1e3, p_lat[n - 1] / 1e3);
+}
+
+static int compare_uint64(const void *p_a, const void *p_b)
+{
+    uint64_t a = *(const uint64_t *)p_a;
+    uint64_t b = *(const uint64_t *)p_b;
+
+    return a < b ? -1 : a > b;
+}
+
+/* Make sure the data file exists at full size, without going through the
+server (and so without timing it) */
+static int make_data_file(const options_t *p_opts)
+{
+    char sz_path[PATH_MAX];
+    struct stat st;
+    uint64_t offset;
+    int fd;
+
+    snprintf(sz_path, sizeof(sz_path), "%s/data", p_opts->sz_dir);
+    if (stat(sz_path, &st) == 0 && (uint64_t)st.st_size >= p_opts->size)
+    {
+        return 0;
+    }
+    fd = open(sz_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        perror(sz_path);
+        return -1;
+    }
+    for (offset = 0; offset < p_opts->size; offset += MAX_BLOCK)
+    {
+        size_t len = p_opts->size - offset < MAX_BLOCK ? (size_t)(p_opts->size - offset) : MAX_BLOCK;
+
+        if (write(fd, block_data, len) != (ssize_t)len)
+        {
+            perror(sz_path);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/* Make sure dir/f0 .. dir/f<count-1> exist */
+static int make_dir_files(const options_t *p_opts)
+{
+    char sz_path[PATH_MAX];
+    uint32_t i;
+
+    snprintf(sz_path, sizeof(sz_path), "%s/dir", p_opts->sz_dir);
+    if (mkdir(sz_path, 0777) < 0 && errno != EEXIST)
+    {
+        perror(sz_path);
+        return -1;
+    }
+    for (i = 0; i < p_opts->count; i++)
+    {
+        int fd;
+
+        snprintf(sz_path, sizeof(sz_path), "%s/dir/f%lu", p_opts->sz_dir, (unsigned long)i);
+        fd = open(sz_path, O_WRONLY | O_CREAT, 0666);
+        if (fd < 0)
+        {
+            perror(sz_path);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static int remove_entry(const char *sz_path, const struct stat *p_st, int flag, struct FTW *p_ftw)
+{
+    (void)p_st;
+    (void)flag;
+    (void)p_ftw;
+    return remove(sz_path) < 0 ? -1 : 0;
+}
+/* End of file */
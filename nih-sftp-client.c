@@ -0,0 +1,277 @@
+/* Minimal SFTP client used by the benchmark and replay tools. See
+nih-sftp-client.h */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "nih-sftp-client.h"
+
+static int read_fully(int fd, uint8_t *p_data, uint32_t len);
+static int write_fully(int fd, const uint8_t *p_data, uint32_t len);
+
+int client_spawn(sftp_client_t *p_client, const char *sz_server, char *const argv[],
+    const char *sz_dir, int use_pipes)
+{
+    int child_in, child_out;
+    int fds[2];
+
+    memset(p_client, 0, sizeof(*p_client));
+    if (use_pipes)
+    {
+        int in_pipe[2], out_pipe[2];
+
+        if (pipe(in_pipe) < 0)
+        {
+            return -1;
+        }
+        if (pipe(out_pipe) < 0)
+        {
+            close(in_pipe[0]);
+            close(in_pipe[1]);
+            return -1;
+        }
+        child_in = in_pipe[0];
+        p_client->to_server = in_pipe[1];
+        child_out = out_pipe[1];
+        p_client->from_server = out_pipe[0];
+    }
+    else
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        {
+            return -1;
+        }
+        child_in = child_out = fds[1];
+        p_client->to_server = p_client->from_server = fds[0];
+    }
+
+    p_client->pid = fork();
+    if (p_client->pid < 0)
+    {
+        return -1;
+    }
+    if (p_client->pid == 0)
+    {
+        /* Our ends must go or the server never sees EOF */
+        close(p_client->to_server);
+        if (p_client->from_server != p_client->to_server)
+        {
+            close(p_client->from_server);
+        }
+        if (dup2(child_in, STDIN_FILENO) < 0 || dup2(child_out, STDOUT_FILENO) < 0)
+        {
+            _exit(127);
+        }
+        if (sz_dir && chdir(sz_dir) < 0)
+        {
+            perror(sz_dir);
+            _exit(127);
+        }
+        execv(sz_server, argv);
+        perror(sz_server);
+        _exit(127);
+    }
+
+    close(child_in);
+    if (child_out != child_in)
+    {
+        close(child_out);
+    }
+    return 0;
+}
+
+int client_init(sftp_client_t *p_client, uint32_t version)
+{
+    static sftp_packet_t packet;
+    const uint8_t *p_reply;
+    uint32_t len;
+
+    /* INIT has a version where other requests have an id */
+    packet_begin(&packet, SSH_FXP_INIT, version);
+    if (client_send(p_client, &packet) < 0)
+    {
+        return -1;
+    }
+    p_reply = client_recv(p_client, &len);
+    if (!p_reply || len < 5 || p_reply[0] != SSH_FXP_VERSION)
+    {
+        return -1;
+    }
+    p_client->version = reply_uint32(&p_reply[1]);
+    return 0;
+}
+
+int client_send(sftp_client_t *p_client, sftp_packet_t *p_packet)
+{
+    uint32_t payload_len = p_packet->len - 4;
+
+    p_packet->data[0] = (uint8_t)(payload_len >> 24);
+    p_packet->data[1] = (uint8_t)(payload_len >> 16);
+    p_packet->data[2] = (uint8_t)(payload_len >> 8);
+    p_packet->data[3] = (uint8_t)payload_len;
+    return write_fully(p_client->to_server, p_packet->data, p_packet->len);
+}
+
+int client_send_raw(sftp_client_t *p_client, const uint8_t *p_data, uint32_t len)
+{
+    return write_fully(p_client->to_server, p_data, len);
+}
+
+const uint8_t *client_recv(sftp_client_t *p_client, uint32_t *p_len)
+{
+    uint8_t header[4];
+    uint32_t len;
+
+    if (read_fully(p_client->from_server, header, sizeof(header)) < 0)
+    {
+        return NULL;
+    }
+    len = reply_uint32(header);
+    if (len > p_client->reply_size)
+    {
+        uint8_t *p_new = realloc(p_client->p_reply, len);
+
+        if (!p_new)
+        {
+            return NULL;
+        }
+        p_client->p_reply = p_new;
+        p_client->reply_size = len;
+    }
+    if (read_fully(p_client->from_server, p_client->p_reply, len) < 0)
+    {
+        return NULL;
+    }
+    *p_len = len;
+    return p_client->p_reply;
+}
+
+int client_close(sftp_client_t *p_client)
+{
+    int status = 0;
+
+    close(p_client->to_server);
+    if (p_client->from_server != p_client->to_server)
+    {
+        close(p_client->from_server);
+    }
+    while (waitpid(p_client->pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    free(p_client->p_reply);
+    p_client->p_reply = NULL;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void packet_begin(sftp_packet_t *p_packet, uint8_t type, uint32_t id)
+{
+    /* Leave room for the length */
+    p_packet->len = 4;
+    packet_byte(p_packet, type);
+    packet_uint32(p_packet, id);
+}
+
+void packet_byte(sftp_packet_t *p_packet, uint8_t data)
+{
+    assert(p_packet->len < sizeof(p_packet->data));
+    p_packet->data[p_packet->len++] = data;
+}
+
+void packet_uint32(sftp_packet_t *p_packet, uint32_t data)
+{
+    assert(p_packet->len + 4 <= sizeof(p_packet->data));
+    p_packet->data[p_packet->len++] = (uint8_t)(data >> 24);
+    p_packet->data[p_packet->len++] = (uint8_t)(data >> 16);
+    p_packet->data[p_packet->len++] = (uint8_t)(data >> 8);
+    p_packet->data[p_packet->len++] = (uint8_t)data;
+}
+
+void packet_uint64(sftp_packet_t *p_packet, uint64_t data)
+{
+    packet_uint32(p_packet, (uint32_t)(data >> 32));
+    packet_uint32(p_packet, (uint32_t)data);
+}
+
+void packet_string(sftp_packet_t *p_packet, const void *p_data, uint32_t len)
+{
+    packet_uint32(p_packet, len);
+    assert(p_packet->len + len <= sizeof(p_packet->data));
+    memcpy(&p_packet->data[p_packet->len], p_data, len);
+    p_packet->len += len;
+}
+
+void packet_cstring(sftp_packet_t *p_packet, const char *sz_str)
+{
+    packet_string(p_packet, sz_str, strlen(sz_str));
+}
+
+uint32_t reply_uint32(const uint8_t *p_data)
+{
+    return ((uint32_t)p_data[0] << 24) | ((uint32_t)p_data[1] << 16)
+        | ((uint32_t)p_data[2] << 8) | p_data[3];
+}
+
+uint64_t reply_uint64(const uint8_t *p_data)
+{
+    return ((uint64_t)reply_uint32(p_data) << 32) | reply_uint32(&p_data[4]);
+}
+
+uint64_t client_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int read_fully(int fd, uint8_t *p_data, uint32_t len)
+{
+    while (len > 0)
+    {
+        ssize_t temp = read(fd, p_data, len);
+
+        if (temp < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (temp <= 0)
+        {
+            return -1;
+        }
+        p_data += temp;
+        len -= temp;
+    }
+    return 0;
+}
+
+static int write_fully(int fd, const uint8_t *p_data, uint32_t len)
+{
+    while (len > 0)
+    {
+        ssize_t temp = write(fd, p_data, len);
+
+        if (temp < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (temp <= 0)
+        {
+            return -1;
+        }
+        p_data += temp;
+        len -= temp;
+    }
+    return 0;
+}
+/* End of file */
@@ -0,0 +1,67 @@
+#ifndef _NIH_SFTP_CLIENT_H_
+#define _NIH_SFTP_CLIENT_H_
+
+/* Minimal SFTP client used by the benchmark and replay tools. It runs the
+server as a child process connected by a socketpair (as sshd usually does)
+or a pair of pipes, and exchanges raw packets with it */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "nih-sftp-server.h"
+
+/* Large enough for any request the tools build */
+#define CLIENT_MAX_REQUEST (1024 * 1024)
+
+typedef struct sftp_client_tag
+{
+    pid_t pid;
+    int to_server;
+    int from_server;
+    uint32_t version;       /* Negotiated by client_init() */
+    uint8_t *p_reply;       /* Last reply, grown as needed */
+    uint32_t reply_size;
+} sftp_client_t;
+
+/* Outgoing packet. The length field is filled in by client_send() */
+typedef struct sftp_packet_tag
+{
+    uint32_t len;
+    uint8_t data[CLIENT_MAX_REQUEST];
+} sftp_packet_t;
+
+/* Start sz_server with the given argv (argv[0] included, NULL terminated) in
+directory sz_dir (NULL for ours). Returns 0 or -1 with errno set */
+int client_spawn(sftp_client_t *p_client, const char *sz_server, char *const argv[],
+    const char *sz_dir, int use_pipes);
+
+/* INIT/VERSION exchange. Returns 0 or -1 */
+int client_init(sftp_client_t *p_client, uint32_t version);
+
+/* Send a packet, or raw bytes which already include the length. Return 0 or -1 */
+int client_send(sftp_client_t *p_client, sftp_packet_t *p_packet);
+int client_send_raw(sftp_client_t *p_client, const uint8_t *p_data, uint32_t len);
+
+/* Receive one reply. Returns a pointer to the payload (type byte first) valid
+until the next call, or NULL on EOF or error */
+const uint8_t *client_recv(sftp_client_t *p_client, uint32_t *p_len);
+
+/* Close our end and wait for the server to exit. Returns its exit status */
+int client_close(sftp_client_t *p_client);
+
+/* Packet building */
+void packet_begin(sftp_packet_t *p_packet, uint8_t type, uint32_t id);
+void packet_byte(sftp_packet_t *p_packet, uint8_t data);
+void packet_uint32(sftp_packet_t *p_packet, uint32_t data);
+void packet_uint64(sftp_packet_t *p_packet, uint64_t data);
+void packet_string(sftp_packet_t *p_packet, const void *p_data, uint32_t len);
+void packet_cstring(sftp_packet_t *p_packet, const char *sz_str);
+
+/* Reply parsing */
+uint32_t reply_uint32(const uint8_t *p_data);
+uint64_t reply_uint64(const uint8_t *p_data);
+
+/* Monotonic clock in nanoseconds */
+uint64_t client_now_ns(void);
+
+#endif // _NIH_SFTP_CLIENT_H_
@@ -0,0 +1,608 @@
+/* Replays a request trace recorded with "nih-sftp-server -T" against a
+server running on a scratch directory, either with the original timing or
+(-m) as fast as the server will go with up to -q requests outstanding.
+
+usage: nih-sftp-replay [-s server] [-d dir] [-m] [-q outstanding] [-v] trace
+                       [-- server arguments]
+
+Absolute paths in requests are moved under dir (default a new directory in
+/tmp, removed afterwards) and the server is started in dir plus the original
+working directory, so relative paths land in the same place. dir should hold
+a copy of whatever files the trace expects to exist. Replies whose type or
+status differ from the recorded ones are counted (and with -v, listed) since
+they mean the replay isn't doing the same work as the original session.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "nih-sftp-client.h"
+
+/* Requests in flight when replaying with the original timing. Must be a
+power of 2 */
+#define MAX_IN_FLIGHT 4096
+#define DEFAULT_WINDOW 16
+#define MAX_DIVERGENCES_SHOWN 20
+
+typedef struct record_tag
+{
+    uint64_t arrival_ns;
+    uint32_t handled_ns;
+    uint8_t reply_type;
+    uint32_t reply_status;
+    uint32_t len;
+    const uint8_t *p_packet;
+} record_t;
+
+typedef struct expected_tag
+{
+    uint32_t record;
+    uint32_t id;
+    uint8_t answered;
+    uint64_t sent_ns;
+} expected_t;
+
+/* Extensions whose first arguments are paths */
+typedef struct path_extension_tag
+{
+    const char *sz_name;
+    unsigned paths;
+} path_extension_t;
+
+static uint8_t *load_trace(const char *sz_file, size_t *p_size);
+static record_t *parse_trace(const uint8_t *p_trace, size_t size, char *sz_cwd, uint32_t *p_count);
+static void build_request(const record_t *p_record, const char *sz_root, sftp_packet_t *p_packet);
+static unsigned request_paths(const uint8_t *p_packet, uint32_t len, uint32_t *p_offset);
+static int copy_string(const uint8_t *p_data, uint32_t len, uint32_t *p_offset,
+    const char *sz_root, sftp_packet_t *p_packet);
+static int mkdir_parents(const char *sz_path);
+static uint32_t find_expected(const record_t *p_records, uint32_t head, uint32_t tail,
+    const uint8_t *p_reply, uint32_t len);
+static int compare_uint64(const void *p_a, const void *p_b);
+static int remove_entry(const char *sz_path, const struct stat *p_st, int flag, struct FTW *p_ftw);
+
+static const path_extension_t path_extensions[] =
+{
+    { "remove-recursive@eddylangley.net", 1 },
+    { "mkdir-parents@eddylangley.net", 1 },
+    { "expand-path@openssh.com", 1 },
+    { "statvfs@openssh.com", 1 },
+    { "lsetstat@openssh.com", 1 },
+    { "posix-rename@openssh.com", 2 },
+    { "hardlink@openssh.com", 2 }
+};
+
+static sftp_packet_t packet;
+static expected_t expected[MAX_IN_FLIGHT];
+
+int main(int argc, char **argv)
+{
+    const char *sz_server = NULL;
+    char sz_default_server[PATH_MAX];
+    char sz_root[PATH_MAX];
+    char sz_cwd[PATH_MAX];
+    char sz_session_dir[2 * PATH_MAX];
+    char **server_argv;
+    uint8_t *p_trace;
+    size_t trace_size;
+    record_t *p_records;
+    uint32_t count;
+    uint32_t window = DEFAULT_WINDOW;
+    uint32_t next = 0, head = 0, tail = 0;
+    uint32_t divergences = 0;
+    uint64_t *p_latency;
+    uint32_t latency_count = 0;
+    uint64_t start, elapsed;
+    int max_speed = 0;
+    int verbose = 0;
+    int remove_dir = 0;
+    int status = EXIT_SUCCESS;
+    int opt, i;
+
+    sz_root[0] = '\0';
+    snprintf(sz_default_server, sizeof(sz_default_server), "%.*s%s",
+        strrchr(argv[0], '/') ? (int)(strrchr(argv[0], '/') - argv[0] + 1) : 0, argv[0], "nih-sftp-server");
+    sz_server = sz_default_server;
+
+    while ((opt = getopt(argc, argv, "s:d:mq:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            sz_server = optarg;
+            break;
+        case 'd':
+            if (!realpath(optarg, sz_root))
+            {
+                perror(optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            max_speed = 1;
+            break;
+        case 'q':
+            window = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc || window < 1 || window > MAX_IN_FLIGHT)
+    {
+        fprintf(stderr, "usage: %s [-s server] [-d dir] [-m] [-q outstanding (1-%d)] [-v] trace "
+            "[-- server arguments]\n", argv[0], MAX_IN_FLIGHT);
+        return EXIT_FAILURE;
+    }
+    if (!max_speed)
+    {
+        window = MAX_IN_FLIGHT;
+    }
+
+    p_trace = load_trace(argv[optind], &trace_size);
+    if (!p_trace)
+    {
+        return EXIT_FAILURE;
+    }
+    p_records = parse_trace(p_trace, trace_size, sz_cwd, &count);
+    if (!p_records)
+    {
+        fprintf(stderr, "%s: not a trace, or truncated\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if (sz_root[0] == '\0')
+    {
+        strcpy(sz_root, "/tmp/nih-sftp-replay.XXXXXX");
+        if (!mkdtemp(sz_root))
+        {
+            perror("mkdtemp()");
+            return EXIT_FAILURE;
+        }
+        remove_dir = 1;
+    }
+    snprintf(sz_session_dir, sizeof(sz_session_dir), "%s%s", sz_root, sz_cwd);
+    if (mkdir_parents(sz_session_dir) < 0)
+    {
+        perror(sz_session_dir);
+        return EXIT_FAILURE;
+    }
+
+    /* Server argv: its path then anything after the trace file */
+    server_argv = calloc(argc - optind + 1, sizeof(*server_argv));
+    p_latency = malloc((count ? count : 1) * sizeof(*p_latency));
+    if (!server_argv || !p_latency)
+    {
+        return EXIT_FAILURE;
+    }
+    server_argv[0] = (char *)sz_server;
+    for (i = optind + 1; i < argc; i++)
+    {
+        server_argv[i - optind] = argv[i];
+    }
+
+    {
+        sftp_client_t client;
+
+        if (client_spawn(&client, sz_server, server_argv, sz_session_dir, 0) < 0)
+        {
+            perror(sz_server);
+            return EXIT_FAILURE;
+        }
+
+        start = client_now_ns();
+        while (next < count || head != tail)
+        {
+            uint64_t now = client_now_ns();
+            int timeout = -1;
+
+            if (next < count && tail - head < window)
+            {
+                const record_t *p_record = &p_records[next];
+
+                if (max_speed || now - start >= p_record->arrival_ns)
+                {
+                    build_request(p_record, sz_root, &packet);
+                    if (client_send(&client, &packet) < 0)
+                    {
+                        fprintf(stderr, "Lost connection to server\n");
+                        status = EXIT_FAILURE;
+                        break;
+                    }
+                    if (p_record->reply_type != 0)
+                    {
+                        expected_t *p_expected = &expected[tail & (MAX_IN_FLIGHT - 1)];
+
+                        p_expected->record = next;
+                        p_expected->id = p_record->len >= 5 ? reply_uint32(&p_record->p_packet[1]) : 0;
+                        p_expected->answered = 0;
+                        p_expected->sent_ns = client_now_ns();
+                        tail++;
+                    }
+                    next++;
+                    continue;
+                }
+                timeout = (int)((p_record->arrival_ns - (now - start) + 999999) / 1000000);
+            }
+
+            /* Wait for a reply, or until the next request is due */
+            if (head == tail)
+            {
+                struct timespec ts;
+
+                ts.tv_sec = timeout / 1000;
+                ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+                nanosleep(&ts, NULL);
+                continue;
+            }
+            {
+                struct pollfd pfd;
+                const uint8_t *p_reply;
+                const record_t *p_record;
+                expected_t *p_expected;
+                uint32_t len, slot, reply_status = 0;
+
+                pfd.fd = client.from_server;
+                pfd.events = POLLIN;
+                if (poll(&pfd, 1, timeout) <= 0)
+                {
+                    continue;
+                }
+                p_reply = client_recv(&client, &len);
+                if (!p_reply || len < 1)
+                {
+                    fprintf(stderr, "Lost connection to server\n");
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                slot = find_expected(p_records, head, tail, p_reply, len);
+                if (slot == tail)
+                {
+                    if (verbose && divergences < MAX_DIVERGENCES_SHOWN)
+                    {
+                        fprintf(stderr, "Reply %u matches no outstanding request\n", p_reply[0]);
+                    }
+                    divergences++;
+                    continue;
+                }
+                p_expected = &expected[slot & (MAX_IN_FLIGHT - 1)];
+                p_expected->answered = 1;
+                p_record = &p_records[p_expected->record];
+                p_latency[latency_count++] = client_now_ns() - p_expected->sent_ns;
+                while (head != tail && expected[head & (MAX_IN_FLIGHT - 1)].answered)
+                {
+                    head++;
+                }
+
+                if (p_reply[0] == SSH_FXP_STATUS && len >= 9)
+                {
+                    reply_status = reply_uint32(&p_reply[5]);
+                }
+                if (p_reply[0] != p_record->reply_type || reply_status != p_record->reply_status)
+                {
+                    if (verbose && divergences < MAX_DIVERGENCES_SHOWN)
+                    {
+                        fprintf(stderr, "Request %lu (type %u): reply %u status %lu, recorded %u status %lu\n",
+                            (unsigned long)(p_record - p_records), p_record->p_packet[0],
+                            p_reply[0], (unsigned long)reply_status,
+                            p_record->reply_type, (unsigned long)p_record->reply_status);
+                    }
+                    divergences++;
+                }
+            }
+        }
+        elapsed = client_now_ns() - start;
+        if (client_close(&client) != 0)
+        {
+            fprintf(stderr, "Server exited with an error\n");
+            status = EXIT_FAILURE;
+        }
+    }
+
+    printf("requests %lu in %.3f s (recorded %.3f s), %.0f requests/s\n",
+        (unsigned long)next, elapsed / 1e9, count ? p_records[count - 1].arrival_ns / 1e9 : 0.0,
+        next / (elapsed / 1e9));
+    if (latency_count > 0)
+    {
+        uint64_t handled = 0;
+        uint32_t r;
+
+        for (r = 0; r < count; r++)
+        {
+            handled += p_records[r].handled_ns;
+        }
+        qsort(p_latency, latency_count, sizeof(*p_latency), compare_uint64);
+        printf("round trip us p50 %.1f p90 %.1f p99 %.1f max %.1f; recorded handling mean %.1f us\n",
+            p_latency[latency_count / 2] / 1e3, p_latency[latency_count * 9 / 10] / 1e3,
+            p_latency[latency_count * 99 / 100] / 1e3, p_latency[latency_count - 1] / 1e3,
+            handled / 1e3 / count);
+    }
+    printf("divergent replies %lu\n", (unsigned long)divergences);
+
+    if (remove_dir)
+    {
+        nftw(sz_root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    free(p_latency);
+    free(server_argv);
+    free(p_records);
+    free(p_trace);
+    return status;
+}
+
+static uint8_t *load_trace(const char *sz_file, size_t *p_size)
+{
+    FILE *p_file = fopen(sz_file, "rb");
+    uint8_t *p_data = NULL;
+    size_t size = 0, capacity = 0, got;
+
+    if (!p_file)
+    {
+        perror(sz_file);
+        return NULL;
+    }
+    do
+    {
+        if (size == capacity)
+        {
+            uint8_t *p_new;
+
+            capacity = capacity ? capacity * 2 : 1024 * 1024;
+            p_new = realloc(p_data, capacity);
+            if (!p_new)
+            {
+                fprintf(stderr, "%s: out of memory\n", sz_file);
+                free(p_data);
+                fclose(p_file);
+                return NULL;
+            }
+            p_data = p_new;
+        }
+        got = fread(&p_data[size], 1, capacity - size, p_file);
+        size += got;
+    } while (got > 0);
+    fclose(p_file);
+    *p_size = size;
+    return p_data;
+}
+
+/* Index the records. A record cut short at the end (the server was killed)
+is ignored. Returns NULL if the header is bad */
+static record_t *parse_trace(const uint8_t *p_trace, size_t size, char *sz_cwd, uint32_t *p_count)
+{
+    record_t *p_records = NULL;
+    uint32_t count = 0, capacity = 0;
+    uint32_t cwd_len;
+    size_t offset;
+
+    if (size < TRACE_HEADER_LEN || memcmp(p_trace, TRACE_MAGIC, 8) != 0
+        || reply_uint32(&p_trace[8]) != TRACE_VERSION)
+    {
+        return NULL;
+    }
+    cwd_len = reply_uint32(&p_trace[12]);
+    if (cwd_len >= PATH_MAX || size - TRACE_HEADER_LEN < cwd_len)
+    {
+        return NULL;
+    }
+    memcpy(sz_cwd, &p_trace[TRACE_HEADER_LEN], cwd_len);
+    sz_cwd[cwd_len] = '\0';
+    offset = TRACE_HEADER_LEN + cwd_len;
+
+    while (size - offset >= TRACE_RECORD_LEN)
+    {
+        const uint8_t *p = &p_trace[offset];
+        record_t *p_record;
+        uint32_t len = reply_uint32(&p[8]);
+
+        if (len < 1 || len > CLIENT_MAX_REQUEST / 2 || size - offset - TRACE_RECORD_LEN < len)
+        {
+            break;
+        }
+        if (count == capacity)
+        {
+            record_t *p_new;
+
+            capacity = capacity ? capacity * 2 : 4096;
+            p_new = realloc(p_records, capacity * sizeof(*p_new));
+            if (!p_new)
+            {
+                free(p_records);
+                return NULL;
+            }
+            p_records = p_new;
+        }
+        p_record = &p_records[count++];
+        p_record->arrival_ns = reply_uint64(&p[0]);
+        p_record->len = len;
+        p_record->p_packet = &p[12];
+        p += 12 + len;
+        p_record->handled_ns = reply_uint32(&p[0]);
+        p_record->reply_type = p[4];
+        p_record->reply_status = reply_uint32(&p[5]);
+        offset += TRACE_RECORD_LEN + len;
+    }
+    *p_count = count;
+    return p_records ? p_records : calloc(1, sizeof(*p_records));
+}
+
+/* Copy a recorded request into the packet, moving its absolute paths under
+sz_root */
+static void build_request(const record_t *p_record, const char *sz_root, sftp_packet_t *p_packet)
+{
+    uint32_t offset = 0;
+    unsigned paths = request_paths(p_record->p_packet, p_record->len, &offset);
+    unsigned i;
+
+    p_packet->len = 4;
+    memcpy(&p_packet->data[4], p_record->p_packet, offset);
+    p_packet->len += offset;
+    for (i = 0; i < paths; i++)
+    {
+        if (copy_string(p_record->p_packet, p_record->len, &offset, sz_root, p_packet) < 0)
+        {
+            break;
+        }
+    }
+    memcpy(&p_packet->data[p_packet->len], &p_record->p_packet[offset], p_record->len - offset);
+    p_packet->len += p_record->len - offset;
+}
+
+/* Number of path strings in the request, and the offset of the first */
+static unsigned request_paths(const uint8_t *p_packet, uint32_t len, uint32_t *p_offset)
+{
+    uint32_t name_len;
+    size_t i;
+
+    /* Type and id */
+    *p_offset = 5;
+    if (len < 5)
+    {
+        *p_offset = len;
+        return 0;
+    }
+    switch (p_packet[0])
+    {
+    case SSH_FXP_OPEN:
+    case SSH_FXP_OPENDIR:
+    case SSH_FXP_STAT:
+    case SSH_FXP_LSTAT:
+    case SSH_FXP_SETSTAT:
+    case SSH_FXP_REMOVE:
+    case SSH_FXP_MKDIR:
+    case SSH_FXP_RMDIR:
+    case SSH_FXP_REALPATH:
+    case SSH_FXP_READLINK:
+        return 1;
+
+    case SSH_FXP_RENAME:
+    case SSH_FXP_SYMLINK:
+        return 2;
+
+    case SSH_FXP_EXTENDED:
+        if (len < 9 || len - 9 < (name_len = reply_uint32(&p_packet[5])))
+        {
+            return 0;
+        }
+        for (i = 0; i < sizeof(path_extensions) / sizeof(path_extensions[0]); i++)
+        {
+            if (strlen(path_extensions[i].sz_name) == name_len
+                && memcmp(path_extensions[i].sz_name, &p_packet[9], name_len) == 0)
+            {
+                *p_offset = 9 + name_len;
+                return path_extensions[i].paths;
+            }
+        }
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+/* Copy a string from the request at *p_offset to the packet, prefixing it
+with sz_root if it's an absolute path */
+static int copy_string(const uint8_t *p_data, uint32_t len, uint32_t *p_offset,
+    const char *sz_root, sftp_packet_t *p_packet)
+{
+    uint32_t str_len, root_len = 0;
+
+    if (len - *p_offset < 4 || len - *p_offset - 4 < (str_len = reply_uint32(&p_data[*p_offset])))
+    {
+        return -1;
+    }
+    if (str_len > 0 && p_data[*p_offset + 4] == '/')
+    {
+        root_len = strlen(sz_root);
+    }
+    packet_uint32(p_packet, root_len + str_len);
+    memcpy(&p_packet->data[p_packet->len], sz_root, root_len);
+    memcpy(&p_packet->data[p_packet->len + root_len], &p_data[*p_offset + 4], str_len);
+    p_packet->len += root_len + str_len;
+    *p_offset += 4 + str_len;
+    return 0;
+}
+
+static int mkdir_parents(const char *sz_path)
+{
+    char sz_partial[2 * PATH_MAX];
+    size_t i;
+
+    for (i = 1; ; i++)
+    {
+        if (sz_path[i] == '/' || sz_path[i] == '\0')
+        {
+            memcpy(sz_partial, sz_path, i);
+            sz_partial[i] = '\0';
+            if (mkdir(sz_partial, 0777) < 0 && errno != EEXIST)
+            {
+                return -1;
+            }
+        }
+        if (sz_path[i] == '\0')
+        {
+            return 0;
+        }
+    }
+}
+
+/* The slot of the request a reply answers, or tail if none does. Replies
+needn't come in request order, since the server may let some requests past
+others, so this is the oldest unanswered request with the reply's id. A
+VERSION reply carries no id and answers the INIT */
+static uint32_t find_expected(const record_t *p_records, uint32_t head, uint32_t tail,
+    const uint8_t *p_reply, uint32_t len)
+{
+    uint32_t id = len >= 5 ? reply_uint32(&p_reply[1]) : 0;
+    uint32_t slot;
+
+    for (slot = head; slot != tail; slot++)
+    {
+        const expected_t *p_expected = &expected[slot & (MAX_IN_FLIGHT - 1)];
+
+        if (p_expected->answered)
+        {
+            continue;
+        }
+        if (p_reply[0] == SSH_FXP_VERSION
+            ? p_records[p_expected->record].p_packet[0] == SSH_FXP_INIT
+            : p_expected->id == id)
+        {
+            return slot;
+        }
+    }
+    return tail;
+}
+
+static int compare_uint64(const void *p_a, const void *p_b)
+{
+    uint64_t a = *(const uint64_t *)p_a;
+    uint64_t b = *(const uint64_t *)p_b;
+
+    return a < b ? -1 : a > b;
+}
+
+static int remove_entry(const char *sz_path, const struct stat *p_st, int flag, struct FTW *p_ftw)
+{
+    (void)p_st;
+    (void)flag;
+    (void)p_ftw;
+    return remove(sz_path) < 0 ? -1 : 0;
+}
+/* End of file */
@@ -28,7 +28,7 @@ This code originates from http://www.eddylangley.net/nih/sftp/
 
 */
 
-/* Version 3 SFTP server. Should compile warning-free on most POSIX boxes with:
+/* Version 3 to 6 SFTP server. Should compile warning-free on most POSIX boxes with:
 
 gcc -O2 -Wall -Wextra -Werror -std=iso9899:1999 -pedantic-errors nih-sftp-server.c -o sftp-server
 
@@ -36,14 +36,52 @@ If not then see "man 7 feature_test_macros". The relevant features are:
 
 _XOPEN_SOURCE for POSIX telldir, seekdir
 _XOPEN_SOURCE >=500 for POSIX lstat, telldir, seekdir, readlink, symlink
-_XOPEN_SOURCE >=700 for POSIX.1-2008 + XSI fstatat fdopendir; without this 
-realpath() is broken and sftp_realpath will return unsupported 
-_BSD_SOURCE for futimes; otherwise sftp_fsetstat() will return unsupported
+_XOPEN_SOURCE >=700 for POSIX.1-2008 + XSI fstatat fdopendir and the other *at()
+functions; without this realpath() is broken and sftp_realpath will return unsupported 
+_GNU_SOURCE on Linux for O_PATH, and statx() so only the attributes a reply
+carries are fetched
+
+Normally sshd runs one server process per session. Alternatively, start a long
+lived daemon with "nih-sftp-server -D /run/nih-sftp.sock" and configure sshd
+with "Subsystem sftp /path/to/nih-sftp-server -C /run/nih-sftp.sock"; each
+session then hands its connection to the daemon, falling back to serving it
+directly if the daemon isn't running.
+
+With "-S file", counters and per-opcode latency histograms are collected and
+appended to file as a line of JSON on SIGUSR1 and when the session ends.
+
+With "-P bytes", packets of up to that size (default 340000) are accepted and
+advertised through limits@openssh.com.
+
+With "-T file", every request is recorded to file (file.pid for daemon
+sessions) for replay by nih-sftp-replay.
+
+With "-N dir" (up to MAX_NOCACHE_DIRS times), files under dir are read and
+written without filling the page cache: what has been transferred is written
+back and dropped behind the cursor, so a bulk upload doesn't evict everything
+else the box has cached.
+
+With "-M bytes", regular files of up to MAP_FILE_MAX opened only for reading
+are mapped into memory, up to bytes of them at once, and READs are copied from
+the mapping. Mappings outlive CLOSE, so a hot file opened again is read without
+any system calls beyond open(), fstat() and close().
+
+With "-A ms", STAT and LSTAT results are remembered for up to ms milliseconds,
+for clients which poll the same paths. On Linux, inotify on the parent
+directories forgets them sooner when something changes there.
+
+With "-B bytes" and "-I ops", READ and WRITE are limited to that many bytes
+and requests a second; nothing else is counted, so neither limits a storm of
+STATs. Requests over the limit wait their turn rather than failing. Requests
+which only look at things (STAT, LSTAT, FSTAT, REALPATH and READLINK) are
+always answered ahead of READs queued before them, but never passed a WRITE
+or anything else which might change what they see.
 */
 #define _XOPEN_SOURCE 700
-//#define _BSD_SOURCE
 #ifdef __APPLE__
 #define _DARWIN_C_SOURCE
+#elif defined(__linux__)
+#define _GNU_SOURCE
 #else
 #define _DEFAULT_SOURCE
 #endif
@@ -66,65 +104,62 @@ _BSD_SOURCE for futimes; otherwise sftp_fsetstat() will return unsupported
 #include <pwd.h> /* getpwuid */
 #include <grp.h> /* getgrgid */
 #include <time.h>
+#include <limits.h> /* PATH_MAX */
+#include <signal.h> /* sigaction */
+#include <setjmp.h> /* sigsetjmp */
+#include <sys/mman.h> /* mmap */
+#include <sys/socket.h> /* Daemon mode */
+#include <sys/un.h> /* sockaddr_un */
+#include <sys/statvfs.h> /* statvfs */
+#include <sys/file.h> /* flock */
+#include <sys/uio.h> /* writev */
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#else
+#include <poll.h>
+#endif
 
 #include "nih-sftp-server.h"
-#include "strmode.h"
-
-/* draft-ietf-secsh-filexfer-02 */
-#define SSH_FXP_INIT                1
-#define SSH_FXP_VERSION             2
-#define SSH_FXP_OPEN                3
-#define SSH_FXP_CLOSE               4
-#define SSH_FXP_READ                5
-#define SSH_FXP_WRITE               6
-#define SSH_FXP_LSTAT               7
-#define SSH_FXP_FSTAT               8
-#define SSH_FXP_SETSTAT             9
-#define SSH_FXP_FSETSTAT           10
-#define SSH_FXP_OPENDIR            11
-#define SSH_FXP_READDIR            12
-#define SSH_FXP_REMOVE             13
-#define SSH_FXP_MKDIR              14
-#define SSH_FXP_RMDIR              15
-#define SSH_FXP_REALPATH           16
-#define SSH_FXP_STAT               17
-#define SSH_FXP_RENAME             18
-#define SSH_FXP_READLINK           19
-#define SSH_FXP_SYMLINK            20
-#define SSH_FXP_STATUS            101
-#define SSH_FXP_HANDLE            102
-#define SSH_FXP_DATA              103
-#define SSH_FXP_NAME              104
-#define SSH_FXP_ATTRS             105
-#define SSH_FXP_EXTENDED          200
-#define SSH_FXP_EXTENDED_REPLY    201
-
-#define SSH_FX_OK                            0
-#define SSH_FX_EOF                           1
-#define SSH_FX_NO_SUCH_FILE                  2
-#define SSH_FX_PERMISSION_DENIED             3
-#define SSH_FX_FAILURE                       4
-#define SSH_FX_BAD_MESSAGE                   5
-#define SSH_FX_NO_CONNECTION                 6
-#define SSH_FX_CONNECTION_LOST               7
-#define SSH_FX_OP_UNSUPPORTED                8
-
-#define SSH_FILEXFER_ATTR_SIZE          0x00000001
-#define SSH_FILEXFER_ATTR_UIDGID        0x00000002
-#define SSH_FILEXFER_ATTR_PERMISSIONS   0x00000004
-#define SSH_FILEXFER_ATTR_ACMODTIME     0x00000008
-#define SSH_FILEXFER_ATTR_EXTENDED      0x80000000
-
-#define SSH_FXF_READ            0x00000001
-#define SSH_FXF_WRITE           0x00000002
-#define SSH_FXF_APPEND          0x00000004
-#define SSH_FXF_CREAT           0x00000008
-#define SSH_FXF_TRUNC           0x00000010
-#define SSH_FXF_EXCL            0x00000020
-
-/* Derived from SFTP specification */
-#define MAX_ATTRS_BYTES 32
-#define SFTP_PROTOCOL_VERSION 3
+
+/* Replies to our own extensions */
+#define NIH_FX_EXT_VERSION "1"
+/* Version 3 extended attribute carrying the nanoseconds of the access and
+modify times: uint32 atime nanoseconds, uint32 mtime nanoseconds. Always
+accepted; only sent once the client has asked with the extension of the same
+name, as a client may refuse ATTRS with extensions it didn't expect */
+#define NIH_ATTR_TIMES_NS "times-ns@eddylangley.net"
+
+/* Derived from SFTP specification. The largest ATTRS we send is version 6's
+with SIZE, OWNERGROUP, PERMISSIONS, four times with nanoseconds and
+LINK_COUNT */
+#define MAX_ATTRS_BYTES (69 + 2 * (4 + OWNER_NAME_MAX))
+#define SFTP_MIN_VERSION 3
+#define SFTP_MAX_VERSION 6
+
+/* POSIX.1-2008 nanosecond file times */
+#ifdef __APPLE__
+#define ST_ATIM st_atimespec
+#define ST_MTIM st_mtimespec
+#define ST_CTIM st_ctimespec
+#else
+#define ST_ATIM st_atim
+#define ST_MTIM st_mtim
+#define ST_CTIM st_ctim
+#endif
+
+/* WRITEs of at least this many zero bytes leave a hole rather than allocating
+blocks */
+#define ZERO_WRITE_MIN 4096
+/* Most ranges in one data-ranges@eddylangley.net reply */
+#define DATA_RANGES_MAX 512
+/* Directories given with -N, and how much of a file under one is transferred
+between drops from the page cache */
+#define MAX_NOCACHE_DIRS 8
+#define DROP_BEHIND_CHUNK (8 * 1024 * 1024)
+/* Files mapped for -M: how many, and the largest */
+#define MAP_CACHE_SIZE 256
+#define MAP_FILE_MAX (1024 * 1024)
 
 /* Defaults */
 #define DEFAULT_FILE_PERM 0666
@@ -132,20 +167,105 @@ _BSD_SOURCE for futimes; otherwise sftp_fsetstat() will return unsupported
 
 /* Implementation limits */
 #define MAX_PACKET 340000    /* SFTP: All servers SHOULD support packets of at least 340000 bytes?? */
+/* Range for -P. Packet lengths exclude the 4 byte length field */
+#define MIN_PACKET 34000
+#define MAX_PACKET_LIMIT (16 * 1024 * 1024)
+/* Advertised read and write lengths leave this much of a packet for headers */
+#define PACKET_HEADROOM 1024
 #define PERM_MASK 0777
 /* Handles are represented as SSH strings; MAX_HANDLE_DIGITS must enable the printing of
 MAX_HANDLES in that many digits */
 #define MAX_HANDLES 99
 #define MAX_HANDLE_DIGITS 2
 
-#define MAX_LONGNAME_LEN 4096
-#define MAX_USR_GRP_LEN 4096
+/* Resolved directories remembered by the realpath cache. Must be a power of 2 */
+#define REALPATH_CACHE_SIZE 64
+/* Open parent directory descriptors kept by path_at(), and the most directories
+inotify watches so that they're forgotten when renamed or removed */
+#define DIRFD_CACHE_SIZE 16
+#define DIRFD_WATCH_MAX 128
+/* Descriptors of closed read-only files kept for reopening */
+#define FD_CACHE_SIZE 16
+/* STAT and LSTAT results remembered for -A, and the most directories inotify
+watches for changes to them. Size must be a power of 2 */
+#define ATTR_CACHE_SIZE 256
+#define ATTR_WATCH_MAX 64
+
+/* Longest user or group name we send; longer ones go as the number */
+#ifdef LOGIN_NAME_MAX
+#define OWNER_NAME_MAX (LOGIN_NAME_MAX - 1)
+#else
+#define OWNER_NAME_MAX 255
+#endif
+
+/* Caches shared between all sessions of a daemon. Sizes must be powers of 2;
+lifetimes are in seconds. Names longer than NAME_CACHE_LEN aren't cached */
+#define NAME_CACHE_SIZE 256
+#define NAME_CACHE_LEN 32
+#define NAME_CACHE_TTL 300
+#define STATVFS_CACHE_SIZE 32
+#define STATVFS_CACHE_LEN 128
+#define STATVFS_CACHE_TTL 2
+
+/* The input queue holds several packets so we can keep reading requests
+while replies wait for the client. Requests are handled until this many
+packets' worth of replies are waiting */
+#define INPUT_QUEUE_PACKETS 2
+#define OUTPUT_QUEUE_PACKETS 4
+/* -B and -I allow bursts of this long at the full rate */
+#define SHAPE_BURST_NS (100 * 1000000u)
+/* Runs of up to SCHED_WINDOW READs and WRITEs are shared between handles, each
+taking SCHED_QUANTUM bytes in turn */
+#define SCHED_WINDOW 256
+#define SCHED_QUANTUM (64 * 1024)
+/* Most writes of the output queue are a single writev() */
+#define OUTPUT_IOV_MAX 64
+
+/* Reply buffer pool size classes. Small fits STATUS, HANDLE and ATTRS
+replies; medium a NAME with a couple of paths; large is a whole packet, for
+READ and READDIR. Each class keeps up to POOL_MAX_FREE buffers for reuse */
+#define POOL_SMALL_SIZE 1024
+#define POOL_MEDIUM_SIZE (16 * 1024)
+#define POOL_CLASSES 3
+#define POOL_MAX_FREE 32
+
+/* Descriptors the event loop can watch */
+#define MAX_EV_SOURCES 8
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+
+/* Latency histograms have STATS_SUB_BUCKETS linear buckets per power of 2
+nanoseconds, up to 2^STATS_MAX_MAGNITUDE ns (about 18 minutes) */
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_MAGNITUDE 40
+#define STATS_HIST_BUCKETS ((STATS_MAX_MAGNITUDE - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+#define STATS_MAX_OPCODES 256
+/* Room for one statistics dump */
+#define STATS_DUMP_SIZE (64 * 1024)
+
+/* Pending connections for the daemon's listening socket */
+#define DAEMON_BACKLOG 64
+
+/* Version 3 long names are "mode links owner group size date name". This is
+the most they need besides the name: 10 + 20 digit link count + two names +
+20 digit size + a date with an 11 digit year, and the spaces */
+#define LONGNAME_MAX_DATE 23
+#define LONGNAME_FIXED_LEN (10 + 20 + 2 * OWNER_NAME_MAX + 20 + LONGNAME_MAX_DATE + 6)
+/* Formatted dates remembered by minute. Must be a power of 2 */
+#define LONGNAME_DATE_CACHE_SIZE 16
 
 /* Utility macros */
 #define STR(x) #x
 #define STREXPAND(x) STR(x)
 #define elemof(x) ( sizeof(x) / sizeof( (x)[0] ) )
 
+/* Wire integers are big endian. On little endian GCC and clang builds they're
+moved whole and byte swapped; elsewhere they're assembled a byte at a time */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define WIRE_BSWAP
+#endif
+
 /* Basic boolean type */
 typedef enum
 {
@@ -155,14 +275,54 @@ typedef enum
 
 /* Buffers. There are two buffers - the input buffer, containing 1 SFTP packet,
 which we consume as we process the packet, and the output buffer, which we
-populate as we reply to the input packet */
+populate as we reply to the input packet. Both are windows onto the input and
+output queues */
 typedef struct buff_tag
 {
     uint32_t count;     /* Space remaining input pkt/ space left output pkt */
     uint8_t *p_data;    /* Read pointer input pkt/ write ptr output pkt */
-    uint8_t data[MAX_PACKET];
+    uint8_t *data;      /* Start of output packet */
+    uint32_t size;      /* Size of output packet space */
 } buff_t;
 
+/* Byte queue between a descriptor and the packet buffers. Bytes from head up
+to tail are waiting to be consumed; space after tail is free */
+typedef struct queue_tag
+{
+    uint8_t *data;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+} queue_t;
+
+/* Rate limit for -B and -I, as the time the next request would be due if
+requests came at exactly the rate (GCRA, equivalent to a token bucket) */
+typedef struct bucket_tag
+{
+    uint64_t rate;      /* Per second, 0 for no limit */
+    uint64_t due;       /* CLOCK_MONOTONIC ns */
+} bucket_t;
+
+/* A READ or WRITE in the run being scheduled */
+typedef struct sched_entry_tag
+{
+    uint32_t posn;      /* Of its length field in the input queue */
+    uint32_t len;       /* Without the length field */
+    uint32_t cost;      /* Data bytes */
+    uint32_t next;      /* Next of the same handle, SCHED_WINDOW for none */
+    ssh_bool_t done;
+} sched_entry_t;
+
+/* Event loop source - a descriptor and the handler to call when it's ready */
+typedef void (*ev_handler_t)(int fd, unsigned events);
+typedef struct ev_source_tag
+{
+    int fd;             /* -1 if free */
+    unsigned events;    /* EV_READ | EV_WRITE */
+    ev_handler_t handler;
+    ssh_bool_t always_ready;    /* epoll refused it: a regular file, /dev/null */
+} ev_source_t;
+
 /* We can save the buffer pointers - e.g. to write the rest of the buffer, then
 come back and write the length once we know what it is. */
 typedef struct buff_save
@@ -171,18 +331,99 @@ typedef struct buff_save
     uint8_t *p_data;    /* Read pointer input pkt/ write ptr output pkt */
 } buff_save_t;
 
-/* File attributes */
+/* A string in a request: a view of the bytes in the input packet, not NUL
+terminated and valid only while the packet is */
+typedef struct sv_tag
+{
+    const uint8_t *p_data;
+    uint32_t len;
+} sv_t;
+
+/* Bump allocator for the NUL terminated copies of request strings which
+system calls need. Emptied before each request is handled. Each string costs
+its length plus a NUL here, against its length plus a 4 byte length field in
+the packet, so a packet's worth of space is always enough */
+typedef struct arena_tag
+{
+    uint32_t used;
+    uint32_t size;
+    char *data;
+} arena_t;
+
+/* Pooled reply buffer. Replies waiting to be written are kept in a list */
+typedef struct pbuf_tag
+{
+    struct pbuf_tag *p_next;
+    uint32_t size;          /* Of data */
+    uint32_t len;           /* Bytes of reply */
+    uint32_t sent;          /* Bytes of reply written so far */
+    uint8_t data[];
+} pbuf_t;
+
+typedef struct pool_tag
+{
+    pbuf_t *p_free[POOL_CLASSES];
+    uint32_t free_count[POOL_CLASSES];
+    uint32_t class_size[POOL_CLASSES];
+} pool_t;
+
+/* File attributes, whatever the protocol version. flags uses the version 4
+meanings, except that UIDGID says uid and gid are valid: get_attrs() maps
+version 3's ACMODTIME to ACCESSTIME | MODIFYTIME, and put_attrs() maps back
+and turns UIDGID into OWNERGROUP names as the version requires */
 typedef struct attrs_tag
 {
     uint32_t   flags;           /* Which of the following are valid */
+    uint8_t    type;            /* SSH_FILEXFER_TYPE_*, 0 if not known */
     uint32_t   permissions;     /* SSH_FILEXFER_ATTR_PERMISSIONS */
     uint64_t   size;            /* SSH_FILEXFER_ATTR_SIZE */
     uint32_t   uid;             /* SSH_FILEXFER_ATTR_UIDGID */
     uint32_t   gid;             /* SSH_FILEXFER_ATTR_UIDGID */
-    uint32_t   atime;           /* SSH_FILEXFER_ATTR_ACMODTIME */
-    uint32_t   mtime;           /* SSH_FILEXFER_ATTR_ACMODTIME */
+    sv_t       owner;           /* SSH_FILEXFER_ATTR_OWNERGROUP, as received */
+    sv_t       group;           /* SSH_FILEXFER_ATTR_OWNERGROUP, as received */
+    int64_t    atime;           /* SSH_FILEXFER_ATTR_ACCESSTIME */
+    int64_t    mtime;           /* SSH_FILEXFER_ATTR_MODIFYTIME */
+    int64_t    ctime;           /* SSH_FILEXFER_ATTR_CTIME */
+    int64_t    createtime;      /* SSH_FILEXFER_ATTR_CREATETIME */
+    uint32_t   atime_ns;        /* The times' nanoseconds, with */
+    uint32_t   mtime_ns;        /* SSH_FILEXFER_ATTR_SUBSECOND_TIMES */
+    uint32_t   ctime_ns;
+    uint32_t   createtime_ns;
+    uint32_t   link_count;      /* SSH_FILEXFER_ATTR_LINK_COUNT */
 } attrs_t;
 
+/* A request decoded from its packet by decode_request(). Which fields are
+valid depends on the type; the packet itself is never modified, so a decoded
+request only needs the packet to stay put until it has been handled */
+typedef struct request_tag
+{
+    uint8_t type;
+    uint32_t id;            /* Or version, for INIT */
+    sv_t handle;            /* CLOSE READ WRITE FSTAT FSETSTAT READDIR BLOCK UNBLOCK */
+    sv_t path;              /* Requests on a path; RENAME old, SYMLINK and LINK link path */
+    sv_t path2;             /* RENAME new path, SYMLINK and LINK target */
+    sv_t name;              /* EXTENDED request name */
+    sv_t data;              /* WRITE data; EXTENDED arguments and REALPATH compose
+                            paths, still encoded */
+    uint64_t offset;        /* READ WRITE BLOCK UNBLOCK */
+    uint64_t length;        /* BLOCK UNBLOCK */
+    uint32_t len;           /* READ */
+    uint32_t pflags;        /* OPEN; RENAME flags; BLOCK lock mask */
+    uint32_t access;        /* OPEN desired access, version 5 onwards */
+    uint32_t attr_mask;     /* STAT LSTAT FSTAT attributes wanted */
+    uint8_t control;        /* REALPATH control byte; LINK sym-link flag */
+    attrs_t attrs;          /* OPEN SETSTAT FSETSTAT MKDIR */
+} request_t;
+
+/* Long name date cache entry - "YYYY-MM-DD HH:MM" for one minute of mtimes */
+typedef struct date_entry_tag
+{
+    ssh_bool_t used;
+    int64_t minute;
+    uint32_t len;
+    char date[LONGNAME_MAX_DATE];
+} date_entry_t;
+
 /* Handle types. can represent either a file or a directory */
 typedef enum handle_use_tag
 {
@@ -191,49 +432,341 @@ typedef enum handle_use_tag
     HANDLE_DIR
 } handle_use_t;
 
+/* A file mapped by the map cache for -M. Entries are keyed by device and inode
+and only reused while size, mtime and ctime are unchanged */
+typedef struct map_entry_tag
+{
+    uint8_t *p_data;        /* NULL if free */
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint32_t refs;          /* Handles reading through it */
+    uint32_t last_use;
+    ssh_bool_t stale;       /* File changed; unmapped when refs reaches 0 */
+} map_entry_t;
+
 typedef struct fxp_handle_tag
 {
     handle_use_t use;
     int fd;
     DIR *p_dir;
+    ssh_bool_t drop_behind;     /* Under a -N directory */
+    ssh_bool_t dirty;           /* Written since opened */
+    uint64_t behind_start;      /* Transferred sequentially, still cached */
+    uint64_t behind_end;
+    uint64_t wb_start;          /* Being written back, dropped next */
+    uint64_t wb_end;
+    map_entry_t *p_map;         /* Read through the map cache */
+    char *sz_path;              /* Kept by the fd cache on CLOSE if set */
+    int flags;
+    ssh_bool_t have_ident;      /* dev and ino are known */
+    dev_t dev;
+    ino_t ino;
 } fxp_handle_t;
 
+/* Extension handlers are looked up by name when an SSH_FXP_EXTENDED request
+arrives. The table also provides the extension pairs sent in our VERSION reply */
+typedef struct extension_tag
+{
+    const char *sz_name;
+    const char *sz_data;
+    void (*handler)(uint32_t id);
+} extension_t;
+
+/* Running totals for a recursive remove. The first error is reported to the
+client along with the path (relative to the request path) which caused it */
+typedef struct remove_summary_tag
+{
+    uint64_t files;
+    uint64_t dirs;
+    uint32_t first_status;
+    char sz_first_path[PATH_MAX];
+    char sz_path[PATH_MAX];      /* Path of the entry being visited */
+    size_t path_len;
+} remove_summary_t;
+
+/* Realpath cache entry - maps a directory path exactly as the client sent it
+to its canonical form */
+typedef struct realpath_entry_tag
+{
+    char *sz_key;
+    char *sz_resolved;
+} realpath_entry_t;
+
+/* Dirfd cache entry - an open descriptor for a directory named by the first
+dir_len bytes of a client path. Searched linearly; evicted least recently used */
+typedef struct dirfd_entry_tag
+{
+    char *sz_dir;       /* NULL if free */
+    size_t dir_len;
+    uint32_t hash;
+    uint32_t last_use;
+    int fd;
+} dirfd_entry_t;
+
+/* A directory watched by inotify for directories in it being renamed or
+removed, named as in a client path. Cached descriptors for paths through it
+are only valid while it's watched */
+typedef struct dir_watch_tag
+{
+    char *sz_dir;       /* NULL if free */
+    size_t dir_len;
+    uint32_t last_use;
+    int wd;
+} dir_watch_t;
+
+/* A read-only descriptor kept open after CLOSE, keyed by the path and flags
+it was opened with */
+typedef struct fd_entry_tag
+{
+    char *sz_path;      /* NULL if free */
+    uint32_t hash;
+    uint32_t last_use;
+    int flags;          /* As opened */
+    int fd;
+    dev_t dev;          /* As at CLOSE */
+    ino_t ino;
+    struct timespec ctime;
+} fd_entry_t;
+
+/* A STAT or LSTAT result remembered by the attribute cache */
+typedef struct attr_entry_tag
+{
+    char *sz_path;      /* NULL if free */
+    uint32_t hash;
+    uint32_t wanted;    /* attrs_wanted() of the request */
+    ssh_bool_t follow;  /* STAT rather than LSTAT */
+    int error;          /* 0 and attrs, or ENOENT */
+    attrs_t attrs;
+    uint32_t gen;       /* attr_gen when looked up */
+    int wd;             /* inotify watch on the parent, -1 if none */
+    uint64_t expires;   /* CLOCK_MONOTONIC ns */
+} attr_entry_t;
+
+/* A directory the attribute cache watches, keyed by the client's path to it */
+typedef struct attr_watch_tag
+{
+    char *sz_dir;       /* NULL if free */
+    uint32_t hash;
+    uint32_t last_use;
+    int wd;
+} attr_watch_t;
+
+/* Shared caches. In daemon mode these live in memory shared by every session
+process, so a session starts with whatever earlier sessions have looked up.
+Each entry is protected by a sequence lock: writers make seq odd while
+updating (giving up if someone else is), and readers treat the entry as a
+miss if seq was odd or changed while they copied it out */
+typedef struct name_entry_tag
+{
+    volatile uint32_t seq;
+    uint32_t id;
+    ssh_bool_t is_group;
+    time_t expires;
+    char sz_name[NAME_CACHE_LEN + 1];
+} name_entry_t;
+
+typedef struct statvfs_entry_tag
+{
+    volatile uint32_t seq;
+    time_t expires;
+    uid_t uid;
+    char sz_path[STATVFS_CACHE_LEN + 1];    /* Canonical */
+    struct statvfs st;
+} statvfs_entry_t;
+
+typedef struct shared_tag
+{
+    name_entry_t names[NAME_CACHE_SIZE];
+    statvfs_entry_t statvfs[STATVFS_CACHE_SIZE];
+} shared_t;
+
+/* Statistics, collected only if a statistics file is configured (-S). Counts
+are per session process */
+typedef struct op_stats_tag
+{
+    uint64_t count;
+    uint64_t errors;        /* Replies with a STATUS other than OK or EOF */
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint32_t hist[STATS_HIST_BUCKETS];
+} op_stats_t;
+
+typedef struct stats_tag
+{
+    struct timespec start;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t file_bytes_read;
+    uint64_t file_bytes_written;
+    uint64_t sys_read;          /* read() of stdin */
+    uint64_t sys_write;         /* write() of stdout */
+    uint64_t sys_wait;          /* epoll_wait() or poll() */
+    uint64_t sys_file_read;
+    uint64_t sys_file_write;
+    uint64_t sys_file_seek;
+    uint64_t mapped_reads;      /* READs copied from the map cache */
+    uint64_t attr_hits;         /* STATs answered by the attribute cache */
+    uint32_t handles_open;
+    uint32_t handles_peak;
+    uint32_t input_peak;        /* Bytes waiting in the input queue */
+    uint32_t output_peak;       /* Bytes waiting in the output queue */
+    uint32_t batch_peak;        /* Packets handled between reads */
+    uint64_t buffers_allocated; /* Reply buffers the pool couldn't reuse */
+    op_stats_t ops[STATS_MAX_OPCODES];
+} stats_t;
+
 /* Private function prototypes - SFTP */
-static void sftp_in(void);
-static void sftp_init(void);
-static void sftp_open(void);
-static void sftp_close(void);
-static void sftp_read(void);
-static void sftp_write(void);
+static void sftp_in(const request_t *p_req);
+static void decode_request(request_t *p_req);
+static uint32_t reply_size(const request_t *p_req);
+static void sftp_init(const request_t *p_req);
+static void sftp_open(const request_t *p_req);
+static void sftp_close(const request_t *p_req);
+static void sftp_read(const request_t *p_req);
+static void sftp_write(const request_t *p_req);
+static ssh_bool_t is_zero(const uint8_t *p_data, uint32_t len);
+static int write_zeros(int fd, uint64_t offset, uint32_t len);
 static void stat_to_attr(struct stat *p_stat, attrs_t *p_attr);
-static void do_stat(ssh_bool_t follow_symlinks);
-static void sftp_stat(void);
-static void sftp_lstat(void);
-static void sftp_fstat(void);
-static void sftp_setstat(void);
-static void sftp_fsetstat(void);
-static void sftp_opendir(void);
-static void sftp_readdir(void);
-static void sftp_remove(void);
-static void sftp_mkdir(void);
-static void sftp_rmdir(void);
-static void sftp_realpath(void);
-static void sftp_rename(void);
-static void sftp_readlink(void);
-static void sftp_symlink(void);
-
-static void read_input(uint32_t len);
+static uint8_t mode_to_type(mode_t mode);
+static uint32_t attrs_wanted(uint32_t attr_mask);
+static int attrs_stat(int dirfd, const char *sz_path, int at_flags, uint32_t wanted, attrs_t *p_attr);
+static uint32_t attrs_resolve_owner(attrs_t *p_attr);
+static void do_stat(const request_t *p_req, ssh_bool_t follow_symlinks);
+static void attr_cache_init(void);
+static void attr_cache_note(uint8_t type);
+static int attr_cache_stat(const char *sz_path, ssh_bool_t follow, uint32_t wanted, attrs_t *p_attr);
+static int attr_cache_watch(const char *sz_path);
+#ifdef __linux__
+static void attr_forget_wd(int wd);
+static void attr_on_inotify(int fd, unsigned events);
+#endif
+static void sftp_fstat(const request_t *p_req);
+static void sftp_setstat(const request_t *p_req);
+static uint32_t attrs_apply(int dirfd, const char *sz_base, int at_flags, const attrs_t *p_attr);
+static int truncate_at(int dirfd, const char *sz_base, uint64_t size);
+static int preallocate(int fd, uint64_t offset, uint64_t len);
+static ssh_bool_t is_nocache_path(const char *sz_path);
+static void drop_behind(fxp_handle_t *p_handle, uint64_t offset, uint64_t len);
+static void drop_range(int fd, uint64_t start, uint64_t end, ssh_bool_t wait);
+static void map_init(void);
+static map_entry_t *map_acquire(int fd);
+static void map_release(map_entry_t *p_map);
+static ssize_t map_read(fxp_handle_t *p_handle, uint8_t *p_dest, uint64_t offset, uint32_t len);
+static void map_on_sigbus(int sig);
+static void sftp_fsetstat(const request_t *p_req);
+static void sftp_opendir(const request_t *p_req);
+static void sftp_readdir(const request_t *p_req);
+static void sftp_remove(const request_t *p_req);
+static void sftp_mkdir(const request_t *p_req);
+static void sftp_rmdir(const request_t *p_req);
+static void sftp_realpath(const request_t *p_req);
+static void sftp_rename(const request_t *p_req);
+static void sftp_readlink(const request_t *p_req);
+static void sftp_symlink(const request_t *p_req);
+static void sftp_link(const request_t *p_req);
+static void sftp_block(const request_t *p_req);
+static void sftp_unblock(const request_t *p_req);
+static void put_supported(void);
+static void sftp_extended(const request_t *p_req);
+
+/* Private function prototypes - extensions */
+static void ext_remove_recursive(uint32_t id);
+static void ext_mkdir_parents(uint32_t id);
+static void ext_expand_path(uint32_t id);
+static void ext_statvfs(uint32_t id);
+static void ext_fstatvfs(uint32_t id);
+static void ext_limits(uint32_t id);
+static void ext_times_ns(uint32_t id);
+static void ext_lsetstat(uint32_t id);
+static void ext_data_ranges(uint32_t id);
+static void ext_preallocate(uint32_t id);
+static void put_statvfs(uint32_t id, const struct statvfs *p_st);
+static void remove_dir_contents(int dirfd, remove_summary_t *p_sum);
+static void remove_note_error(remove_summary_t *p_sum, int unix_error);
+static int mkdir_parents(char *sz_path, size_t len, mode_t mode);
+
+static void serve(void);
+static ssh_bool_t process_input(void);
+static void handle_packet(uint8_t *p_packet, uint32_t len);
+static ssh_bool_t sched_run(uint32_t *p_batch);
+static ssh_bool_t sched_emit(sched_entry_t *p_entry, uint32_t *p_batch);
+static ssh_bool_t sched_distinct(fxp_handle_t **pp_handles, uint32_t count);
+static uint32_t request_bytes(const uint8_t *p_packet, uint32_t len);
+static uint64_t shape_admit(const uint8_t *p_packet, uint32_t len);
+static uint32_t look_ahead(uint32_t posn);
+static uint64_t bucket_delay(const bucket_t *p_bucket, uint64_t now);
+static void bucket_charge(bucket_t *p_bucket, uint64_t now, uint64_t cost);
+static void on_input(int fd, unsigned events);
+static void on_output(int fd, unsigned events);
+static void flush_output(void);
+static void queue_compact(queue_t *p_queue);
+static void queue_reply(pbuf_t *p_buf);
+
+/* Reply buffers */
+static void pool_init(void);
+static pbuf_t *pool_get(uint32_t size);
+static void pool_put(pbuf_t *p_buf);
+
+/* Statistics */
+static void stats_init(void);
+static void stats_request(uint8_t opcode, uint64_t ns);
+static void stats_dump(const char *sz_reason);
+static void stats_dump_at_exit(void);
+static void stats_on_signal(int sig);
+static unsigned stats_bucket(uint64_t ns);
+static uint64_t stats_bucket_low(unsigned bucket);
+static uint64_t stats_percentile(const op_stats_t *p_op, unsigned percent);
+static const char *opcode_name(uint8_t opcode);
+#define STATS_ADD(field, n) do { if (p_stats) { p_stats->field += (n); } } while (0)
+
+/* Request tracing */
+static void trace_init(void);
+static void trace_request(const uint8_t *p_packet, uint32_t len, const struct timespec *p_start);
+static void trace_reply(uint64_t ns);
+static void trace_put_uint32(uint8_t *p_out, uint32_t data);
+
+/* Event loop */
+static void ev_init(void);
+static void ev_set(int fd, unsigned events, ev_handler_t handler);
+static void ev_wait(int timeout_ms);
+
+/* Daemon mode */
+static void daemon_run(const char *sz_socket);
+static void daemon_session(int sock, uid_t uid, gid_t gid);
+static int daemon_switch_user(uid_t uid, gid_t gid);
+static int peer_ids(int sock, uid_t *p_uid, gid_t *p_gid);
+static void shim_run(const char *sz_socket);
+
+/* Shared caches */
+static void shared_init(void);
+static const char *name_lookup(uint32_t id, ssh_bool_t is_group, char *sz_name);
+static int statvfs_cached(const char *sz_path, struct statvfs *p_st);
+static ssh_bool_t seq_write_begin(volatile uint32_t *p_seq);
+static void seq_write_end(volatile uint32_t *p_seq);
 
 /* Buffer pointer save/swap - see typedef comments */
 static void buff_save(buff_save_t *p_buff);
 static void buff_swap(buff_save_t *p_buff);
 
 /* Various buffer read/write functions. get_* obtains information from (and consumes)
-the input buffer, put_* writes to (and consumes space in) the output buffer. It is
-always assert()ed that the data to be put_* doesn't overflow the output buffer; cases
-where this may occur are very rare by design (e.g. filenames >17k long) */
+the input buffer, put_* writes to (and consumes space in) the output buffer. Data
+which would overflow the output buffer isn't written but sets encode_error, and the
+reply is replaced by SSH_FX_FAILURE once the request has been handled; cases where
+this may occur are very rare by design (e.g. filenames >17k long). Input comes
+from the client so get_* never asserts: reading past the end of the packet sets
+decode_error, empties the input buffer and yields zeros. The flag is checked once
+per request, after decoding, and the request answered with SSH_FX_BAD_MESSAGE */
 static void put_status(uint32_t id, uint32_t status);
+static ssh_bool_t bad_message(uint32_t id);
+static void reply_check(uint32_t id);
 static void put_handle(uint32_t id, unsigned long handle);
+static uint32_t decode_fail(void);
 static uint8_t get_byte(void);
 static void put_byte(uint8_t data);
 /* Not needed static ssh_bool_t get_bool(void);*/
@@ -241,17 +774,64 @@ static uint32_t get_uint32(void);
 static uint64_t get_uint64(void);
 static void put_uint32(uint32_t data);
 static void put_uint64(uint64_t data);
+static void get_view(sv_t *p_sv);
+static const uint8_t *get_handle_fixed(sv_t *p_handle, uint32_t fixed_len);
 static const char *get_string(uint32_t *p_sz_len);
-static const uint8_t *get_data(uint32_t *p_len);
 static void put_cstring(const char *sz_str);
+static void put_string(const char *p_str, uint32_t len);
 static fxp_handle_t *get_handle(void);
+static fxp_handle_t *handle_lookup(const sv_t *p_handle);
+static const char *sv_cstr(const sv_t *p_sv);
 
 static void get_attrs(attrs_t *p_attrs);
-static void put_attrs(attrs_t *p_attrs);
-static void attrs_to_tv(attrs_t *p_attr, struct timeval tv[2]);
+static void put_attrs(const attrs_t *p_attrs);
+
+/* Bulk encoding. Callers check once that the output buffer has room for the
+whole of what they write, then store fields through a pointer and account
+for them in one go. load_* reads bytes already known to be in the packet */
+static uint32_t load_uint32(const uint8_t *p_data);
+static uint64_t load_uint64(const uint8_t *p_data);
+static uint8_t *store_uint32(uint8_t *p_out, uint32_t data);
+static uint8_t *store_uint64(uint8_t *p_out, uint64_t data);
+static uint8_t *store_string(uint8_t *p_out, const char *p_str, uint32_t len);
+static uint8_t *attrs_encode(uint8_t *p_out, const attrs_t *p_attrs);
+
+/* Version 3 long names */
+static void longname_init(void);
+static uint8_t *longname_encode(uint8_t *p_str, const struct stat *p_st, const char *sz_name, uint32_t name_len);
+static char *longname_date(char *p_out, time_t mtime);
+static char *longname_decimal(char *p_out, uint64_t value);
+
+/* Path resolution */
+static void put_realpath_name(uint32_t id, const char *sz_path, const attrs_t *p_attr);
+static int resolve_path(const char *sz_path, char *sz_resolved);
+static unsigned realpath_cache_slot(const char *sz_key);
+static void attrs_to_ts(const attrs_t *p_attr, struct timespec ts[2]);
+static const char *realpath_cache_lookup(const char *sz_key);
+static void realpath_cache_insert(const char *sz_key, const char *sz_resolved);
+static void realpath_cache_flush(void);
+static int path_at(const char *sz_path, const char **p_sz_base);
+static void realpath_cache_forget(const char *sz_path);
+static ssh_bool_t path_under(const char *sz_path, size_t len, const char *sz_dir, size_t dir_len);
+static void dirfd_cache_init(void);
+static ssh_bool_t dir_watch_chain(const char *sz_path, size_t dir_len);
+#ifdef __linux__
+static int dir_watch_add(const char *sz_dir, size_t dir_len, uint32_t chain_start);
+static void dir_watch_unwatch(int wd);
+static void dir_watch_drop(dir_watch_t *p_watch);
+static void dirfd_forget(const char *sz_dir, size_t dir_len);
+static void dir_on_inotify(int fd, unsigned events);
+#endif
+static void path_caches_changed(const char *sz_path);
+static void fd_cache_forget(const char *sz_path);
+static int fd_cache_take(const char *sz_path, int flags, int dirfd, const char *sz_base, char **p_sz_path);
+static ssh_bool_t fd_cache_put(fxp_handle_t *p_handle);
+static uint32_t hash_bytes(const void *p_data, size_t len);
 
 /* Portability and POSIX <-> SFTP conversion */
 static int pflags_to_unix(uint32_t pflags);
+static int open_flags_to_unix(uint32_t access, uint32_t flags);
+static int rename_noreplace(int old_dirfd, const char *sz_old, int new_dirfd, const char *sz_new);
 static uint32_t errno_to_sftp(int unix_error);
 
 /* Handle management */
@@ -260,8 +840,75 @@ static unsigned long handle_alloc_dir(int fd, DIR *p_dir);
 
 /* Private data */
 static buff_t ibuff, obuff;
+static arena_t arena;
+static queue_t inq;
+static pbuf_t *p_out_head, *p_out_tail;
+static uint32_t out_bytes;
+static pool_t pool;
+static uint32_t max_packet = MAX_PACKET;
+static ssh_bool_t input_eof = SSH_FALSE;
+static ssh_bool_t decode_error = SSH_FALSE;
+static ssh_bool_t encode_error = SSH_FALSE;
+static uint32_t input_discard;      /* Bytes of an oversized packet still to skip */
+static ev_source_t ev_sources[MAX_EV_SOURCES];
+#ifdef __linux__
+static int epoll_fd = -1;
+#endif
 static ssh_bool_t have_init = SSH_FALSE;
+static uint32_t sftp_version = SFTP_MIN_VERSION;    /* Negotiated by INIT */
+static ssh_bool_t v3_times_ns = SSH_FALSE;          /* Send NIH_ATTR_TIMES_NS */
 static fxp_handle_t handles[MAX_HANDLES];
+static realpath_entry_t realpath_cache[REALPATH_CACHE_SIZE];
+static dirfd_entry_t dirfd_cache[DIRFD_CACHE_SIZE];
+static uint32_t dirfd_clock;
+static const dirfd_entry_t *p_dirfd_last;       /* Returned by the last path_at() */
+#ifdef __linux__
+static dir_watch_t dir_watches[DIRFD_WATCH_MAX];
+static int dir_inotify_fd = -1;
+#endif
+static ssh_bool_t realpath_indirect;            /* Symlink or ".." resolved since the last flush */
+static fd_entry_t fd_cache[FD_CACHE_SIZE];
+static uint32_t fd_clock;
+static shared_t *p_shared;
+static stats_t *p_stats;
+static const char *sz_stats_file;
+static volatile sig_atomic_t stats_requested;
+static FILE *p_trace;
+static const char *sz_trace_file;
+static struct timespec trace_start;
+static char *nocache_dirs[MAX_NOCACHE_DIRS];    /* -N, canonical */
+static size_t nocache_count;
+static size_t map_budget;                       /* -M, 0 for no map cache */
+static size_t map_bytes;
+static map_entry_t map_cache[MAP_CACHE_SIZE];
+static uint32_t map_clock;
+static sigjmp_buf map_jmp;
+static volatile sig_atomic_t map_copying;
+static uint32_t attr_ttl_ms;                    /* -A, 0 for no attribute cache */
+static attr_entry_t attr_cache[ATTR_CACHE_SIZE];
+static uint32_t attr_gen;                       /* Bumped by changes we make */
+static int attr_inotify_fd = -1;
+static attr_watch_t attr_watches[ATTR_WATCH_MAX];
+static uint32_t attr_clock;
+static bucket_t shape_bytes;                    /* -B */
+static bucket_t shape_ops;                      /* -I */
+static uint64_t shape_delay_ns;                 /* Until the next request is due */
+static char longname_perms[512][9];     /* rwxrwxrwx by mode & 0777 */
+static date_entry_t longname_dates[LONGNAME_DATE_CACHE_SIZE];
+
+static const extension_t extensions[] =
+{
+    { "remove-recursive@eddylangley.net", NIH_FX_EXT_VERSION, ext_remove_recursive },
+    { "mkdir-parents@eddylangley.net", NIH_FX_EXT_VERSION, ext_mkdir_parents },
+    { "expand-path@openssh.com", "1", ext_expand_path },
+    { "statvfs@openssh.com", "2", ext_statvfs },
+    { "fstatvfs@openssh.com", "2", ext_fstatvfs },
+    { "limits@openssh.com", "1", ext_limits },
+    { "lsetstat@openssh.com", "1", ext_lsetstat },
+    { "data-ranges@eddylangley.net", NIH_FX_EXT_VERSION, ext_data_ranges },
+    { "preallocate@eddylangley.net", NIH_FX_EXT_VERSION, ext_preallocate },
+    { NIH_ATTR_TIMES_NS, NIH_FX_EXT_VERSION, ext_times_ns }
+};
 
 #ifdef DBMULTI_sftpserver
 int sftp_server_main(int argc, const char **argv)
@@ -269,1240 +916,6226 @@ int sftp_server_main(int argc, const char **argv)
 int main(int argc, const char **argv)
 #endif
 {
-    (void)argc; /* Unused */
-    (void)argv; /* Unused */
+    const char *sz_daemon = NULL;
+    const char *sz_connect = NULL;
+    int opt;
 
-    for(;;)
+    while ((opt = getopt(argc, (char * const *)argv, "D:C:S:T:P:N:M:A:B:I:")) != -1)
     {
-        uint32_t payload_len, packet_len;
-        ssize_t temp;
-        buff_save_t save;
+        switch (opt)
+        {
+        case 'D':
+            sz_daemon = optarg;
+            break;
 
-        /* Read a 4-byte length header into start of packet buffer */
-        read_input(4);
-        payload_len = get_uint32();
+        case 'C':
+            sz_connect = optarg;
+            break;
 
-        /* Read the payload into the beginning of the packet buffer overwriting
-        length */
-        assert(payload_len <= sizeof(ibuff.data));
+        case 'S':
+            sz_stats_file = optarg;
+            break;
 
-        /* Read the rest of the packet */
-        read_input(payload_len);
+        case 'T':
+            sz_trace_file = optarg;
+            break;
 
-        /* We have a whole packet. Each input packet may generate up to one
-        output response. Initalise the output buffer with zero length then 
-        handle the packet */
-        obuff.p_data = obuff.data;
-        obuff.count = sizeof(obuff.data);
-        buff_save(&save);
-        put_uint32(0);
-        if (payload_len > 0)
-        {
-            /* This is a choice - we silently discard zero length input packets */
-            sftp_in();
-        }
-
-        /* Send response */
-        packet_len = sizeof(obuff.data) - obuff.count;
-        payload_len = packet_len - 4;
-        if (payload_len > 0)
-        {
-            uint8_t *p_out = obuff.data;
-
-            /* Write length to start of packet */
-            buff_swap(&save);
-            put_uint32(payload_len);
-            while (packet_len > 0)
-            {
-                fd_set wfds;
-                int retval;
-
-                /* Use select() to check the write will succeed just in case our 
-                parent process has marked the file descriptor non-blocking */
-                FD_ZERO(&wfds);
-                FD_SET(STDOUT_FILENO, &wfds);
-                retval = select(STDOUT_FILENO + 1, NULL, &wfds, NULL, NULL);
-                if (retval == -1)
-                {
-                    perror("select(stdout)");
-                    exit(EXIT_FAILURE);
-                }
+        case 'P':
+            max_packet = strtoul(optarg, NULL, 0);
+            if (max_packet < MIN_PACKET || max_packet > MAX_PACKET_LIMIT)
+            {
+                fprintf(stderr, "Packet size must be %d to %d\n", MIN_PACKET, MAX_PACKET_LIMIT);
+                exit(EXIT_FAILURE);
+            }
+            break;
 
-                temp = write(STDOUT_FILENO, p_out, packet_len);
-                if (temp < 0)
-                {
-                    perror("write()");
-                    exit(EXIT_FAILURE);
-                }
-                p_out += temp;
-                packet_len -= temp;
+        case 'N':
+            if (nocache_count == elemof(nocache_dirs))
+            {
+                fprintf(stderr, "At most %d -N directories\n", MAX_NOCACHE_DIRS);
+                exit(EXIT_FAILURE);
+            }
+            nocache_dirs[nocache_count] = realpath(optarg, NULL);
+            if (!nocache_dirs[nocache_count])
+            {
+                perror(optarg);
+                exit(EXIT_FAILURE);
             }
+            nocache_count++;
+            break;
+
+        case 'M':
+            map_budget = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'A':
+            attr_ttl_ms = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'B':
+            shape_bytes.rate = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'I':
+            shape_ops.rate = strtoull(optarg, NULL, 0);
+            break;
+
+        default:
+            fprintf(stderr, "usage: %s [-P max-packet] [-S stats-file] [-T trace-file] [-N dir]... [-M bytes] [-A ms] [-B bytes] [-I ops] [-D daemon-socket | -C daemon-socket]\n", argv[0]);
+            exit(EXIT_FAILURE);
         }
     }
+
+    shared_init();
+    longname_init();
+    if (sz_daemon)
+    {
+        /* Doesn't return */
+        daemon_run(sz_daemon);
+    }
+    if (sz_connect)
+    {
+        /* Only returns if there is no daemon to hand over to */
+        shim_run(sz_connect);
+    }
+    serve();
+    return EXIT_SUCCESS;
 }
 
-static void read_input(uint32_t len)
+/* Serve one session on stdin/stdout until the client disconnects. Requests are
+read, handled and replied to in batches: whatever requests have arrived are
+handled, their replies queued, and the queue written with as few calls as
+possible. Input and output are both non-blocking so a client that isn't
+reading its replies doesn't stop us reading its requests (up to the size of
+the input queue) */
+static void serve(void)
 {
-    ssize_t temp;
-
-    /* Initialise input packet */
-    ibuff.count = 0;
-    ibuff.p_data = ibuff.data;
+    inq.size = INPUT_QUEUE_PACKETS * (max_packet + 4);
+    inq.data = malloc(inq.size);
+    arena.size = max_packet;
+    arena.data = malloc(arena.size);
+    pool_init();
+    if (!inq.data || !arena.data)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK) < 0
+        || fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        perror("fcntl(O_NONBLOCK)");
+        exit(EXIT_FAILURE);
+    }
+    ev_init();
+    if (sz_stats_file)
+    {
+        stats_init();
+    }
+    if (sz_trace_file)
+    {
+        trace_init();
+    }
+    if (map_budget)
+    {
+        map_init();
+    }
+    if (attr_ttl_ms)
+    {
+        attr_cache_init();
+    }
+    dirfd_cache_init();
 
-    /* Read a 4-byte length header */
-    while (ibuff.count < len)
+    for (;;)
     {
-        fd_set rfds;
-        int retval;
+        ssh_bool_t blocked;
 
-        /* Watch STDIN with select(), just in case our parent process has
-        marked it non-blocking */
-        FD_ZERO(&rfds);
-        FD_SET(STDIN_FILENO, &rfds);
-        retval = select(STDIN_FILENO + 1, &rfds, NULL, NULL, NULL);
-        if (retval == -1)
+        if (stats_requested)
         {
-            perror("select(stdin)");
-            exit(EXIT_FAILURE);
+            stats_requested = 0;
+            stats_dump("signal");
         }
+        blocked = process_input();
+        flush_output();
 
-        temp = read(STDIN_FILENO, &ibuff.data[ibuff.count], len - ibuff.count);
-        if (temp < 0)
+        if (input_eof && inq.head == inq.tail && !p_out_head)
         {
-            perror("header read()");
-            exit(EXIT_FAILURE);
+            exit(EXIT_SUCCESS);
         }
-        else if (temp == 0)
+
+        /* The output queue held up requests and drained without waiting,
+        so nothing will wake us to handle them */
+        if (blocked && !p_out_head)
         {
-            /* End of file */
-            exit(EXIT_SUCCESS);
+            continue;
         }
-        ibuff.count += temp;
+
+        /* Read more unless there's no room for it */
+        queue_compact(&inq);
+        ev_set(STDIN_FILENO, (!input_eof && inq.tail < inq.size) ? EV_READ : 0, on_input);
+        ev_wait(shape_delay_ns ? (int)((shape_delay_ns + 999999) / 1000000) : -1);
     }
 }
 
-static void sftp_in(void)
+/* Handle every complete packet in the input queue, until the output queue is
+full. Each reply is built in a pooled buffer sized for the request. Returns
+SSH_TRUE if the output queue stopped it */
+static ssh_bool_t process_input(void)
 {
-    /* Obtain the opcode - will fail if zero length packet */
-    uint8_t opcode = get_byte();
+    ssh_bool_t incomplete = SSH_FALSE;
+    ssh_bool_t blocked = SSH_FALSE;
+    uint32_t batch = 0;
 
-    /* INIT must be the first packet */
-    if (!have_init)
+    if (p_stats && inq.tail - inq.head > p_stats->input_peak)
     {
-        assert(opcode == SSH_FXP_INIT);
-        sftp_init();
-        have_init = SSH_TRUE;
-        return;
+        p_stats->input_peak = inq.tail - inq.head;
     }
-    switch (opcode)
+    shape_delay_ns = 0;
+    for (;;)
     {
-    case SSH_FXP_INIT:
-        /* Don't allow INIT more than once */
-        fprintf(stderr,"Can't INIT twice\n");
-        exit(EXIT_FAILURE);
-        break;
-
-    case SSH_FXP_OPEN:
-        sftp_open();
-        break;
-
-    case SSH_FXP_CLOSE:
-        sftp_close();
-        break;
-
-    case SSH_FXP_READ:
-        sftp_read();
-        break;
-
-    case SSH_FXP_WRITE:
-        sftp_write();
-        break;
+        uint32_t available = inq.tail - inq.head;
+        uint32_t payload_len;
+        pbuf_t *p_buf;
 
-    case SSH_FXP_LSTAT:
-        sftp_lstat();
-        break;
-
-    case SSH_FXP_FSTAT:
-        sftp_fstat();
-        break;
-
-    case SSH_FXP_SETSTAT:
-        sftp_setstat();
-        break;
-
-    case SSH_FXP_FSETSTAT:
-        sftp_fsetstat();
-        break;
-
-    case SSH_FXP_OPENDIR:
-        sftp_opendir();
-        break;
-
-    case SSH_FXP_READDIR:
-        sftp_readdir();
-        break;
-
-    case SSH_FXP_REMOVE:
-        sftp_remove();
-        break;
-
-    case SSH_FXP_MKDIR:
-        sftp_mkdir();
-        break;
-
-    case SSH_FXP_RMDIR:
-        sftp_rmdir();
-        break;
-
-    case SSH_FXP_REALPATH:
-        sftp_realpath();
-        break;
-
-    case SSH_FXP_STAT:
-        sftp_stat();
-        break;
+        if (input_discard > 0)
+        {
+            /* Skip the rest of an oversized packet as it arrives */
+            uint32_t skip = available < input_discard ? available : input_discard;
 
-    case SSH_FXP_RENAME:
-        sftp_rename();
-        break;
+            inq.head += skip;
+            input_discard -= skip;
+            if (input_discard > 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if (available < 4)
+        {
+            incomplete = available > 0;
+            break;
+        }
+        if (out_bytes >= OUTPUT_QUEUE_PACKETS * max_packet)
+        {
+            blocked = SSH_TRUE;
+            break;
+        }
+        ibuff.p_data = &inq.data[inq.head];
+        ibuff.count = available;
+        payload_len = get_uint32();
+        if (payload_len > max_packet)
+        {
+            /* Too big for the input queue. Answer it once we have its id,
+            then throw it away without buffering it */
+            if (available < 4 + 5)
+            {
+                incomplete = SSH_TRUE;
+                break;
+            }
+            (void)get_byte();
+            p_buf = pool_get(POOL_SMALL_SIZE);
+            put_status(get_uint32(), SSH_FX_BAD_MESSAGE);
+            queue_reply(p_buf);
+            inq.head += 4 + 5;
+            input_discard = payload_len - 5;
+            batch++;
+            continue;
+        }
+        if (available - 4 < payload_len)
+        {
+            incomplete = SSH_TRUE;
+            break;
+        }
 
-    case SSH_FXP_READLINK:
-        sftp_readlink();
-        break;
+        /* READs and WRITEs are scheduled between handles a run at a time,
+        after any requests behind READs which only look at things */
+        if (payload_len >= 5
+            && (inq.data[inq.head + 4] == SSH_FXP_READ || inq.data[inq.head + 4] == SSH_FXP_WRITE))
+        {
+            uint32_t before;
 
-    case SSH_FXP_SYMLINK:
-        sftp_symlink();
-        break;
+            batch += look_ahead(inq.head);
+            before = batch;
+            if (sched_run(&batch))
+            {
+                blocked = !shape_delay_ns;
+                break;
+            }
+            if (batch != before)
+            {
+                continue;
+            }
+        }
 
-    default:
-        /* All (non-INIT) packets begin with an ID and all responses echo it */
-        put_status(get_uint32(), SSH_FX_OP_UNSUPPORTED);
-        break;
+        /* We have a whole packet. Each input packet may generate up to one
+        output response */
+        inq.head += 4 + payload_len;
+        batch++;
+        if (payload_len < 5)
+        {
+            /* This is a choice - we silently discard zero length input packets,
+            and any too short to hold an id (or INIT's version) as there would
+            be nothing to echo in a reply */
+            continue;
+        }
+        handle_packet(&inq.data[inq.head - payload_len], payload_len);
+    }
+    if (p_stats)
+    {
+        p_stats->packets_in += batch;
+        if (batch > p_stats->batch_peak)
+        {
+            p_stats->batch_peak = batch;
+        }
+        if (out_bytes > p_stats->output_peak)
+        {
+            p_stats->output_peak = out_bytes;
+        }
     }
+    if (input_eof && incomplete)
+    {
+        /* Partial packet which will never be completed */
+        inq.head = inq.tail;
+    }
+    if (input_eof && input_discard > 0 && inq.head == inq.tail)
+    {
+        input_discard = 0;
+    }
+    if (inq.head == inq.tail)
+    {
+        inq.head = inq.tail = 0;
+    }
+    return blocked;
 }
 
-static void sftp_init(void)
+/* Handle one whole packet, without its length, and queue its reply */
+static void handle_packet(uint8_t *p_packet, uint32_t len)
 {
-    uint32_t version = get_uint32();
+    request_t req;
+    pbuf_t *p_buf;
 
-    /* For now we'll be version 3 */
-    assert(version >= SFTP_PROTOCOL_VERSION);
+    ibuff.p_data = p_packet;
+    ibuff.count = len;
+    if (p_stats || p_trace)
+    {
+        struct timespec start, end;
+        uint64_t ns;
 
-    /* Reply with our version */
-    put_byte(SSH_FXP_VERSION);
-    put_uint32(SFTP_PROTOCOL_VERSION);
-    /* No extension pairs */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (p_trace)
+        {
+            /* The reply half of the record follows once it is handled */
+            trace_request(p_packet, len, &start);
+        }
+        decode_request(&req);
+        p_buf = pool_get(reply_size(&req));
+        sftp_in(&req);
+        reply_check(req.id);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + end.tv_nsec - start.tv_nsec;
+        if (p_stats)
+        {
+            stats_request(req.type, ns);
+        }
+        if (p_trace)
+        {
+            trace_reply(ns);
+        }
+    }
+    else
+    {
+        decode_request(&req);
+        p_buf = pool_get(reply_size(&req));
+        sftp_in(&req);
+        reply_check(req.id);
+    }
+    queue_reply(p_buf);
 }
 
-static void sftp_open(void)
+/* Handle the run of READs and WRITEs at the head of the input queue, taking
+turns between their handles so that one big transfer doesn't hold up small
+ones: deficit round robin, each handle's turn allowing SCHED_QUANTUM bytes
+more. Each handle's requests stay in order, and the run ends at anything
+else, so requests on a file are handled in the order they arrived. So are
+the whole run's if it writes to a file open through two of its handles.
+
+Whatever can't be handled yet - the output queue filled, or the rate limit
+was reached - is left at the head of the queue in its original order, and
+SSH_TRUE returned */
+static ssh_bool_t sched_run(uint32_t *p_batch)
 {
-    uint32_t id;
-    const char *sz_filename;
-    uint32_t pflags;
-    attrs_t attrs;
-    int fd,flags;
-    mode_t mode;
-    uint32_t status = SSH_FX_FAILURE;
-
-    /* Read input packet */
-    id = get_uint32();
-    sz_filename = get_string(NULL);
-    pflags = get_uint32();
-    get_attrs(&attrs);
-    flags = pflags_to_unix(pflags);
-    mode = attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS ? attrs.permissions : DEFAULT_FILE_PERM;
+    sched_entry_t entries[SCHED_WINDOW];
+    /* One group per handle, and one for requests with invalid handles */
+    fxp_handle_t *p_group_handles[MAX_HANDLES + 1];
+    uint32_t group_heads[MAX_HANDLES + 1];
+    uint32_t group_tails[MAX_HANDLES + 1];
+    uint32_t deficits[MAX_HANDLES + 1];
+    uint32_t count = 0;
+    uint32_t groups = 0;
+    uint32_t posn = inq.head;
+    uint32_t end, i, g;
+    ssh_bool_t writes = SSH_FALSE;
+    ssh_bool_t stopped = SSH_FALSE;
 
-    /* Open file */
-    fd = open(sz_filename, flags, mode);
-    if (fd < 0)
-    {
-        status = errno_to_sftp(errno);
-    }
-    else
+    while (count < SCHED_WINDOW && inq.tail - posn >= 4)
     {
-        unsigned long handle = handle_alloc_file(fd);
-        if (handle == 0)
+        uint32_t len = load_uint32(&inq.data[posn]);
+        const uint8_t *p_packet = &inq.data[posn + 4];
+        fxp_handle_t *p_handle;
+        sv_t handle;
+
+        if (len < 9 || len > max_packet || inq.tail - posn - 4 < len
+            || (p_packet[0] != SSH_FXP_READ && p_packet[0] != SSH_FXP_WRITE))
         {
-            /* Out of handles */
-            close(fd);
+            break;
+        }
+        handle.len = load_uint32(p_packet + 5);
+        if (handle.len > len - 9)
+        {
+            break;
+        }
+        handle.p_data = p_packet + 9;
+        p_handle = handle_lookup(&handle);
+        for (g = 0; g < groups && p_group_handles[g] != p_handle; g++)
+        {
+        }
+        if (g == groups)
+        {
+            p_group_handles[g] = p_handle;
+            group_heads[g] = count;
+            deficits[g] = 0;
+            groups++;
         }
         else
         {
-            /* We have opened the file and successfully given it a handle */
-            put_handle(id, handle);
-            return;
+            entries[group_tails[g]].next = count;
         }
+        group_tails[g] = count;
+        entries[count].posn = posn;
+        entries[count].len = len;
+        entries[count].cost = request_bytes(p_packet, len);
+        entries[count].next = SCHED_WINDOW;
+        entries[count].done = SSH_FALSE;
+        writes |= p_packet[0] == SSH_FXP_WRITE;
+        posn += 4 + len;
+        count++;
     }
-    put_status(id, status);
-}
-
-static void sftp_close(void)
-{
-    uint32_t id;
-    uint32_t status = SSH_FX_OK;
-    fxp_handle_t *p_handle;
-
-    id = get_uint32();
-    p_handle = get_handle();
+    end = posn;
 
-    if (!p_handle)
+    if (groups == 1 || (writes && !sched_distinct(p_group_handles, groups)))
     {
-        status = SSH_FX_FAILURE;
+        for (i = 0; i < count && !stopped; i++)
+        {
+            stopped = sched_emit(&entries[i], p_batch);
+        }
     }
     else
     {
-        if (p_handle->use == HANDLE_FILE)
+        uint32_t left = count;
+
+        while (left > 0 && !stopped)
         {
-            if (-1 == close(p_handle->fd))
+            for (g = 0; g < groups && !stopped; g++)
             {
-                status = errno_to_sftp(errno);
+                if (group_heads[g] == SCHED_WINDOW)
+                {
+                    continue;
+                }
+                deficits[g] += SCHED_QUANTUM;
+                while (group_heads[g] != SCHED_WINDOW && entries[group_heads[g]].cost <= deficits[g])
+                {
+                    sched_entry_t *p_entry = &entries[group_heads[g]];
+
+                    if (sched_emit(p_entry, p_batch))
+                    {
+                        stopped = SSH_TRUE;
+                        break;
+                    }
+                    deficits[g] -= p_entry->cost;
+                    group_heads[g] = p_entry->next;
+                    left--;
+                }
+                if (group_heads[g] == SCHED_WINDOW)
+                {
+                    deficits[g] = 0;
+                }
             }
         }
-        else if (p_handle->use == HANDLE_DIR)
+    }
+
+    /* Close up what's left against the end of the run */
+    for (i = count; i-- > 0; )
+    {
+        if (!entries[i].done)
         {
-            /* closedir() also closes the underlying  file  descriptor  associated  with  p_dir */
-            if (-1 == closedir(p_handle->p_dir))
-            {
-                status = errno_to_sftp(errno);
-            }
+            end -= 4 + entries[i].len;
+            memmove(&inq.data[end], &inq.data[entries[i].posn], 4 + entries[i].len);
         }
-        /* Free handle. p_handle->use invalid is successfully freed but should never occur */
-        p_handle->use = HANDLE_FREE;
     }
-    put_status(id, status);
+    inq.head = end;
+    return stopped;
 }
 
-static void sftp_read(void)
+/* Handle one request of a run unless it must wait, returning SSH_TRUE if so */
+static ssh_bool_t sched_emit(sched_entry_t *p_entry, uint32_t *p_batch)
 {
-    /* DATA packet begins opcode, id, length-of-data */
-    const uint32_t hdr_size = 1 + 4 + 4;
-    uint32_t id, len, max_len;
-    fxp_handle_t *p_handle;
-    uint64_t offset;
-    int status = SSH_FX_FAILURE;
-
-    /* Read request */
-    id = get_uint32();
-    p_handle = get_handle();
-    offset = get_uint64();
-    len = get_uint32();
-
-    /* Maximum read length must fit in buffer after header.
-    !!! TODO - Different SFTP drafts say different things about shortening reads */
-    max_len = obuff.count - hdr_size;
-    if (len > max_len)
+    if (out_bytes >= OUTPUT_QUEUE_PACKETS * max_packet)
     {
-        len = max_len;
+        return SSH_TRUE;
     }
-    if (p_handle && p_handle->use == HANDLE_FILE)
+    if (shape_bytes.rate || shape_ops.rate)
     {
-        if (lseek(p_handle->fd, offset, SEEK_SET) < 0)
+        shape_delay_ns = shape_admit(&inq.data[p_entry->posn + 4], p_entry->len);
+        if (shape_delay_ns)
         {
-            status = errno_to_sftp(errno);
+            return SSH_TRUE;
         }
-        else
-        {
-            /* Read the data directly into the output buffer */
-            int ret = read(p_handle->fd, &obuff.p_data[hdr_size], len);
+    }
+    handle_packet(&inq.data[p_entry->posn + 4], p_entry->len);
+    p_entry->done = SSH_TRUE;
+    (*p_batch)++;
+    return SSH_FALSE;
+}
 
-            if (ret < 0)
-            {
-                status = errno_to_sftp(errno);
-            }
-            else if (ret == 0)
+/* Are the handles all of different files? Each handle's identity is looked up
+the first time it's needed */
+static ssh_bool_t sched_distinct(fxp_handle_t **pp_handles, uint32_t count)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < count; i++)
+    {
+        fxp_handle_t *p_handle = pp_handles[i];
+        struct stat st;
+
+        if (p_handle && !p_handle->have_ident)
+        {
+            if (fstat(p_handle->fd, &st) < 0)
             {
-                status = SSH_FX_EOF;
+                return SSH_FALSE;
             }
-            else
+            p_handle->dev = st.st_dev;
+            p_handle->ino = st.st_ino;
+            p_handle->have_ident = SSH_TRUE;
+        }
+    }
+    for (i = 0; i < count; i++)
+    {
+        for (j = i + 1; j < count; j++)
+        {
+            if (pp_handles[i] && pp_handles[j] && pp_handles[i]->dev == pp_handles[j]->dev
+                && pp_handles[i]->ino == pp_handles[j]->ino)
             {
-                /* Successful read some data (may be less than we requested) */
-                assert((unsigned)ret <= len);
-                put_byte(SSH_FXP_DATA);
-                put_uint32(id);
-                put_uint32(ret);
-                obuff.count -= ret;
-                obuff.p_data += ret;
-                return;
+                return SSH_FALSE;
             }
         }
     }
-    put_status(id, status);
+    return SSH_TRUE;
 }
 
-static void sftp_write(void)
+/* The data bytes a READ or WRITE moves, 0 for anything else */
+static uint32_t request_bytes(const uint8_t *p_packet, uint32_t len)
 {
-    uint32_t id;
-    fxp_handle_t *p_handle;
-    uint64_t offset;
-    const uint8_t *p_data;
-    uint32_t data_len;
-    int status = SSH_FX_FAILURE;
+    uint32_t bytes = 0;
 
-    /* Parse packet */
-    id = get_uint32();
-    p_handle = get_handle();
-    offset = get_uint64();
-    p_data = get_data(&data_len);
-
-    if (p_handle && p_handle->use == HANDLE_FILE)
+    if (p_packet[0] == SSH_FXP_READ && len >= 5 + 4 + 8 + 4)
     {
-        if (lseek(p_handle->fd, offset, SEEK_SET) < 0)
+        /* The length is the last field. No more than a packet is sent */
+        bytes = load_uint32(p_packet + len - 4);
+        if (bytes > max_packet)
         {
-            status = errno_to_sftp(errno);
+            bytes = max_packet;
         }
-        else
-        {
-            int ret = write(p_handle->fd, p_data, data_len);
+    }
+    else if (p_packet[0] == SSH_FXP_WRITE && len >= 5 + 4 + 8 + 4)
+    {
+        /* All but the id, handle, offset and data length */
+        uint32_t handle_len = load_uint32(p_packet + 5);
 
-            if (ret < 0)
-            {
-                status = errno_to_sftp(errno);
-            }
-            else if ((unsigned)ret == data_len)
-            {
-                status = SSH_FX_OK;
-            }
+        if (handle_len <= len - (5 + 4 + 8 + 4))
+        {
+            bytes = len - (5 + 4 + handle_len + 8 + 4);
         }
     }
-    put_status(id, status);
+    return bytes;
 }
 
-static void stat_to_attr(struct stat *p_stat, attrs_t *p_attr)
+/* Rate limits for -B and -I. READ and WRITE are charged their data length
+and one request; anything else goes through. Returns 0 having charged them
+if the packet may be handled now, else how many ns until it may */
+static uint64_t shape_admit(const uint8_t *p_packet, uint32_t len)
 {
-    memset(p_attr, 0, sizeof(*p_attr));
-    p_attr->flags = SSH_FILEXFER_ATTR_SIZE
-        | SSH_FILEXFER_ATTR_UIDGID
-        | SSH_FILEXFER_ATTR_PERMISSIONS
-        | SSH_FILEXFER_ATTR_ACMODTIME;
-    p_attr->size = p_stat->st_size;
-    p_attr->uid = p_stat->st_uid;
-    p_attr->gid = p_stat->st_gid;
-    p_attr->permissions = p_stat->st_mode;
-    p_attr->atime = p_stat->st_atime;
-    p_attr->mtime = p_stat->st_mtime;
-}
+    struct timespec now_ts;
+    uint64_t now, delay, ops_delay;
+    uint64_t bytes;
 
-static void do_stat(ssh_bool_t follow_symlinks)
-{
-    uint32_t id = get_uint32();
-    const char *sz_path = get_string(NULL);
-    struct stat st;
-    int ret = follow_symlinks ? stat(sz_path, &st) : lstat(sz_path, &st);
+    if (p_packet[0] != SSH_FXP_READ && p_packet[0] != SSH_FXP_WRITE)
+    {
+        return 0;
+    }
+    bytes = request_bytes(p_packet, len);
 
-    if (ret < 0)
+    clock_gettime(CLOCK_MONOTONIC, &now_ts);
+    now = (uint64_t)now_ts.tv_sec * 1000000000u + now_ts.tv_nsec;
+    delay = bucket_delay(&shape_bytes, now);
+    ops_delay = bucket_delay(&shape_ops, now);
+    if (ops_delay > delay)
     {
-        put_status(id, errno_to_sftp(errno));
+        delay = ops_delay;
     }
-    else
+    if (delay == 0)
     {
-        attrs_t attr;
-        stat_to_attr(&st, &attr);
-        put_byte(SSH_FXP_ATTRS);
-        put_uint32(id);
-        put_attrs(&attr);
+        bucket_charge(&shape_bytes, now, bytes);
+        bucket_charge(&shape_ops, now, 1);
     }
+    return delay;
 }
 
-static void sftp_stat(void)
-{
-    do_stat(SSH_TRUE);
-}
-
-static void sftp_lstat(void)
-{
-    do_stat(SSH_FALSE);
-}
-
-static void sftp_fstat(void)
+/* Answer requests queued behind READs which only look at things - metadata
+before bulk data, whether the READs are waiting for the rate limit or for
+room in the output queue, or would just take a while. They are removed from
+the input queue as they're handled. Results are the same as if they had
+waited, since READs change nothing, but anything else ends the search, as it
+would be reordered against the READs; so a WRITE is a barrier. posn is where
+the first READ's length starts; returns the number of packets handled */
+static uint32_t look_ahead(uint32_t posn)
 {
-    uint32_t id = get_uint32();
-    fxp_handle_t *p_handle = get_handle();
-    uint32_t status = SSH_FX_FAILURE;
+    uint32_t handled = 0;
 
-    if (p_handle && p_handle->use == HANDLE_FILE)
+    if (inq.data[posn + 4] != SSH_FXP_READ)
     {
-        struct stat st;
-        if (fstat(p_handle->fd, &st) == 0)
+        return 0;
+    }
+    while (inq.tail - posn >= 4 && out_bytes < OUTPUT_QUEUE_PACKETS * max_packet)
+    {
+        uint32_t len = load_uint32(&inq.data[posn]);
+
+        if (len < 5 || len > max_packet || inq.tail - posn - 4 < len)
         {
-            attrs_t attr;
-            stat_to_attr(&st, &attr);
-            put_byte(SSH_FXP_ATTRS);
-            put_uint32(id);
-            put_attrs(&attr);
-            return;
+            break;
         }
-        else
+        switch (inq.data[posn + 4])
         {
-            status = errno_to_sftp(errno);
+        case SSH_FXP_READ:
+            posn += 4 + len;
+            continue;
+
+        case SSH_FXP_STAT:
+        case SSH_FXP_LSTAT:
+        case SSH_FXP_FSTAT:
+        case SSH_FXP_REALPATH:
+        case SSH_FXP_READLINK:
+            handle_packet(&inq.data[posn + 4], len);
+            memmove(&inq.data[posn], &inq.data[posn + 4 + len], inq.tail - (posn + 4 + len));
+            inq.tail -= 4 + len;
+            handled++;
+            continue;
+
+        default:
+            break;
         }
+        break;
     }
-    put_status(id, status);
+    return handled;
 }
 
-static void sftp_setstat(void)
+/* How long until a request is due, allowing a burst of SHAPE_BURST_NS */
+static uint64_t bucket_delay(const bucket_t *p_bucket, uint64_t now)
 {
-    uint32_t id = get_uint32();
-    const char *sz_path = get_string(NULL);
-    attrs_t attr;
+    if (p_bucket->rate == 0 || p_bucket->due <= now + SHAPE_BURST_NS)
+    {
+        return 0;
+    }
+    return p_bucket->due - now - SHAPE_BURST_NS;
+}
 
-    get_attrs(&attr);
-    if (attr.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+static void bucket_charge(bucket_t *p_bucket, uint64_t now, uint64_t cost)
+{
+    if (p_bucket->rate == 0)
     {
-        if (chmod(sz_path, attr.permissions & PERM_MASK) < 0)
-        {
-            put_status(id, errno_to_sftp(errno));
-            return;
-        }
+        return;
     }
-    if (attr.flags & SSH_FILEXFER_ATTR_ACMODTIME)
+    if (p_bucket->due < now)
     {
-        struct timeval tv[2];
+        p_bucket->due = now;
+    }
+    p_bucket->due += cost * 1000000000u / p_bucket->rate;
+}
+
+/* stdin is readable */
+static void on_input(int fd, unsigned events)
+{
+    ssize_t temp;
 
-        attrs_to_tv(&attr, tv);
-        if (utimes(sz_path, tv) < 0)
+    (void)events;
+    temp = read(fd, &inq.data[inq.tail], inq.size - inq.tail);
+    STATS_ADD(sys_read, 1);
+    if (temp < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
         {
-            put_status(id, errno_to_sftp(errno));
-            return;
+            perror("read()");
+            exit(EXIT_FAILURE);
         }
     }
-    if (attr.flags & SSH_FILEXFER_ATTR_UIDGID)
+    else if (temp == 0)
     {
-        if (chown(sz_path, attr.uid, attr.gid) < 0)
-        {
-            put_status(id, errno_to_sftp(errno));
-            return;
-        }
+        /* End of file. Any partial packet is discarded once we've dealt
+        with everything before it */
+        input_eof = SSH_TRUE;
+    }
+    else
+    {
+        inq.tail += temp;
+        STATS_ADD(bytes_in, temp);
     }
-    put_status(id, SSH_FX_OK);
 }
 
-static void sftp_fsetstat(void)
+/* stdout is writable again */
+static void on_output(int fd, unsigned events)
 {
-#ifdef _BSD_SOURCE
-    uint32_t id = get_uint32();
-    fxp_handle_t *p_handle = get_handle();
-    uint32_t status = SSH_FX_FAILURE;
-    attrs_t attr;
+    (void)fd;
+    (void)events;
+    flush_output();
+}
 
-    get_attrs(&attr);
-    if (p_handle && p_handle->use == HANDLE_FILE)
+/* Write as much of the output queue as stdout will take, gathering the
+waiting replies into one writev(). If it won't take it all, wait for it to
+become writable */
+static void flush_output(void)
+{
+    while (p_out_head)
     {
-        if (attr.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+        struct iovec iov[OUTPUT_IOV_MAX];
+        pbuf_t *p_buf;
+        ssize_t temp;
+        int count = 0;
+
+        for (p_buf = p_out_head; p_buf && count < OUTPUT_IOV_MAX; p_buf = p_buf->p_next)
         {
-            if (fchmod(p_handle->fd, attr.permissions & 0777) < 0)
-            {
-                put_status(id, errno_to_sftp(errno));
-                return;
-            }
+            iov[count].iov_base = &p_buf->data[p_buf->sent];
+            iov[count].iov_len = p_buf->len - p_buf->sent;
+            count++;
         }
-        if (attr.flags & SSH_FILEXFER_ATTR_ACMODTIME)
+        temp = writev(STDOUT_FILENO, iov, count);
+        STATS_ADD(sys_write, 1);
+        if (temp < 0)
         {
-            struct timeval tv[2];
-            attrs_to_tv(&attr, tv);
-            if (futimes(p_handle->fd, tv) < 0)
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                put_status(id, errno_to_sftp(errno));
+                ev_set(STDOUT_FILENO, EV_WRITE, on_output);
                 return;
             }
+            perror("writev()");
+            exit(EXIT_FAILURE);
         }
-        if (attr.flags & SSH_FILEXFER_ATTR_UIDGID)
+
+        /* Return the buffers which were written completely */
+        out_bytes -= temp;
+        while (temp > 0)
         {
-            if (fchown(p_handle->fd, attr.uid, attr.gid) < 0)
+            uint32_t left = p_out_head->len - p_out_head->sent;
+
+            if ((size_t)temp < left)
             {
-                put_status(id, errno_to_sftp(errno));
-                return;
+                p_out_head->sent += temp;
+                break;
             }
+            temp -= left;
+            p_buf = p_out_head;
+            p_out_head = p_buf->p_next;
+            pool_put(p_buf);
+        }
+        if (!p_out_head)
+        {
+            p_out_tail = NULL;
         }
-        status = SSH_FX_OK;
     }
-    put_status(id, status);
-#else
-    put_status(get_uint32(), SSH_FX_OP_UNSUPPORTED);    
-#endif
+    ev_set(STDOUT_FILENO, 0, on_output);
 }
 
-static void sftp_opendir(void)
+/* Move the unconsumed bytes to the start of the queue */
+static void queue_compact(queue_t *p_queue)
 {
-    int fd;
-    DIR *p_dir;
-    uint32_t id = get_uint32();
-    const char *sz_path = get_string(NULL);
-    int status = SSH_FX_FAILURE;
+    if (p_queue->head > 0)
+    {
+        memmove(p_queue->data, &p_queue->data[p_queue->head], p_queue->tail - p_queue->head);
+        p_queue->tail -= p_queue->head;
+        p_queue->head = 0;
+    }
+}
 
-    /* Open the directory and obtain both a DIR* and a file descriptor.
-    Later, when we come to read the directory this allows us to stat
-    files in the directory without having to store or catenate the path
-    to the files */
-    fd = open(sz_path, O_RDONLY);
-    if (fd == -1)
+/* Queue the reply built in p_buf, filling in its length. A buffer with no
+reply in it goes straight back to the pool */
+static void queue_reply(pbuf_t *p_buf)
+{
+    uint32_t packet_len = obuff.size - obuff.count;
+    uint32_t payload_len = packet_len - 4;
+
+    if (payload_len == 0)
     {
-        status = errno_to_sftp(errno);
+        pool_put(p_buf);
+        return;
+    }
+    p_buf->data[0] = (uint8_t)(payload_len >> 24);
+    p_buf->data[1] = (uint8_t)(payload_len >> 16);
+    p_buf->data[2] = (uint8_t)(payload_len >> 8);
+    p_buf->data[3] = (uint8_t)payload_len;
+    p_buf->len = packet_len;
+    p_buf->sent = 0;
+    p_buf->p_next = NULL;
+    if (p_out_tail)
+    {
+        p_out_tail->p_next = p_buf;
     }
     else
     {
-        p_dir = fdopendir(fd);
-        if (!p_dir)
-        {
-            status = errno_to_sftp(errno);
-        }
-        else
-        {
-            unsigned long handle = handle_alloc_dir(fd, p_dir);
-            if (handle != 0)
-            {
-                put_handle(id, handle);
-                return;
-            }
-        }
+        p_out_head = p_buf;
     }
-    put_status(id, status);
+    p_out_tail = p_buf;
+    out_bytes += packet_len;
+    STATS_ADD(packets_out, 1);
+    STATS_ADD(bytes_out, packet_len);
 }
 
-static char *get_longname(char *str, const struct stat *st, const struct dirent *dir_entry)
+/* Reply buffer pool. Buffers come in POOL_CLASSES sizes, the largest being a
+whole packet plus its length field; returned buffers are kept on a free list
+per class, up to POOL_MAX_FREE each, so memory stays bounded by the output
+queue limit plus the free lists */
+static void pool_init(void)
 {
-    char mode_str[11] = { '\0' };
-    jev_strmode(st->st_mode, mode_str);
-
-    nlink_t num_links = st->st_nlink;
-
-    uid_t uid = st->st_uid;
-    //struct passwd passwd_st;
-    //size_t passwd_buf_max_sz = sysconf(_SC_GETPW_R_SIZE_MAX);
-    //char *passwd_buf = malloc(passwd_buf_max_sz);
-    //assert(passwd_buf);
-    //char passwd_buf[MAX_USR_GRP_LEN];
-    struct passwd *passwd_st_res;
-    //assert(!getpwuid_r(uid, &passwd_st, passwd_buf, passwd_buf_max_sz, &passwd_st_res));
-    //assert(!getpwuid_r(uid, &passwd_st, passwd_buf, sizeof(passwd_buf), &passwd_st_res));
-    passwd_st_res = getpwuid(uid);
-    assert(passwd_st_res);
-
-    gid_t gid = st->st_gid;
-    //struct group group_st;
-    //size_t group_buf_max_sz = sysconf(_SC_GETGR_R_SIZE_MAX);
-    //char *group_buf = malloc(group_buf_max_sz);
-    //assert(group_buf);
-    //char group_buf[MAX_USR_GRP_LEN];
-    struct group *group_st_res;
-    //assert(!getgrgid_r(gid, &group_st, group_buf, group_buf_max_sz, &group_st_res));
-    //assert(!getgrgid_r(gid, &group_st, group_buf, sizeof(group_buf), &group_st_res));
-    group_st_res = getgrgid(gid);
-    assert(group_st_res);
+    pool.class_size[0] = POOL_SMALL_SIZE;
+    pool.class_size[1] = POOL_MEDIUM_SIZE;
+    pool.class_size[2] = max_packet + 4;
+}
 
-    off_t sz = st->st_size;
+/* A buffer of at least size bytes, which must be no more than the largest
+class. Its contents are undefined */
+static pbuf_t *pool_get(uint32_t size)
+{
+    unsigned c;
+    pbuf_t *p_buf;
 
-    struct tm t_st;
-    struct tm *t = gmtime_r(&st->st_mtime, &t_st);
-    assert(t);
+    for (c = 0; c < POOL_CLASSES - 1 && pool.class_size[c] < size; c++)
+    {
+    }
+    assert(size <= pool.class_size[c]);
+    p_buf = pool.p_free[c];
+    if (p_buf)
+    {
+        pool.p_free[c] = p_buf->p_next;
+        pool.free_count[c]--;
+    }
+    else
+    {
+        p_buf = malloc(sizeof(*p_buf) + pool.class_size[c]);
+        if (!p_buf)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        p_buf->size = pool.class_size[c];
+        STATS_ADD(buffers_allocated, 1);
+    }
 
-    // snprintf(str, MAX_LONGNAME_LEN, "%s\t%d\t%s\t%s\t%lu\t%04d-%02u-%02u %02u:%02u\t%s",
-    snprintf(str, MAX_LONGNAME_LEN, "%s %d %s %s %lu %04d-%02u-%02u %02u:%02u %s",
-        mode_str, num_links, passwd_st_res->pw_name, group_st_res->gr_name, (unsigned long)sz,
-        1900 + t->tm_year, t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min,
-        dir_entry->d_name
-    );
+    /* Replies are built in the buffer, starting with room for the length */
+    obuff.data = p_buf->data;
+    obuff.size = p_buf->size;
+    obuff.p_data = obuff.data;
+    obuff.count = obuff.size;
+    encode_error = SSH_FALSE;
+    put_uint32(0);
+    return p_buf;
+}
 
-    //free(passwd_buf);
-    //free(group_buf);
+static void pool_put(pbuf_t *p_buf)
+{
+    unsigned c;
 
-    return str;
+    for (c = 0; c < POOL_CLASSES - 1 && pool.class_size[c] != p_buf->size; c++)
+    {
+    }
+    if (pool.free_count[c] < POOL_MAX_FREE)
+    {
+        p_buf->p_next = pool.p_free[c];
+        pool.p_free[c] = p_buf;
+        pool.free_count[c]++;
+    }
+    else
+    {
+        free(p_buf);
+    }
 }
 
-static void sftp_readdir(void)
+static void sftp_in(const request_t *p_req)
 {
-    buff_save_t save1,save2;
-    uint32_t count = 0;
-    struct dirent *p_entry;
-    uint32_t id = get_uint32();
-    fxp_handle_t *p_handle = get_handle();
-    char longname[MAX_LONGNAME_LEN];
-
-    if (!p_handle)
+    /* Truncated, or with lengths which overrun the packet */
+    if (bad_message(p_req->id))
     {
-        put_status(id, SSH_FX_FAILURE);
         return;
     }
-    /* Proceed to write a NAME packet; but save the buffer pointers in case we give
-    up and write a STATUS instead. Save the position of count so that we can update
-    it at the end */
-    buff_save(&save1);
-    put_byte(SSH_FXP_NAME);
-    put_uint32(id);
-    buff_save(&save2);
-    put_uint32(count);
 
-    do
+    /* INIT must be the first packet */
+    if (!have_init)
     {
-        attrs_t attr;
-        struct stat st;
-        long dir_posn = telldir(p_handle->p_dir);
-
-        p_entry = readdir(p_handle->p_dir);
-        if (p_entry)
+        if (p_req->type != SSH_FXP_INIT)
         {
-            /* Ignore entries we can't stat */
-            if (fstatat(p_handle->fd, p_entry->d_name, &st, 0) < 0)
-            {
-                continue;
-            }
-
-            // make longname here
-            get_longname(longname, &st, p_entry);
+            put_status(p_req->id, SSH_FX_BAD_MESSAGE);
+            return;
+        }
+        sftp_init(p_req);
+        have_init = SSH_TRUE;
+        return;
+    }
+    if (attr_ttl_ms)
+    {
+        attr_cache_note(p_req->type);
+    }
+    switch (p_req->type)
+    {
+    case SSH_FXP_INIT:
+        /* Don't allow INIT more than once */
+        fprintf(stderr,"Can't INIT twice\n");
+        exit(EXIT_FAILURE);
+        break;
+
+    case SSH_FXP_OPEN:
+        sftp_open(p_req);
+        break;
+
+    case SSH_FXP_CLOSE:
+        sftp_close(p_req);
+        break;
+
+    case SSH_FXP_READ:
+        sftp_read(p_req);
+        break;
+
+    case SSH_FXP_WRITE:
+        sftp_write(p_req);
+        break;
+
+    case SSH_FXP_LSTAT:
+        do_stat(p_req, SSH_FALSE);
+        break;
+
+    case SSH_FXP_FSTAT:
+        sftp_fstat(p_req);
+        break;
+
+    case SSH_FXP_SETSTAT:
+        sftp_setstat(p_req);
+        break;
+
+    case SSH_FXP_FSETSTAT:
+        sftp_fsetstat(p_req);
+        break;
+
+    case SSH_FXP_OPENDIR:
+        sftp_opendir(p_req);
+        break;
+
+    case SSH_FXP_READDIR:
+        sftp_readdir(p_req);
+        break;
+
+    case SSH_FXP_REMOVE:
+        sftp_remove(p_req);
+        break;
+
+    case SSH_FXP_MKDIR:
+        sftp_mkdir(p_req);
+        break;
+
+    case SSH_FXP_RMDIR:
+        sftp_rmdir(p_req);
+        break;
+
+    case SSH_FXP_REALPATH:
+        sftp_realpath(p_req);
+        break;
+
+    case SSH_FXP_STAT:
+        do_stat(p_req, SSH_TRUE);
+        break;
+
+    case SSH_FXP_RENAME:
+        sftp_rename(p_req);
+        break;
+
+    case SSH_FXP_READLINK:
+        sftp_readlink(p_req);
+        break;
+
+    case SSH_FXP_SYMLINK:
+        sftp_symlink(p_req);
+        break;
+
+    case SSH_FXP_LINK:
+        sftp_link(p_req);
+        break;
+
+    case SSH_FXP_BLOCK:
+        sftp_block(p_req);
+        break;
+
+    case SSH_FXP_UNBLOCK:
+        sftp_unblock(p_req);
+        break;
+
+    case SSH_FXP_EXTENDED:
+        sftp_extended(p_req);
+        break;
+
+    default:
+        /* All (non-INIT) packets begin with an ID and all responses echo it */
+        put_status(p_req->id, SSH_FX_OP_UNSUPPORTED);
+        break;
+    }
+}
+
+/* Decode the packet in the input buffer according to its type. Strings are
+left where they are, as views */
+static void decode_request(request_t *p_req)
+{
+    const uint8_t *p_fixed;
+
+    memset(p_req, 0, sizeof(*p_req));
+    arena.used = 0;
+    decode_error = SSH_FALSE;
+
+    /* process_input() has checked there's room for these */
+    p_req->type = get_byte();
+    p_req->id = get_uint32();
+    /* Version 4 onwards says which attributes STAT and friends should return.
+    Some clients leave it off, meaning all of them */
+    p_req->attr_mask = UINT32_MAX;
+    switch (p_req->type)
+    {
+    case SSH_FXP_OPEN:
+        get_view(&p_req->path);
+        if (sftp_version >= 5)
+        {
+            p_req->access = get_uint32();
+        }
+        p_req->pflags = get_uint32();
+        get_attrs(&p_req->attrs);
+        break;
+
+    case SSH_FXP_CLOSE:
+    case SSH_FXP_READDIR:
+        get_view(&p_req->handle);
+        break;
+
+    case SSH_FXP_FSTAT:
+        get_view(&p_req->handle);
+        if (sftp_version >= 4 && ibuff.count > 0)
+        {
+            p_req->attr_mask = get_uint32();
+        }
+        break;
+
+    case SSH_FXP_READ:
+    case SSH_FXP_WRITE:
+        /* Handle, offset and READ's length or the WRITE data's length */
+        p_fixed = get_handle_fixed(&p_req->handle, 12);
+        if (p_fixed)
+        {
+            p_req->offset = load_uint64(p_fixed);
+            if (p_req->type == SSH_FXP_READ)
+            {
+                p_req->len = load_uint32(p_fixed + 8);
+            }
+            else
+            {
+                p_req->data.len = load_uint32(p_fixed + 8);
+                p_req->data.p_data = ibuff.p_data;
+                if (p_req->data.len > ibuff.count)
+                {
+                    p_req->data.len = decode_fail();
+                }
+                else
+                {
+                    ibuff.count -= p_req->data.len;
+                    ibuff.p_data += p_req->data.len;
+                }
+            }
+        }
+        break;
+
+    case SSH_FXP_LSTAT:
+    case SSH_FXP_STAT:
+        get_view(&p_req->path);
+        if (sftp_version >= 4 && ibuff.count > 0)
+        {
+            p_req->attr_mask = get_uint32();
+        }
+        break;
+
+    case SSH_FXP_OPENDIR:
+    case SSH_FXP_REMOVE:
+    case SSH_FXP_RMDIR:
+    case SSH_FXP_READLINK:
+        get_view(&p_req->path);
+        break;
+
+    case SSH_FXP_REALPATH:
+        /* Version 6 may add a control byte and paths to compose with it */
+        get_view(&p_req->path);
+        if (sftp_version >= 6 && ibuff.count > 0)
+        {
+            p_req->control = get_byte();
+            p_req->data.p_data = ibuff.p_data;
+            p_req->data.len = ibuff.count;
+        }
+        break;
+
+    case SSH_FXP_SETSTAT:
+    case SSH_FXP_MKDIR:
+        get_view(&p_req->path);
+        get_attrs(&p_req->attrs);
+        break;
+
+    case SSH_FXP_FSETSTAT:
+        get_view(&p_req->handle);
+        get_attrs(&p_req->attrs);
+        break;
+
+    case SSH_FXP_RENAME:
+        get_view(&p_req->path);
+        get_view(&p_req->path2);
+        if (sftp_version >= 5)
+        {
+            p_req->pflags = get_uint32();
+        }
+        break;
+
+    case SSH_FXP_SYMLINK:
+        get_view(&p_req->path);
+        get_view(&p_req->path2);
+        break;
+
+    case SSH_FXP_LINK:
+        get_view(&p_req->path);
+        get_view(&p_req->path2);
+        p_req->control = get_byte();
+        break;
+
+    case SSH_FXP_BLOCK:
+    case SSH_FXP_UNBLOCK:
+        get_view(&p_req->handle);
+        p_req->offset = get_uint64();
+        p_req->length = get_uint64();
+        if (p_req->type == SSH_FXP_BLOCK)
+        {
+            p_req->pflags = get_uint32();
+        }
+        break;
+
+    case SSH_FXP_EXTENDED:
+        /* The arguments are decoded by the extension's handler */
+        get_view(&p_req->name);
+        p_req->data.p_data = ibuff.p_data;
+        p_req->data.len = ibuff.count;
+        break;
+
+    default:
+        /* INIT has just the version; anything else is unsupported */
+        break;
+    }
+}
+
+/* Size of buffer needed for the reply to a request */
+static uint32_t reply_size(const request_t *p_req)
+{
+    switch (p_req->type)
+    {
+    case SSH_FXP_READ:
+        /* 4 length, 1 type, 4 id, 4 data length. Longer reads are cut short */
+        return p_req->len <= POOL_SMALL_SIZE - 13 ? POOL_SMALL_SIZE : max_packet + 4;
+
+    case SSH_FXP_READDIR:
+        return max_packet + 4;
+
+    case SSH_FXP_INIT:
+    case SSH_FXP_REALPATH:
+    case SSH_FXP_READLINK:
+    case SSH_FXP_EXTENDED:
+        return POOL_MEDIUM_SIZE;
+
+    default:
+        return POOL_SMALL_SIZE;
+    }
+}
+
+static void sftp_init(const request_t *p_req)
+{
+    uint32_t version = p_req->id;
+    size_t i;
+
+    /* Speak the client's version if we can, else our nearest. A client which
+    wants an older version than we have can hang up when it sees ours */
+    if (version < SFTP_MIN_VERSION)
+    {
+        version = SFTP_MIN_VERSION;
+    }
+    else if (version > SFTP_MAX_VERSION)
+    {
+        version = SFTP_MAX_VERSION;
+    }
+    sftp_version = version;
+
+    put_byte(SSH_FXP_VERSION);
+    put_uint32(sftp_version);
+
+    /* Advertise our extensions as name, data pairs */
+    for (i = 0; i < elemof(extensions); i++)
+    {
+        put_cstring(extensions[i].sz_name);
+        put_cstring(extensions[i].sz_data);
+    }
+    if (sftp_version >= 5)
+    {
+        put_supported();
+    }
+}
+
+/* Attributes, open flags and block modes we support, for the VERSION reply */
+#ifdef STATX_BTIME
+#define SUPPORTED_CREATETIME SSH_FILEXFER_ATTR_CREATETIME
+#else
+#define SUPPORTED_CREATETIME 0
+#endif
+#define SUPPORTED_ATTRS (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS \
+    | SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_MODIFYTIME | SSH_FILEXFER_ATTR_OWNERGROUP \
+    | SSH_FILEXFER_ATTR_SUBSECOND_TIMES | SUPPORTED_CREATETIME)
+#define SUPPORTED_ATTRS_V6 (SUPPORTED_ATTRS | SSH_FILEXFER_ATTR_CTIME | SSH_FILEXFER_ATTR_LINK_COUNT)
+#define SUPPORTED_OPEN_FLAGS (SSH_FXF_ACCESS_DISPOSITION | SSH_FXF_APPEND_DATA \
+    | SSH_FXF_APPEND_DATA_ATOMIC | SSH_FXF_TEXT_MODE | SSH_FXF_BLOCK_READ | SSH_FXF_BLOCK_WRITE \
+    | SSH_FXF_BLOCK_DELETE | SSH_FXF_BLOCK_ADVISORY | SSH_FXF_NOFOLLOW)
+#define SUPPORTED_ACCESS (ACE4_READ_DATA | ACE4_WRITE_DATA | ACE4_APPEND_DATA \
+    | ACE4_READ_ATTRIBUTES | ACE4_WRITE_ATTRIBUTES)
+/* Bit n set if block flags (n << 6) work. Locks are advisory only, so just
+none, advisory alone, and advisory with BLOCK_WRITE or BLOCK_READ | BLOCK_WRITE.
+BLOCK needs open file description locks: process-associated fcntl() locks
+don't keep out the session's other handles, and are all dropped when any
+descriptor for the file is closed */
+#define SUPPORTED_BLOCK_VECTOR ((1 << 0) | (1 << 8) | (1 << 10) | (1 << 11))
+#ifdef F_OFD_SETLK
+#define SUPPORTED_RANGE_LOCK_VECTOR SUPPORTED_BLOCK_VECTOR
+#else
+#define SUPPORTED_RANGE_LOCK_VECTOR (1 << 0)
+#endif
+
+/* "supported" (version 5) or "supported2" (version 6) extension pair. The
+data is a structure of its own, so its length is filled in afterwards */
+static void put_supported(void)
+{
+    buff_save_t save;
+    uint32_t start;
+    size_t i;
+
+    put_cstring(sftp_version >= 6 ? "supported2" : "supported");
+    buff_save(&save);
+    put_uint32(0);
+    start = obuff.count;
+    put_uint32(sftp_version >= 6 ? SUPPORTED_ATTRS_V6 : SUPPORTED_ATTRS);
+    put_uint32(0);  /* attrib-bits */
+    put_uint32(SUPPORTED_OPEN_FLAGS);
+    put_uint32(SUPPORTED_ACCESS);
+    put_uint32(0);  /* max-read-size: reads may be short */
+    if (sftp_version >= 6)
+    {
+        put_byte(SUPPORTED_BLOCK_VECTOR >> 8);
+        put_byte(SUPPORTED_BLOCK_VECTOR & 0xff);
+        put_byte(SUPPORTED_RANGE_LOCK_VECTOR >> 8);
+        put_byte(SUPPORTED_RANGE_LOCK_VECTOR & 0xff);
+        put_uint32(0);  /* attrib-extension-count */
+        put_uint32(elemof(extensions));
+    }
+    for (i = 0; i < elemof(extensions); i++)
+    {
+        put_cstring(extensions[i].sz_name);
+    }
+    buff_swap(&save);
+    put_uint32(start - save.count);
+    buff_swap(&save);
+}
+
+static void sftp_open(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_filename = sv_cstr(&p_req->path);
+    const char *sz_base;
+    char *sz_cached = NULL;
+    int fd,flags,dirfd;
+    mode_t mode;
+    uint32_t status = SSH_FX_FAILURE;
+    uint32_t block = 0;
+    ssh_bool_t reopen;
+
+    if (sftp_version >= 5)
+    {
+        flags = open_flags_to_unix(p_req->access, p_req->pflags);
+        block = p_req->pflags & (SSH_FXF_BLOCK_READ | SSH_FXF_BLOCK_WRITE | SSH_FXF_BLOCK_DELETE);
+        if (flags < 0)
+        {
+            put_status(id, SSH_FX_OP_UNSUPPORTED);
+            return;
+        }
+    }
+    else
+    {
+        flags = pflags_to_unix(p_req->pflags);
+    }
+    mode = p_req->attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS ? p_req->attrs.permissions : DEFAULT_FILE_PERM;
+
+    /* Open file. Plain read-only opens may find the file still open from
+    before, and leave it open for next time when closed */
+    dirfd = path_at(sz_filename, &sz_base);
+    reopen = !block && (flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC));
+    fd = reopen ? fd_cache_take(sz_filename, flags, dirfd, sz_base, &sz_cached) : -1;
+    if (fd < 0)
+    {
+        fd = openat(dirfd, sz_base, flags, mode);
+    }
+    if (fd < 0)
+    {
+        status = errno_to_sftp(errno);
+    }
+    else if (block && flock(fd, ((block & SSH_FXF_BLOCK_READ) ? LOCK_EX : LOCK_SH) | LOCK_NB) < 0)
+    {
+        /* Whole file locks for the BLOCK flags; others who take them too are
+        kept out until we close */
+        status = (errno == EWOULDBLOCK) ? SSH_FX_LOCK_CONFLICT : errno_to_sftp(errno);
+        close(fd);
+    }
+    else
+    {
+        unsigned long handle = handle_alloc_file(fd);
+        if (handle == 0)
+        {
+            /* Out of handles */
+            close(fd);
+            free(sz_cached);
+        }
+        else
+        {
+            if (reopen)
+            {
+                /* Failing to copy the path only costs a close() */
+                handles[handle - 1].sz_path = sz_cached ? sz_cached : strdup(sz_filename);
+                handles[handle - 1].flags = flags;
+            }
+
+            /* A size sent with OPEN is how big the client expects the file
+            to become. It's only a hint, so failing to act on it is fine */
+            if ((p_req->attrs.flags & SSH_FILEXFER_ATTR_SIZE) && p_req->attrs.size > 0
+                && (flags & O_ACCMODE) != O_RDONLY)
+            {
+                (void)preallocate(fd, 0, p_req->attrs.size);
+            }
+            handles[handle - 1].drop_behind = is_nocache_path(sz_filename);
+            if (map_budget && (flags & O_ACCMODE) == O_RDONLY && !handles[handle - 1].drop_behind)
+            {
+                handles[handle - 1].p_map = map_acquire(fd);
+            }
+
+            /* We have opened the file and successfully given it a handle */
+            put_handle(id, handle);
+            return;
+        }
+    }
+    put_status(id, status);
+}
+
+static void sftp_close(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    uint32_t status = SSH_FX_OK;
+    fxp_handle_t *p_handle = handle_lookup(&p_req->handle);
+
+    if (!p_handle)
+    {
+        status = SSH_FX_FAILURE;
+    }
+    else
+    {
+        if (p_handle->use == HANDLE_FILE)
+        {
+            if (p_handle->drop_behind)
+            {
+                /* Start writing back what's left and drop whatever is clean;
+                waiting for the rest would stall every small file */
+                drop_range(p_handle->fd, p_handle->wb_start, p_handle->wb_end, SSH_TRUE);
+                drop_range(p_handle->fd, p_handle->behind_start, p_handle->behind_end, SSH_FALSE);
+            }
+            if (p_handle->p_map)
+            {
+                struct stat st;
+
+                /* Don't keep an unlinked file's blocks once nobody reads it */
+                if (fstat(p_handle->fd, &st) == 0 && st.st_nlink == 0)
+                {
+                    p_handle->p_map->stale = SSH_TRUE;
+                }
+                map_release(p_handle->p_map);
+            }
+            if (p_handle->sz_path && fd_cache_put(p_handle))
+            {
+                /* Kept open for the next OPEN of the path */
+            }
+            else if (-1 == close(p_handle->fd))
+            {
+                status = errno_to_sftp(errno);
+            }
+            free(p_handle->sz_path);
+        }
+        else if (p_handle->use == HANDLE_DIR)
+        {
+            /* closedir() also closes the underlying  file  descriptor  associated  with  p_dir */
+            if (-1 == closedir(p_handle->p_dir))
+            {
+                status = errno_to_sftp(errno);
+            }
+        }
+        /* Free handle. p_handle->use invalid is successfully freed but should never occur */
+        p_handle->use = HANDLE_FREE;
+        if (p_stats)
+        {
+            p_stats->handles_open--;
+        }
+    }
+    put_status(id, status);
+}
+
+static void sftp_read(const request_t *p_req)
+{
+    /* DATA packet begins opcode, id, length-of-data */
+    const uint32_t hdr_size = 1 + 4 + 4;
+    uint32_t id = p_req->id;
+    uint32_t len = p_req->len;
+    uint32_t max_len;
+    fxp_handle_t *p_handle = handle_lookup(&p_req->handle);
+    uint64_t offset = p_req->offset;
+    int status = SSH_FX_FAILURE;
+
+    /* Maximum read length must fit in buffer after header.
+    !!! TODO - Different SFTP drafts say different things about shortening reads */
+    max_len = obuff.count - hdr_size;
+    if (len > max_len)
+    {
+        len = max_len;
+    }
+    if (p_handle && p_handle->use == HANDLE_FILE)
+    {
+        /* Read the data directly into the output buffer */
+        ssize_t ret = -1;
+
+        if (p_handle->p_map)
+        {
+            ret = map_read(p_handle, &obuff.p_data[hdr_size], offset, len);
+        }
+        if (ret >= 0)
+        {
+            STATS_ADD(mapped_reads, 1);
+        }
+        else
+        {
+            ret = pread(p_handle->fd, &obuff.p_data[hdr_size], len, offset);
+            STATS_ADD(sys_file_read, 1);
+        }
+        if (ret < 0)
+        {
+            status = errno_to_sftp(errno);
+        }
+        else if (ret == 0)
+        {
+            status = SSH_FX_EOF;
+        }
+        else
+        {
+            /* Successful read some data (may be less than we requested) */
+            assert((size_t)ret <= len);
+            STATS_ADD(file_bytes_read, ret);
+            if (p_handle->drop_behind)
+            {
+                drop_behind(p_handle, offset, ret);
+            }
+            put_byte(SSH_FXP_DATA);
+            put_uint32(id);
+            put_uint32(ret);
+            obuff.count -= ret;
+            obuff.p_data += ret;
+            return;
+        }
+    }
+    put_status(id, status);
+}
+
+static void sftp_write(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    fxp_handle_t *p_handle = handle_lookup(&p_req->handle);
+    uint64_t offset = p_req->offset;
+    const uint8_t *p_data = p_req->data.p_data;
+    uint32_t data_len = p_req->data.len;
+    int status = SSH_FX_FAILURE;
+
+    if (p_handle && p_handle->use == HANDLE_FILE)
+    {
+        ssize_t ret;
+
+        if (data_len >= ZERO_WRITE_MIN && is_zero(p_data, data_len)
+            && write_zeros(p_handle->fd, offset, data_len) == 0)
+        {
+            STATS_ADD(file_bytes_written, data_len);
+            status = SSH_FX_OK;
+        }
+        else
+        {
+            ret = pwrite(p_handle->fd, p_data, data_len, offset);
+            STATS_ADD(sys_file_write, 1);
+            if (ret < 0)
+            {
+                status = errno_to_sftp(errno);
+            }
+            else if ((size_t)ret == data_len)
+            {
+                STATS_ADD(file_bytes_written, ret);
+                status = SSH_FX_OK;
+            }
+        }
+        if (status == SSH_FX_OK && p_handle->drop_behind)
+        {
+            p_handle->dirty = SSH_TRUE;
+            drop_behind(p_handle, offset, data_len);
+        }
+    }
+    put_status(id, status);
+}
+
+/* All zero? The first 16 bytes are checked by hand; after that each 16 bytes
+is compared with the 16 before it, so memcmp() - which the C library
+vectorises - does the rest */
+static ssh_bool_t is_zero(const uint8_t *p_data, uint32_t len)
+{
+    static const uint8_t zeros[16];
+
+    if (len <= sizeof(zeros))
+    {
+        return memcmp(p_data, zeros, len) == 0;
+    }
+    return memcmp(p_data, zeros, sizeof(zeros)) == 0
+        && memcmp(p_data, p_data + sizeof(zeros), len - sizeof(zeros)) == 0;
+}
+
+/* Make len bytes at offset read as zeros without writing them all: punch a
+hole over them, then write just the last byte, which extends the file if it
+was shorter and leaves the extension sparse. Nothing depends on the size,
+which another writer may be changing, and the file never shrinks. Without
+hole punching only writes at or past the end are done this way. Returns 0,
+or -1 if the caller should write the zeros after all */
+static int write_zeros(int fd, uint64_t offset, uint32_t len)
+{
+    static const uint8_t zero = 0;
+    int flags = fcntl(fd, F_GETFL);
+
+    /* Appends go wherever the end of the file is by then */
+    if (flags < 0 || (flags & O_APPEND))
+    {
+        return -1;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    /* Fails for anything but a regular file, or where holes aren't supported */
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0)
+    {
+        return -1;
+    }
+#else
+    {
+        struct stat st;
+
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || offset < (uint64_t)st.st_size)
+        {
+            return -1;
+        }
+    }
+#endif
+    if (pwrite(fd, &zero, 1, offset + len - 1) != 1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void stat_to_attr(struct stat *p_stat, attrs_t *p_attr)
+{
+    memset(p_attr, 0, sizeof(*p_attr));
+    p_attr->flags = SSH_FILEXFER_ATTR_SIZE
+        | SSH_FILEXFER_ATTR_UIDGID
+        | SSH_FILEXFER_ATTR_PERMISSIONS
+        | SSH_FILEXFER_ATTR_ACCESSTIME
+        | SSH_FILEXFER_ATTR_MODIFYTIME
+        | SSH_FILEXFER_ATTR_CTIME
+        | SSH_FILEXFER_ATTR_SUBSECOND_TIMES
+        | SSH_FILEXFER_ATTR_LINK_COUNT;
+    p_attr->type = mode_to_type(p_stat->st_mode);
+    p_attr->size = p_stat->st_size;
+    p_attr->uid = p_stat->st_uid;
+    p_attr->gid = p_stat->st_gid;
+    p_attr->permissions = p_stat->st_mode;
+    p_attr->atime = p_stat->ST_ATIM.tv_sec;
+    p_attr->atime_ns = p_stat->ST_ATIM.tv_nsec;
+    p_attr->mtime = p_stat->ST_MTIM.tv_sec;
+    p_attr->mtime_ns = p_stat->ST_MTIM.tv_nsec;
+    p_attr->ctime = p_stat->ST_CTIM.tv_sec;
+    p_attr->ctime_ns = p_stat->ST_CTIM.tv_nsec;
+    p_attr->link_count = p_stat->st_nlink;
+}
+
+static uint8_t mode_to_type(mode_t mode)
+{
+    if (S_ISREG(mode))
+    {
+        return SSH_FILEXFER_TYPE_REGULAR;
+    }
+    else if (S_ISDIR(mode))
+    {
+        return SSH_FILEXFER_TYPE_DIRECTORY;
+    }
+    else if (S_ISLNK(mode))
+    {
+        return SSH_FILEXFER_TYPE_SYMLINK;
+    }
+    else if (S_ISSOCK(mode))
+    {
+        return SSH_FILEXFER_TYPE_SOCKET;
+    }
+    else if (S_ISCHR(mode))
+    {
+        return SSH_FILEXFER_TYPE_CHAR_DEVICE;
+    }
+    else if (S_ISBLK(mode))
+    {
+        return SSH_FILEXFER_TYPE_BLOCK_DEVICE;
+    }
+    else if (S_ISFIFO(mode))
+    {
+        return SSH_FILEXFER_TYPE_FIFO;
+    }
+    return SSH_FILEXFER_TYPE_UNKNOWN;
+}
+
+/* The attributes a reply can carry: everything version 3 has room for, or
+those of the version 4+ client's mask that we support. Leaving out OWNERGROUP
+saves looking up the names */
+static uint32_t attrs_wanted(uint32_t attr_mask)
+{
+    uint32_t wanted;
+
+    if (sftp_version == 3)
+    {
+        wanted = SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID | SSH_FILEXFER_ATTR_PERMISSIONS
+            | SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_MODIFYTIME;
+        if (v3_times_ns)
+        {
+            wanted |= SSH_FILEXFER_ATTR_SUBSECOND_TIMES;
+        }
+        return wanted;
+    }
+    wanted = attr_mask & (sftp_version >= 6 ? SUPPORTED_ATTRS_V6 : SUPPORTED_ATTRS);
+    if (wanted & SSH_FILEXFER_ATTR_OWNERGROUP)
+    {
+        wanted |= SSH_FILEXFER_ATTR_UIDGID;
+    }
+    return wanted;
+}
+
+/* Attributes of sz_path relative to dirfd, or of dirfd itself if sz_path is
+NULL, limited to those wanted. On Linux statx() is asked for just those, which
+spares network filesystems from fetching what the reply won't carry, and adds
+the creation time where the filesystem keeps one. Returns 0, or -1 with errno
+set */
+static int attrs_stat(int dirfd, const char *sz_path, int at_flags, uint32_t wanted, attrs_t *p_attr)
+{
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+    unsigned int mask = STATX_TYPE;
+
+    if (wanted & SSH_FILEXFER_ATTR_SIZE)
+    {
+        mask |= STATX_SIZE;
+    }
+    if (wanted & SSH_FILEXFER_ATTR_UIDGID)
+    {
+        mask |= STATX_UID | STATX_GID;
+    }
+    if (wanted & SSH_FILEXFER_ATTR_PERMISSIONS)
+    {
+        mask |= STATX_MODE;
+    }
+    if (wanted & SSH_FILEXFER_ATTR_ACCESSTIME)
+    {
+        mask |= STATX_ATIME;
+    }
+    if (wanted & SSH_FILEXFER_ATTR_MODIFYTIME)
+    {
+        mask |= STATX_MTIME;
+    }
+    if (wanted & SSH_FILEXFER_ATTR_CTIME)
+    {
+        mask |= STATX_CTIME;
+    }
+    if (wanted & SSH_FILEXFER_ATTR_CREATETIME)
+    {
+        mask |= STATX_BTIME;
+    }
+    if (wanted & SSH_FILEXFER_ATTR_LINK_COUNT)
+    {
+        mask |= STATX_NLINK;
+    }
+    if (!sz_path)
+    {
+        sz_path = "";
+        at_flags |= AT_EMPTY_PATH;
+    }
+    if (statx(dirfd, sz_path, at_flags, mask, &stx) < 0)
+    {
+        return -1;
+    }
+
+    /* The filesystem may not have everything we asked for */
+    memset(p_attr, 0, sizeof(*p_attr));
+    p_attr->flags = wanted & SSH_FILEXFER_ATTR_SUBSECOND_TIMES;
+    p_attr->type = mode_to_type(stx.stx_mode);
+    mask &= stx.stx_mask;
+    if (mask & STATX_SIZE)
+    {
+        p_attr->flags |= SSH_FILEXFER_ATTR_SIZE;
+        p_attr->size = stx.stx_size;
+    }
+    if ((mask & (STATX_UID | STATX_GID)) == (STATX_UID | STATX_GID))
+    {
+        p_attr->flags |= SSH_FILEXFER_ATTR_UIDGID;
+        p_attr->uid = stx.stx_uid;
+        p_attr->gid = stx.stx_gid;
+    }
+    if (mask & STATX_MODE)
+    {
+        p_attr->flags |= SSH_FILEXFER_ATTR_PERMISSIONS;
+        p_attr->permissions = stx.stx_mode;
+    }
+    if (mask & STATX_ATIME)
+    {
+        p_attr->flags |= SSH_FILEXFER_ATTR_ACCESSTIME;
+        p_attr->atime = stx.stx_atime.tv_sec;
+        p_attr->atime_ns = stx.stx_atime.tv_nsec;
+    }
+    if (mask & STATX_MTIME)
+    {
+        p_attr->flags |= SSH_FILEXFER_ATTR_MODIFYTIME;
+        p_attr->mtime = stx.stx_mtime.tv_sec;
+        p_attr->mtime_ns = stx.stx_mtime.tv_nsec;
+    }
+    if (mask & STATX_CTIME)
+    {
+        p_attr->flags |= SSH_FILEXFER_ATTR_CTIME;
+        p_attr->ctime = stx.stx_ctime.tv_sec;
+        p_attr->ctime_ns = stx.stx_ctime.tv_nsec;
+    }
+    if (mask & STATX_BTIME)
+    {
+        p_attr->flags |= SSH_FILEXFER_ATTR_CREATETIME;
+        p_attr->createtime = stx.stx_btime.tv_sec;
+        p_attr->createtime_ns = stx.stx_btime.tv_nsec;
+    }
+    if (mask & STATX_NLINK)
+    {
+        p_attr->flags |= SSH_FILEXFER_ATTR_LINK_COUNT;
+        p_attr->link_count = stx.stx_nlink;
+    }
+#else
+    struct stat st;
+
+    if ((sz_path ? fstatat(dirfd, sz_path, &st, at_flags) : fstat(dirfd, &st)) < 0)
+    {
+        return -1;
+    }
+    stat_to_attr(&st, p_attr);
+    p_attr->flags &= wanted;
+#endif
+    return 0;
+}
+
+/* Turn OWNERGROUP names from a version 4+ client into uid and gid. Names may
+be numbers, and any @domain is ignored. Returns an SFTP status */
+static uint32_t attrs_resolve_owner(attrs_t *p_attr)
+{
+    const char *sz_names[2];
+    uint32_t ids[2];
+    unsigned i;
+
+    if (!(p_attr->flags & SSH_FILEXFER_ATTR_OWNERGROUP))
+    {
+        return SSH_FX_OK;
+    }
+    sz_names[0] = sv_cstr(&p_attr->owner);
+    sz_names[1] = sv_cstr(&p_attr->group);
+    for (i = 0; i < 2; i++)
+    {
+        char *sz_at = strchr(sz_names[i], '@');
+        char *p_end;
+
+        if (sz_at)
+        {
+            *sz_at = '\0';
+        }
+        ids[i] = strtoul(sz_names[i], &p_end, 10);
+        if (*sz_names[i] == '\0' || *p_end != '\0')
+        {
+            struct passwd *p_pw = i == 0 ? getpwnam(sz_names[i]) : NULL;
+            struct group *p_gr = i == 1 ? getgrnam(sz_names[i]) : NULL;
+
+            if (!p_pw && !p_gr)
+            {
+                if (sftp_version >= 6)
+                {
+                    return i == 0 ? SSH_FX_OWNER_INVALID : SSH_FX_GROUP_INVALID;
+                }
+                return sftp_version >= 5 ? SSH_FX_UNKNOWN_PRINCIPAL : SSH_FX_FAILURE;
+            }
+            ids[i] = p_pw ? p_pw->pw_uid : p_gr->gr_gid;
+        }
+    }
+    p_attr->uid = ids[0];
+    p_attr->gid = ids[1];
+    p_attr->flags |= SSH_FILEXFER_ATTR_UIDGID;
+    return SSH_FX_OK;
+}
+
+static void do_stat(const request_t *p_req, ssh_bool_t follow_symlinks)
+{
+    uint32_t id = p_req->id;
+    const char *sz_path = sv_cstr(&p_req->path);
+    attrs_t attr;
+    int ret;
+
+    if (attr_ttl_ms)
+    {
+        ret = attr_cache_stat(sz_path, follow_symlinks, attrs_wanted(p_req->attr_mask), &attr);
+    }
+    else
+    {
+        const char *sz_base;
+        int dirfd = path_at(sz_path, &sz_base);
+
+        ret = attrs_stat(dirfd, sz_base, follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW,
+            attrs_wanted(p_req->attr_mask), &attr);
+    }
+    if (ret < 0)
+    {
+        put_status(id, errno_to_sftp(errno));
+    }
+    else
+    {
+        put_byte(SSH_FXP_ATTRS);
+        put_uint32(id);
+        put_attrs(&attr);
+    }
+}
+
+/* The attribute cache for -A. Entries go stale in three ways: when we change
+anything ourselves - any request but the few which only look bumps attr_gen
+before it's handled; when inotify reports a change in the parent directory,
+watched from before the lookup so nothing after it is missed; and after the
+TTL, which catches what inotify can't see - the targets of symlinks, renames
+of directories further up, changes on network file systems. ATIME lags */
+static void attr_cache_init(void)
+{
+#ifdef __linux__
+    attr_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (attr_inotify_fd >= 0)
+    {
+        ev_set(attr_inotify_fd, EV_READ, attr_on_inotify);
+    }
+#endif
+}
+
+static void attr_cache_note(uint8_t type)
+{
+    switch (type)
+    {
+    case SSH_FXP_STAT:
+    case SSH_FXP_LSTAT:
+    case SSH_FXP_FSTAT:
+    case SSH_FXP_READ:
+    case SSH_FXP_OPENDIR:
+    case SSH_FXP_READDIR:
+    case SSH_FXP_CLOSE:
+    case SSH_FXP_REALPATH:
+    case SSH_FXP_READLINK:
+        break;
+
+    default:
+        attr_gen++;
+        break;
+    }
+}
+
+/* attrs_stat() of sz_path answered from the cache if possible, so that a hit
+costs no system calls beyond the clock; only a miss goes through path_at().
+Successes and ENOENT are remembered */
+static int attr_cache_stat(const char *sz_path, ssh_bool_t follow, uint32_t wanted, attrs_t *p_attr)
+{
+    uint32_t hash = hash_bytes(sz_path, strlen(sz_path));
+    attr_entry_t *p_entry = &attr_cache[hash & (ATTR_CACHE_SIZE - 1)];
+    struct timespec now;
+    const char *sz_base;
+    uint64_t now_ns;
+    int ret, wd, dirfd;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    if (p_entry->sz_path && p_entry->hash == hash && p_entry->follow == follow
+        && p_entry->wanted == wanted && p_entry->gen == attr_gen && p_entry->expires > now_ns
+        && strcmp(p_entry->sz_path, sz_path) == 0)
+    {
+        STATS_ADD(attr_hits, 1);
+        if (p_entry->error)
+        {
+            errno = p_entry->error;
+            return -1;
+        }
+        *p_attr = p_entry->attrs;
+        return 0;
+    }
+
+    wd = attr_cache_watch(sz_path);
+    dirfd = path_at(sz_path, &sz_base);
+    ret = attrs_stat(dirfd, sz_base, follow ? 0 : AT_SYMLINK_NOFOLLOW, wanted, p_attr);
+    if (ret == 0 || errno == ENOENT)
+    {
+        int error = errno;
+        size_t len = strlen(sz_path) + 1;
+
+        free(p_entry->sz_path);
+        p_entry->sz_path = malloc(len);
+        if (p_entry->sz_path)
+        {
+            memcpy(p_entry->sz_path, sz_path, len);
+            p_entry->hash = hash;
+            p_entry->wanted = wanted;
+            p_entry->follow = follow;
+            p_entry->error = ret == 0 ? 0 : error;
+            if (ret == 0)
+            {
+                p_entry->attrs = *p_attr;
+            }
+            p_entry->gen = attr_gen;
+            p_entry->wd = wd;
+            p_entry->expires = now_ns + (uint64_t)attr_ttl_ms * 1000000u;
+        }
+        errno = error;
+    }
+    return ret;
+}
+
+/* Watch sz_path's parent directory for changes, returning the watch or -1.
+A directory already in attr_watches costs nothing; once every slot is used,
+the least recently used watch is removed and what relied on it forgotten */
+static int attr_cache_watch(const char *sz_path)
+{
+#ifdef __linux__
+    const char *p_slash = strrchr(sz_path, '/');
+    attr_watch_t *p_victim = &attr_watches[0];
+    char sz_dir[PATH_MAX];
+    size_t dir_len;
+    uint32_t hash;
+    size_t i;
+    int wd;
+
+    if (attr_inotify_fd < 0)
+    {
+        return -1;
+    }
+    if (!p_slash)
+    {
+        strcpy(sz_dir, ".");
+    }
+    else
+    {
+        dir_len = (p_slash == sz_path) ? 1 : (size_t)(p_slash - sz_path);
+        if (dir_len >= sizeof(sz_dir))
+        {
+            return -1;
+        }
+        memcpy(sz_dir, sz_path, dir_len);
+        sz_dir[dir_len] = '\0';
+    }
+
+    hash = hash_bytes(sz_dir, strlen(sz_dir));
+    for (i = 0; i < elemof(attr_watches); i++)
+    {
+        attr_watch_t *p_watch = &attr_watches[i];
+
+        if (p_watch->sz_dir && p_watch->hash == hash && strcmp(p_watch->sz_dir, sz_dir) == 0)
+        {
+            p_watch->last_use = ++attr_clock;
+            return p_watch->wd;
+        }
+        if (!p_watch->sz_dir || (p_victim->sz_dir && p_watch->last_use < p_victim->last_use))
+        {
+            p_victim = p_watch;
+        }
+    }
+
+    wd = inotify_add_watch(attr_inotify_fd, sz_dir, IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd < 0)
+    {
+        return -1;
+    }
+    if (p_victim->sz_dir)
+    {
+        int old_wd = p_victim->wd;
+
+        free(p_victim->sz_dir);
+        p_victim->sz_dir = NULL;
+        if (old_wd != wd)
+        {
+            /* Unless another path names the same directory */
+            for (i = 0; i < elemof(attr_watches); i++)
+            {
+                if (attr_watches[i].sz_dir && attr_watches[i].wd == old_wd)
+                {
+                    break;
+                }
+            }
+            if (i == elemof(attr_watches))
+            {
+                inotify_rm_watch(attr_inotify_fd, old_wd);
+                attr_forget_wd(old_wd);
+            }
+        }
+    }
+    p_victim->sz_dir = strdup(sz_dir);
+    if (!p_victim->sz_dir)
+    {
+        /* Still watched, just not found again */
+        return wd;
+    }
+    p_victim->hash = hash;
+    p_victim->last_use = ++attr_clock;
+    p_victim->wd = wd;
+    return wd;
+#else
+    (void)sz_path;
+    return -1;
+#endif
+}
+
+#ifdef __linux__
+/* Drop the cached results which relied on watch wd */
+static void attr_forget_wd(int wd)
+{
+    size_t i;
+
+    for (i = 0; i < elemof(attr_cache); i++)
+    {
+        if (attr_cache[i].sz_path && attr_cache[i].wd == wd)
+        {
+            free(attr_cache[i].sz_path);
+            attr_cache[i].sz_path = NULL;
+        }
+    }
+}
+
+/* Forget what's cached for directories inotify reports changes in */
+static void attr_on_inotify(int fd, unsigned events)
+{
+    union
+    {
+        struct inotify_event ev;
+        char bytes[4096];
+    } buf;
+    ssize_t len;
+
+    (void)events;
+    while ((len = read(fd, buf.bytes, sizeof(buf.bytes))) > 0)
+    {
+        ssize_t posn = 0;
+
+        while (posn < len)
+        {
+            const struct inotify_event *p_ev = (const struct inotify_event *)&buf.bytes[posn];
+            size_t i;
+
+            if (p_ev->mask & IN_Q_OVERFLOW)
+            {
+                attr_gen++;
+            }
+            attr_forget_wd(p_ev->wd);
+            if (p_ev->mask & IN_IGNORED)
+            {
+                /* Removed with its directory - a new one may get its number */
+                for (i = 0; i < elemof(attr_watches); i++)
+                {
+                    if (attr_watches[i].sz_dir && attr_watches[i].wd == p_ev->wd)
+                    {
+                        free(attr_watches[i].sz_dir);
+                        attr_watches[i].sz_dir = NULL;
+                    }
+                }
+            }
+            posn += sizeof(struct inotify_event) + p_ev->len;
+        }
+    }
+}
+#endif
+
+static void sftp_fstat(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    fxp_handle_t *p_handle = handle_lookup(&p_req->handle);
+    uint32_t status = SSH_FX_FAILURE;
+
+    if (p_handle && p_handle->use == HANDLE_FILE)
+    {
+        attrs_t attr;
+        if (attrs_stat(p_handle->fd, NULL, 0, attrs_wanted(p_req->attr_mask), &attr) == 0)
+        {
+            put_byte(SSH_FXP_ATTRS);
+            put_uint32(id);
+            put_attrs(&attr);
+            return;
+        }
+        else
+        {
+            status = errno_to_sftp(errno);
+        }
+    }
+    put_status(id, status);
+}
+
+static void sftp_setstat(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_path = sv_cstr(&p_req->path);
+    const char *sz_base;
+    int dirfd = path_at(sz_path, &sz_base);
+    attrs_t attr = p_req->attrs;
+    uint32_t status = attrs_resolve_owner(&attr);
+
+    if (status == SSH_FX_OK)
+    {
+        status = attrs_apply(dirfd, sz_base, 0, &attr);
+    }
+    put_status(id, status);
+}
+
+static void sftp_fsetstat(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    fxp_handle_t *p_handle = handle_lookup(&p_req->handle);
+    uint32_t status = SSH_FX_FAILURE;
+    attrs_t attr = p_req->attrs;
+
+    if (p_handle && p_handle->use == HANDLE_FILE)
+    {
+        status = attrs_resolve_owner(&attr);
+        if (status == SSH_FX_OK)
+        {
+            status = attrs_apply(p_handle->fd, NULL, 0, &attr);
+        }
+    }
+    put_status(id, status);
+}
+
+/* Set the attributes of a SETSTAT family request on the file sz_base names
+relative to dirfd, or on the open file dirfd if sz_base is NULL. at_flags is 0
+or AT_SYMLINK_NOFOLLOW. With O_PATH the name is looked up once and everything
+is set through the descriptor that gives us; otherwise each call looks it up
+again. Returns an SFTP status */
+static uint32_t attrs_apply(int dirfd, const char *sz_base, int at_flags, const attrs_t *p_attr)
+{
+    const char *sz_name = sz_base;
+    int fd = dirfd;
+    int flags = at_flags;
+    int ret = 0;
+    uint32_t status;
+
+#ifdef O_PATH
+    if (sz_base)
+    {
+        fd = openat(dirfd, sz_base, O_PATH | ((at_flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0));
+        if (fd < 0)
+        {
+            return errno_to_sftp(errno);
+        }
+        sz_name = "";
+        flags = AT_EMPTY_PATH;
+    }
+#endif
+    /* Size first, as truncating updates the modify time */
+    if (p_attr->flags & SSH_FILEXFER_ATTR_SIZE)
+    {
+        if (!sz_base)
+        {
+            ret = ftruncate(fd, p_attr->size);
+        }
+#ifdef O_PATH
+        else
+        {
+            char sz_proc[32];
+
+            sprintf(sz_proc, "/proc/self/fd/%d", fd);
+            ret = truncate(sz_proc, p_attr->size);
+            if (ret < 0 && errno == ENOENT)
+            {
+                ret = truncate_at(dirfd, sz_base, p_attr->size);
+            }
+        }
+#else
+        else
+        {
+            ret = truncate_at(dirfd, sz_base, p_attr->size);
+        }
+#endif
+    }
+    if (ret == 0 && (p_attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS))
+    {
+        mode_t mode = p_attr->permissions & PERM_MASK;
+
+        if (!sz_base)
+        {
+            ret = fchmod(fd, mode);
+        }
+#ifdef O_PATH
+        else
+        {
+            /* fchmodat() won't take AT_EMPTY_PATH, but the descriptor's
+            /proc link names the file without walking the client's path
+            again. Like lchmod(), refuse to change a symlink's mode */
+            struct stat st;
+            char sz_proc[32];
+
+            ret = (at_flags & AT_SYMLINK_NOFOLLOW) ? fstat(fd, &st) : 0;
+            if (ret == 0 && (at_flags & AT_SYMLINK_NOFOLLOW) && S_ISLNK(st.st_mode))
+            {
+                errno = EOPNOTSUPP;
+                ret = -1;
+            }
+            else if (ret == 0)
+            {
+                sprintf(sz_proc, "/proc/self/fd/%d", fd);
+                ret = chmod(sz_proc, mode);
+                if (ret < 0 && errno == ENOENT)
+                {
+                    /* No /proc, say in a chroot */
+                    ret = fchmodat(dirfd, sz_base, mode, 0);
+                }
+            }
+        }
+#else
+        else
+        {
+            ret = fchmodat(dirfd, sz_base, mode, at_flags);
+        }
+#endif
+    }
+    if (ret == 0 && (p_attr->flags & (SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_MODIFYTIME)))
+    {
+        struct timespec ts[2];
+
+        attrs_to_ts(p_attr, ts);
+        if (!sz_base)
+        {
+            ret = futimens(fd, ts);
+        }
+        else
+        {
+            ret = utimensat(fd, sz_name, ts, flags);
+            if (ret < 0 && errno == EINVAL && fd != dirfd)
+            {
+                /* Kernel without AT_EMPTY_PATH for utimensat() */
+                ret = utimensat(dirfd, sz_base, ts, at_flags);
+            }
+        }
+    }
+    if (ret == 0 && (p_attr->flags & SSH_FILEXFER_ATTR_UIDGID))
+    {
+        ret = sz_base ? fchownat(fd, sz_name, p_attr->uid, p_attr->gid, flags)
+                      : fchown(fd, p_attr->uid, p_attr->gid);
+    }
+    /* Before close() can change errno */
+    status = ret < 0 ? errno_to_sftp(errno) : SSH_FX_OK;
+    if (fd != dirfd)
+    {
+        close(fd);
+    }
+    return status;
+}
+
+/* truncate() of a name relative to dirfd */
+static int truncate_at(int dirfd, const char *sz_base, uint64_t size)
+{
+    int fd = openat(dirfd, sz_base, O_WRONLY | O_NONBLOCK | O_NOCTTY);
+    int ret;
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ret = ftruncate(fd, size);
+    if (ret < 0)
+    {
+        int unix_error = errno;
+
+        close(fd);
+        errno = unix_error;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Reserve blocks for len bytes at offset without changing the file's size,
+so a large upload lands in few extents. posix_fallocate() would make the
+file that long straight away, which a client seeing a partial upload
+wouldn't expect, so this is only done where Linux's fallocate() is */
+static int preallocate(int fd, uint64_t offset, uint64_t len)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+    return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+/* Is the file at sz_path, which needn't exist yet, under a -N directory? Its
+parent is resolved (usually from the realpath cache) and compared with each */
+static ssh_bool_t is_nocache_path(const char *sz_path)
+{
+    const char *p_slash = strrchr(sz_path, '/');
+    char sz_dir[PATH_MAX];
+    char sz_resolved[PATH_MAX];
+    size_t dir_len;
+    size_t i;
+
+    if (nocache_count == 0)
+    {
+        return SSH_FALSE;
+    }
+    if (!p_slash)
+    {
+        strcpy(sz_dir, ".");
+    }
+    else
+    {
+        dir_len = (p_slash == sz_path) ? 1 : (size_t)(p_slash - sz_path);
+        if (dir_len >= sizeof(sz_dir))
+        {
+            return SSH_FALSE;
+        }
+        memcpy(sz_dir, sz_path, dir_len);
+        sz_dir[dir_len] = '\0';
+    }
+    if (resolve_path(sz_dir, sz_resolved) != 0)
+    {
+        return SSH_FALSE;
+    }
+    for (i = 0; i < nocache_count; i++)
+    {
+        size_t len = strlen(nocache_dirs[i]);
+
+        if (strncmp(sz_resolved, nocache_dirs[i], len) == 0
+            && (sz_resolved[len] == '\0' || sz_resolved[len] == '/' || len == 1))
+        {
+            return SSH_TRUE;
+        }
+    }
+    return SSH_FALSE;
+}
+
+/* Keep a -N handle's transfers out of the page cache. Once DROP_BEHIND_CHUNK
+bytes have gone by sequentially, writeback of them is started, and the chunk
+before - whose writeback has had a whole chunk's time to finish - is waited for
+and dropped. So at most two chunks per handle are cached, and the wait is
+rarely long. Reads have nothing to write back and are just dropped. A jump
+elsewhere in the file starts afresh without waiting, dropping what it can */
+static void drop_behind(fxp_handle_t *p_handle, uint64_t offset, uint64_t len)
+{
+    if (offset != p_handle->behind_end)
+    {
+        drop_range(p_handle->fd, p_handle->wb_start, p_handle->wb_end, SSH_FALSE);
+        drop_range(p_handle->fd, p_handle->behind_start, p_handle->behind_end, SSH_FALSE);
+        p_handle->wb_start = p_handle->wb_end = 0;
+        p_handle->behind_start = offset;
+    }
+    p_handle->behind_end = offset + len;
+    if (p_handle->behind_end - p_handle->behind_start >= DROP_BEHIND_CHUNK)
+    {
+#ifdef SYNC_FILE_RANGE_WRITE
+        if (p_handle->dirty)
+        {
+            (void)sync_file_range(p_handle->fd, p_handle->behind_start,
+                p_handle->behind_end - p_handle->behind_start, SYNC_FILE_RANGE_WRITE);
+        }
+#endif
+        drop_range(p_handle->fd, p_handle->wb_start, p_handle->wb_end, p_handle->dirty);
+        p_handle->wb_start = p_handle->behind_start;
+        p_handle->wb_end = p_handle->behind_end;
+        p_handle->behind_start = p_handle->behind_end;
+    }
+}
+
+/* Drop start to end of fd from the page cache, first waiting for it to be
+written back if wait. Otherwise only clean pages go, though on Linux
+POSIX_FADV_DONTNEED starts writeback of the dirty ones too. Where there's no
+sync_file_range() we can't wait short of fdatasync(), which is too much, and
+without posix_fadvise() (macOS) this does nothing */
+static void drop_range(int fd, uint64_t start, uint64_t end, ssh_bool_t wait)
+{
+    if (end <= start)
+    {
+        return;
+    }
+#ifdef SYNC_FILE_RANGE_WRITE
+    if (wait)
+    {
+        (void)sync_file_range(fd, start, end - start,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#else
+    (void)wait;
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    (void)posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* The map cache for -M. Mappings are per session process - they can't be
+handed between processes - but the pages behind them are the page cache's,
+shared with everyone. If another process truncates a mapped file, copying
+from beyond its new end raises SIGBUS; map_on_sigbus() jumps back into
+map_read(), which gives up the mapping and lets the READ go to the file. The
+handler is SA_NODEFER so the jump needn't restore the signal mask, which would
+cost a system call on every READ */
+static void map_init(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = map_on_sigbus;
+    sa.sa_flags = SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+static void map_on_sigbus(int sig)
+{
+    if (map_copying)
+    {
+        siglongjmp(map_jmp, 1);
+    }
+    /* Not ours: die as we would have */
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Find or make a mapping of the file open on fd for a new handle, or NULL if
+it's not a small regular file or there's no room. Unchanged files already
+mapped are shared; to make room, the least recently used mappings no handle
+is reading are unmapped */
+static map_entry_t *map_acquire(int fd)
+{
+    struct stat st;
+    map_entry_t *p_free = NULL;
+    void *p_data;
+    size_t i;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > MAP_FILE_MAX)
+    {
+        return NULL;
+    }
+    for (i = 0; i < elemof(map_cache); i++)
+    {
+        map_entry_t *p_entry = &map_cache[i];
+
+        if (p_entry->p_data && !p_entry->stale && p_entry->dev == st.st_dev && p_entry->ino == st.st_ino)
+        {
+            if (p_entry->size == (size_t)st.st_size
+                && p_entry->mtime.tv_sec == st.ST_MTIM.tv_sec && p_entry->mtime.tv_nsec == st.ST_MTIM.tv_nsec
+                && p_entry->ctime.tv_sec == st.ST_CTIM.tv_sec && p_entry->ctime.tv_nsec == st.ST_CTIM.tv_nsec)
+            {
+                p_entry->refs++;
+                p_entry->last_use = ++map_clock;
+                return p_entry;
+            }
+            /* Changed since it was mapped */
+            p_entry->stale = SSH_TRUE;
+            p_entry->refs++;
+            map_release(p_entry);
+        }
+        if (!p_entry->p_data && !p_free)
+        {
+            p_free = p_entry;
+        }
+    }
+
+    while (!p_free || map_bytes + st.st_size > map_budget)
+    {
+        map_entry_t *p_victim = NULL;
+
+        for (i = 0; i < elemof(map_cache); i++)
+        {
+            map_entry_t *p_entry = &map_cache[i];
+
+            if (p_entry->p_data && p_entry->refs == 0
+                && (!p_victim || p_entry->last_use < p_victim->last_use))
+            {
+                p_victim = p_entry;
+            }
+        }
+        if (!p_victim)
+        {
+            return NULL;
+        }
+        p_victim->stale = SSH_TRUE;
+        p_victim->refs++;
+        map_release(p_victim);
+        if (!p_free)
+        {
+            p_free = p_victim;
+        }
+    }
+
+    p_data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p_data == MAP_FAILED)
+    {
+        return NULL;
+    }
+    (void)posix_madvise(p_data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    p_free->p_data = p_data;
+    p_free->size = st.st_size;
+    p_free->dev = st.st_dev;
+    p_free->ino = st.st_ino;
+    p_free->mtime = st.ST_MTIM;
+    p_free->ctime = st.ST_CTIM;
+    p_free->refs = 1;
+    p_free->last_use = ++map_clock;
+    p_free->stale = SSH_FALSE;
+    map_bytes += st.st_size;
+    return p_free;
+}
+
+/* A handle is done with a mapping. Stale ones - changed, or unlinked by the
+time of the CLOSE - go as soon as nobody reads them; the rest stay for the
+next OPEN of the file */
+static void map_release(map_entry_t *p_map)
+{
+    assert(p_map->refs > 0);
+    if (--p_map->refs == 0 && p_map->stale)
+    {
+        munmap(p_map->p_data, p_map->size);
+        map_bytes -= p_map->size;
+        p_map->p_data = NULL;
+    }
+}
+
+/* READ through a handle's mapping. Returns the bytes copied, or -1 if the
+READ must go to the file instead: beyond the end of the mapping, as the file
+may have grown since, or if the file shrank and the copy faulted */
+static ssize_t map_read(fxp_handle_t *p_handle, uint8_t *p_dest, uint64_t offset, uint32_t len)
+{
+    map_entry_t *p_map = p_handle->p_map;
+    size_t count;
+
+    if (offset >= p_map->size)
+    {
+        return -1;
+    }
+    /* Not len itself, which sigsetjmp() could leave clobbered */
+    count = len < p_map->size - offset ? len : p_map->size - offset;
+    if (sigsetjmp(map_jmp, 0))
+    {
+        map_copying = 0;
+        p_map->stale = SSH_TRUE;
+        map_release(p_map);
+        p_handle->p_map = NULL;
+        return -1;
+    }
+    map_copying = 1;
+    memcpy(p_dest, p_map->p_data + offset, count);
+    map_copying = 0;
+    return count;
+}
+
+static void sftp_opendir(const request_t *p_req)
+{
+    int fd;
+    DIR *p_dir;
+    uint32_t id = p_req->id;
+    const char *sz_path = sv_cstr(&p_req->path);
+    const char *sz_base;
+    int dirfd = path_at(sz_path, &sz_base);
+    int status = SSH_FX_FAILURE;
+
+    /* Open the directory and obtain both a DIR* and a file descriptor.
+    Later, when we come to read the directory this allows us to stat
+    files in the directory without having to store or catenate the path
+    to the files */
+    fd = openat(dirfd, sz_base, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+    {
+        status = errno_to_sftp(errno);
+    }
+    else
+    {
+        p_dir = fdopendir(fd);
+        if (!p_dir)
+        {
+            status = errno_to_sftp(errno);
+        }
+        else
+        {
+            unsigned long handle = handle_alloc_dir(fd, p_dir);
+            if (handle != 0)
+            {
+                put_handle(id, handle);
+                return;
+            }
+        }
+    }
+    put_status(id, status);
+}
+
+static void sftp_readdir(const request_t *p_req)
+{
+    buff_save_t save1,save2;
+    uint32_t count = 0;
+    struct dirent *p_entry;
+    uint32_t id = p_req->id;
+    fxp_handle_t *p_handle = handle_lookup(&p_req->handle);
+
+    if (!p_handle)
+    {
+        put_status(id, SSH_FX_FAILURE);
+        return;
+    }
+    /* Proceed to write a NAME packet; but save the buffer pointers in case we give
+    up and write a STATUS instead. Save the position of count so that we can update
+    it at the end */
+    buff_save(&save1);
+    put_byte(SSH_FXP_NAME);
+    put_uint32(id);
+    buff_save(&save2);
+    put_uint32(count);
+
+    do
+    {
+        attrs_t attr;
+        struct stat st;
+        long dir_posn = telldir(p_handle->p_dir);
+
+        p_entry = readdir(p_handle->p_dir);
+        if (p_entry)
+        {
+            uint32_t name_len;
+            uint32_t entry_len;
+
+            /* Ignore entries we can't stat */
+            if (fstatat(p_handle->fd, p_entry->d_name, &st, 0) < 0)
+            {
+                continue;
+            }
+
+            /* Only version 3 has the ls -l style long name, which ends with
+            the name again */
+            name_len = strlen(p_entry->d_name);
+            entry_len = sizeof(uint32_t) + name_len + MAX_ATTRS_BYTES;
+            if (sftp_version == 3)
+            {
+                entry_len += sizeof(uint32_t) + LONGNAME_FIXED_LEN + name_len;
+            }
+
+            /* If the entry will fit in the buffer, write it in one go */
+            if (entry_len <= obuff.count)
+            {
+                uint8_t *p_out = store_string(obuff.p_data, p_entry->d_name, name_len);
+
+                if (sftp_version == 3)
+                {
+                    p_out = longname_encode(p_out, &st, p_entry->d_name, name_len);
+                }
+                stat_to_attr(&st, &attr);
+                p_out = attrs_encode(p_out, &attr);
+                obuff.count -= p_out - obuff.p_data;
+                obuff.p_data = p_out;
+                count++;
+            }
+            else if (count > 0)
+            {
+                /* We couldn't write the name to the buffer and it's not the only 
+                name in the buffer - rewind the dir pointer and leave it to next time */
+                seekdir(p_handle->p_dir, dir_posn);
+                break;
+            }
+            /* else - we skip entries too long to ever report! This seems more helpful than
+            returning an error and refusing to read anything. */
+        }
+    } while (p_entry);
+
+    if (count > 0)
+    {
+        buff_swap(&save2);
+        put_uint32(count);
+        buff_swap(&save2);
+    }
+    else
+    {
+        buff_swap(&save1);
+        put_status(id, SSH_FX_EOF);
+    }
+}
+
+/* Build the permission strings for every combination of the nine rwx bits */
+static void longname_init(void)
+{
+    static const char rwx[] = "rwxrwxrwx";
+    unsigned mode, bit;
+
+    for (mode = 0; mode < elemof(longname_perms); mode++)
+    {
+        for (bit = 0; bit < 9; bit++)
+        {
+            longname_perms[mode][bit] = (mode & (0400 >> bit)) ? rwx[bit] : '-';
+        }
+    }
+}
+
+/* Store the long name of a version 3 READDIR entry as a string, at most
+LONGNAME_FIXED_LEN bytes plus the name and its length field, and return the
+end */
+static uint8_t *longname_encode(uint8_t *p_str, const struct stat *p_st, const char *sz_name, uint32_t name_len)
+{
+    char *p_start = (char *)p_str + sizeof(uint32_t);
+    char *p_out = p_start;
+    char sz_owner[OWNER_NAME_MAX + 1];
+    mode_t mode = p_st->st_mode;
+    size_t len;
+
+    switch (mode & S_IFMT)
+    {
+    case S_IFDIR:   *p_out++ = 'd'; break;
+    case S_IFCHR:   *p_out++ = 'c'; break;
+    case S_IFBLK:   *p_out++ = 'b'; break;
+    case S_IFREG:   *p_out++ = '-'; break;
+    case S_IFLNK:   *p_out++ = 'l'; break;
+    case S_IFSOCK:  *p_out++ = 's'; break;
+    case S_IFIFO:   *p_out++ = 'p'; break;
+    default:        *p_out++ = '?'; break;
+    }
+    memcpy(p_out, longname_perms[mode & 0777], 9);
+    if (mode & (S_ISUID | S_ISGID | S_ISVTX))
+    {
+        /* Lower case if the execute bit underneath is set */
+        if (mode & S_ISUID)
+        {
+            p_out[2] = (mode & S_IXUSR) ? 's' : 'S';
+        }
+        if (mode & S_ISGID)
+        {
+            p_out[5] = (mode & S_IXGRP) ? 's' : 'S';
+        }
+        if (mode & S_ISVTX)
+        {
+            p_out[8] = (mode & S_IXOTH) ? 't' : 'T';
+        }
+    }
+    p_out += 9;
+    *p_out++ = ' ';
+    p_out = longname_decimal(p_out, p_st->st_nlink);
+    *p_out++ = ' ';
+    name_lookup(p_st->st_uid, SSH_FALSE, sz_owner);
+    len = strlen(sz_owner);
+    memcpy(p_out, sz_owner, len);
+    p_out += len;
+    *p_out++ = ' ';
+    name_lookup(p_st->st_gid, SSH_TRUE, sz_owner);
+    len = strlen(sz_owner);
+    memcpy(p_out, sz_owner, len);
+    p_out += len;
+    *p_out++ = ' ';
+    p_out = longname_decimal(p_out, (uint64_t)p_st->st_size);
+    *p_out++ = ' ';
+    p_out = longname_date(p_out, p_st->st_mtime);
+    *p_out++ = ' ';
+    memcpy(p_out, sz_name, name_len);
+    p_out += name_len;
+
+    store_uint32(p_str, p_out - p_start);
+    return (uint8_t *)p_out;
+}
+
+/* "YYYY-MM-DD HH:MM" in UTC. Entries of a directory tend to share a handful of
+mtimes, so each minute is only formatted once */
+static char *longname_date(char *p_out, time_t mtime)
+{
+    int64_t minute = mtime >= 0 ? mtime / 60 : -((59 - (int64_t)mtime) / 60);
+    date_entry_t *p_entry = &longname_dates[(uint64_t)minute & (LONGNAME_DATE_CACHE_SIZE - 1)];
+
+    if (!p_entry->used || p_entry->minute != minute)
+    {
+        static const char separators[] = "-- :";
+        time_t t = (time_t)minute * 60;
+        struct tm tm_st;
+        char *p = p_entry->date;
+        int fields[4];
+        int year;
+        unsigned i;
+
+        if (!gmtime_r(&t, &tm_st) || tm_st.tm_year < -1900)
+        {
+            /* Too far out for the calendar */
+            memset(&tm_st, 0, sizeof(tm_st));
+            tm_st.tm_year = -1900;
+        }
+        year = tm_st.tm_year + 1900;
+        if (year < 10000)
+        {
+            *p++ = (char)('0' + year / 1000);
+            *p++ = (char)('0' + year / 100 % 10);
+            *p++ = (char)('0' + year / 10 % 10);
+            *p++ = (char)('0' + year % 10);
+        }
+        else
+        {
+            p = longname_decimal(p, year);
+        }
+        fields[0] = tm_st.tm_mon + 1;
+        fields[1] = tm_st.tm_mday;
+        fields[2] = tm_st.tm_hour;
+        fields[3] = tm_st.tm_min;
+        for (i = 0; i < elemof(fields); i++)
+        {
+            *p++ = separators[i];
+            *p++ = (char)('0' + fields[i] / 10);
+            *p++ = (char)('0' + fields[i] % 10);
+        }
+        p_entry->len = p - p_entry->date;
+        p_entry->minute = minute;
+        p_entry->used = SSH_TRUE;
+    }
+    memcpy(p_out, p_entry->date, p_entry->len);
+    return p_out + p_entry->len;
+}
+
+/* Decimal digits of value, without a NUL. Returns the end */
+static char *longname_decimal(char *p_out, uint64_t value)
+{
+    char digits[20];
+    unsigned n = 0;
+
+    do
+    {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n)
+    {
+        *p_out++ = digits[--n];
+    }
+    return p_out;
+}
+
+static void sftp_remove(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_filename = sv_cstr(&p_req->path);
+    const char *sz_base;
+    int dirfd = path_at(sz_filename, &sz_base);
+    int ret;
+
+    /* As remove(): try as a file, then as a directory */
+    ret = unlinkat(dirfd, sz_base, 0);
+    if (ret == -1 && errno == EISDIR)
+    {
+        ret = unlinkat(dirfd, sz_base, AT_REMOVEDIR);
+        if (ret == 0)
+        {
+            path_caches_changed(sz_filename);
+        }
+    }
+    else if (ret == 0)
+    {
+        /* Nothing cached depends on a file, unless it was a symlink we've
+        resolved through */
+        if (realpath_indirect)
+        {
+            realpath_cache_flush();
+        }
+        fd_cache_forget(sz_filename);
+    }
+    if (-1 == ret)
+    {
+        put_status(id, errno_to_sftp(errno));
+    }
+    else
+    {
+        put_status(id, SSH_FX_OK);
+    }
+}
+
+static void sftp_mkdir(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_path = sv_cstr(&p_req->path);
+    const char *sz_base;
+    int dirfd = path_at(sz_path, &sz_base);
+    mode_t mode;
+
+    if (p_req->attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+    {
+        mode = p_req->attrs.permissions & PERM_MASK;
+    }
+    else
+    {
+        mode = DEFAULT_DIR_PERM;
+    }
+    /* Ignore other attrs */
+    if (-1 == mkdirat(dirfd, sz_base, mode))
+    {
+        put_status(id, errno_to_sftp(errno));
+    }
+    else
+    {
+        put_status(id, SSH_FX_OK);
+    }
+}
+
+static void sftp_rmdir(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_path = sv_cstr(&p_req->path);
+    const char *sz_base;
+    int dirfd = path_at(sz_path, &sz_base);
+
+    if (-1 == unlinkat(dirfd, sz_base, AT_REMOVEDIR))
+    {
+        put_status(id, errno_to_sftp(errno));
+    }
+    else
+    {
+        path_caches_changed(sz_path);
+        put_status(id, SSH_FX_OK);
+    }
+}
+
+/* Version 6 clients may send paths to compose with the first, each
+relative to the result so far, and ask for the result's attributes */
+static void sftp_realpath(const request_t *p_req)
+{
+#if (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L) || defined(__ANDROID__)
+    uint32_t id = p_req->id;
+    const char *sz_path = sv_cstr(&p_req->path);
+    char sz_composed[PATH_MAX];
+    char sz_fullname[PATH_MAX];
+    int unix_error;
+    attrs_t attr;
+
+    if (p_req->data.len > 0)
+    {
+        size_t len = strlen(sz_path);
+
+        /* As for extensions, the input buffer is still at the compose paths */
+        if (len >= sizeof(sz_composed))
+        {
+            put_status(id, errno_to_sftp(ENAMETOOLONG));
+            return;
+        }
+        memcpy(sz_composed, sz_path, len + 1);
+        while (ibuff.count > 0)
+        {
+            uint32_t part_len;
+            const char *sz_part = get_string(&part_len);
+
+            if (bad_message(id))
+            {
+                return;
+            }
+            if (sz_part[0] == '/')
+            {
+                len = 0;
+            }
+            else if (len > 0 && sz_composed[len - 1] != '/')
+            {
+                if (len + 1 >= sizeof(sz_composed))
+                {
+                    put_status(id, errno_to_sftp(ENAMETOOLONG));
+                    return;
+                }
+                sz_composed[len++] = '/';
+            }
+            if (len + part_len >= sizeof(sz_composed))
+            {
+                put_status(id, errno_to_sftp(ENAMETOOLONG));
+                return;
+            }
+            memcpy(&sz_composed[len], sz_part, part_len + 1);
+            len += part_len;
+        }
+        sz_path = sz_composed;
+    }
+
+    unix_error = resolve_path(sz_path, sz_fullname);
+    if (unix_error != 0)
+    {
+        put_status(id, errno_to_sftp(unix_error));
+        return;
+    }
+    if (p_req->control == SSH_FXP_REALPATH_STAT_IF || p_req->control == SSH_FXP_REALPATH_STAT_ALWAYS)
+    {
+        if (attrs_stat(AT_FDCWD, sz_fullname, 0, attrs_wanted(UINT32_MAX), &attr) == 0)
+        {
+            put_realpath_name(id, sz_fullname, &attr);
+            return;
+        }
+        if (p_req->control == SSH_FXP_REALPATH_STAT_ALWAYS)
+        {
+            put_status(id, errno_to_sftp(errno));
+            return;
+        }
+    }
+    put_realpath_name(id, sz_fullname, NULL);
+#else
+    put_status(p_req->id, SSH_FX_OP_UNSUPPORTED);
+#endif
+}
+
+static void sftp_rename(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_old_path = sv_cstr(&p_req->path);
+    const char *sz_new_path = sv_cstr(&p_req->path2);
+    const char *sz_old_base, *sz_new_base;
+    int old_dirfd, new_dirfd, ret;
+
+    /* The second lookup can't evict the first */
+    old_dirfd = path_at(sz_old_path, &sz_old_base);
+    new_dirfd = path_at(sz_new_path, &sz_new_base);
+    /* From version 5 an existing target is only replaced if the client
+    says so; before that rename() semantics were the norm */
+    if (sftp_version >= 5 && !(p_req->pflags & (SSH_FXF_RENAME_OVERWRITE | SSH_FXF_RENAME_ATOMIC)))
+    {
+        ret = rename_noreplace(old_dirfd, sz_old_base, new_dirfd, sz_new_base);
+    }
+    else
+    {
+        ret = renameat(old_dirfd, sz_old_base, new_dirfd, sz_new_base);
+    }
+    if (ret == -1)
+    {
+        put_status(id, errno_to_sftp(errno));
+    }
+    else
+    {
+        /* Whatever was at the new path has been replaced */
+        path_caches_changed(sz_old_path);
+        path_caches_changed(sz_new_path);
+        fd_cache_forget(sz_new_path);
+        put_status(id, SSH_FX_OK);
+    }
+}
+
+static void sftp_readlink(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_path = sv_cstr(&p_req->path);
+    const char *sz_base;
+    int dirfd = path_at(sz_path, &sz_base);
+    buff_save_t save;
+    attrs_t attr;
+    char *p_target;
+    uint32_t space;
+    int len;
+
+    /* Save the buffer position in case we come back and write status instead */
+    buff_save(&save);
+
+    /* Proceed as if readlink will succeed, read directly into the output buffer. */
+    put_byte(SSH_FXP_NAME);
+    put_uint32(id);
+    put_uint32(1);  /* 1 name */
+    
+    /* After attrs, space is two names - two SSH strings with 4-byte length fields. */
+    space = (obuff.count - MAX_ATTRS_BYTES)/2 - sizeof(uint32_t);
+    p_target = (char *)obuff.p_data + sizeof(uint32_t);
+    len = readlinkat(dirfd, sz_base, p_target, space);
+    if (len == -1)
+    {
+        buff_swap(&save);
+        put_status(id, errno_to_sftp(errno));
+    }
+    else
+    {
+        put_uint32(len);
+        obuff.count -= len;
+        obuff.p_data += len;
+        p_target[len] = '\0'; 
+        if (sftp_version == 3)
+        {
+            put_cstring(p_target);
+        }
+        memset(&attr, 0, sizeof(attr));
+        put_attrs(&attr);/* dummy attributes - why does SFTP specify this? Why not real attributes?*/
+    }
+}
+
+static void sftp_symlink(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_link_path = sv_cstr(&p_req->path);
+    const char *sz_target_path = sv_cstr(&p_req->path2);
+    const char *sz_link_base;
+    int dirfd = path_at(sz_link_path, &sz_link_base);
+
+    if (symlinkat(sz_target_path, dirfd, sz_link_base) == -1) /* !!! TODO Other implementations have these the other way around */
+    {
+        put_status(id, errno_to_sftp(errno));
+    }
+    else
+    {
+        path_caches_changed(sz_link_path);
+        put_status(id, SSH_FX_OK);
+    }
+}
+
+/* Version 6 LINK: new link path, existing path and whether it's symbolic.
+Unlike SYMLINK the order is as for ln */
+static void sftp_link(const request_t *p_req)
+{
+    uint32_t id = p_req->id;
+    const char *sz_link_path = sv_cstr(&p_req->path);
+    const char *sz_existing_path = sv_cstr(&p_req->path2);
+    const char *sz_link_base, *sz_existing_base;
+    int link_dirfd, existing_dirfd, ret;
+
+    link_dirfd = path_at(sz_link_path, &sz_link_base);
+    if (p_req->control)
+    {
+        ret = symlinkat(sz_existing_path, link_dirfd, sz_link_base);
+        if (ret == 0)
+        {
+            path_caches_changed(sz_link_path);
+        }
+    }
+    else
+    {
+        /* The second lookup can't evict the first */
+        existing_dirfd = path_at(sz_existing_path, &sz_existing_base);
+        ret = linkat(existing_dirfd, sz_existing_base, link_dirfd, sz_link_base, 0);
+    }
+    put_status(id, ret == -1 ? errno_to_sftp(errno) : SSH_FX_OK);
+}
+
+/* Version 6 BLOCK and UNBLOCK: byte range locks on an open file, as advisory
+open file description locks, which belong to the handle. BLOCK_READ keeps
+others' locks out altogether, so needs a write lock; BLOCK_WRITE and
+BLOCK_DELETE only keep out writers. A length of zero runs to the end of the
+file, as it does for fcntl(). Conflicts are reported rather than waited for
+(F_OFD_SETLKW), which would stall every other request. Without such locks
+BLOCK is unsupported */
+static void sftp_block(const request_t *p_req)
+{
+#ifdef F_OFD_SETLK
+    fxp_handle_t *p_handle = handle_lookup(&p_req->handle);
+    struct flock fl;
+
+    if (!p_handle || p_handle->use != HANDLE_FILE)
+    {
+        put_status(p_req->id, SSH_FX_INVALID_HANDLE);
+        return;
+    }
+    if (!(p_req->pflags & (SSH_FXF_BLOCK_READ | SSH_FXF_BLOCK_WRITE | SSH_FXF_BLOCK_DELETE)))
+    {
+        put_status(p_req->id, SSH_FX_OK);
+        return;
+    }
+    /* l_pid must be zero */
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = (p_req->pflags & SSH_FXF_BLOCK_READ) ? F_WRLCK : F_RDLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = p_req->offset;
+    fl.l_len = p_req->length;
+    if (fcntl(p_handle->fd, F_OFD_SETLK, &fl) < 0)
+    {
+        /* EBADF: the handle wasn't opened for the access the lock needs */
+        put_status(p_req->id, (errno == EACCES || errno == EAGAIN) ? SSH_FX_BYTE_RANGE_LOCK_CONFLICT
+            : errno == EBADF ? SSH_FX_BYTE_RANGE_LOCK_REFUSED : errno_to_sftp(errno));
+        return;
+    }
+    /* The lock lives as long as the descriptor, so the fd cache mustn't keep it */
+    free(p_handle->sz_path);
+    p_handle->sz_path = NULL;
+    put_status(p_req->id, SSH_FX_OK);
+#else
+    put_status(p_req->id, SSH_FX_OP_UNSUPPORTED);
+#endif
+}
+
+static void sftp_unblock(const request_t *p_req)
+{
+#ifdef F_OFD_SETLK
+    fxp_handle_t *p_handle = handle_lookup(&p_req->handle);
+    struct flock fl;
+
+    if (!p_handle || p_handle->use != HANDLE_FILE)
+    {
+        put_status(p_req->id, SSH_FX_INVALID_HANDLE);
+        return;
+    }
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = p_req->offset;
+    fl.l_len = p_req->length;
+    put_status(p_req->id, fcntl(p_handle->fd, F_OFD_SETLK, &fl) < 0 ? errno_to_sftp(errno) : SSH_FX_OK);
+#else
+    put_status(p_req->id, SSH_FX_OP_UNSUPPORTED);
+#endif
+}
+
+/* Extension handlers decode their own arguments with get_*(); the input
+buffer is left at the start of them */
+static void sftp_extended(const request_t *p_req)
+{
+    size_t i;
+
+    for (i = 0; i < elemof(extensions); i++)
+    {
+        if (strlen(extensions[i].sz_name) == p_req->name.len
+            && memcmp(extensions[i].sz_name, p_req->name.p_data, p_req->name.len) == 0)
+        {
+            extensions[i].handler(p_req->id);
+            return;
+        }
+    }
+    put_status(p_req->id, SSH_FX_OP_UNSUPPORTED);
+}
+
+/* remove-recursive@eddylangley.net: string path
+Removes path and, if it is a directory, everything beneath it without following
+symlinks. The walk is done relative to open directory descriptors so each entry
+costs one unlinkat() rather than a full path lookup. The reply is an
+EXTENDED_REPLY carrying: uint32 first error status (SSH_FX_OK if none), string
+path of the first error relative to the request path, uint64 files removed,
+uint64 directories removed. The walk continues past errors. If the path itself
+can't be examined at all we reply with a plain STATUS */
+static void ext_remove_recursive(uint32_t id)
+{
+    const char *sz_path = get_string(NULL);
+    remove_summary_t *p_sum;
+    int fd;
+
+    if (bad_message(id))
+    {
+        return;
+    }
+    /* Try the common case of a file (or symlink to a directory) first */
+    if (unlink(sz_path) == 0)
+    {
+        if (realpath_indirect)
+        {
+            realpath_cache_flush();
+        }
+        fd_cache_forget(sz_path);
+        put_status(id, SSH_FX_OK);
+        return;
+    }
+    if (errno != EISDIR && errno != EPERM)
+    {
+        put_status(id, errno_to_sftp(errno));
+        return;
+    }
+    fd = open(sz_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        put_status(id, errno_to_sftp(errno));
+        return;
+    }
+
+    /* The summary holds two path buffers so is too large for the stack */
+    p_sum = calloc(1, sizeof(*p_sum));
+    if (!p_sum)
+    {
+        close(fd);
+        put_status(id, SSH_FX_FAILURE);
+        return;
+    }
+    p_sum->first_status = SSH_FX_OK;
+    remove_dir_contents(fd, p_sum);
+    if (rmdir(sz_path) == 0)
+    {
+        p_sum->dirs++;
+    }
+    else
+    {
+        p_sum->path_len = 0;
+        remove_note_error(p_sum, errno);
+    }
+    path_caches_changed(sz_path);
+    fd_cache_forget(sz_path);
+
+    put_byte(SSH_FXP_EXTENDED_REPLY);
+    put_uint32(id);
+    put_uint32(p_sum->first_status);
+    put_cstring(p_sum->sz_first_path);
+    put_uint64(p_sum->files);
+    put_uint64(p_sum->dirs);
+    free(p_sum);
+}
+
+/* Empty the directory open on dirfd, which is closed on return. Entries are
+unlinked as files first; EISDIR (Linux) or EPERM (POSIX) tells us it is a
+directory to descend into. Descending uses one descriptor per level */
+static void remove_dir_contents(int dirfd, remove_summary_t *p_sum)
+{
+    DIR *p_dir = fdopendir(dirfd);
+    struct dirent *p_entry;
+    size_t base_len = p_sum->path_len;
+    ssh_bool_t again;
+
+    if (!p_dir)
+    {
+        remove_note_error(p_sum, errno);
+        close(dirfd);
+        return;
+    }
+
+    do
+    {
+        /* Unlinking entries while reading a directory may cause readdir() to
+        skip some; go round again if anything was removed on this pass */
+        again = SSH_FALSE;
+        while ((p_entry = readdir(p_dir)) != NULL)
+        {
+            const char *sz_name = p_entry->d_name;
+            size_t name_len;
+            int fd;
+
+            if (strcmp(sz_name, ".") == 0 || strcmp(sz_name, "..") == 0)
+            {
+                continue;
+            }
+
+            /* Track the relative path for error reports, truncating silently */
+            name_len = strlen(sz_name);
+            p_sum->path_len = base_len;
+            if (base_len + name_len + 2 <= sizeof(p_sum->sz_path))
+            {
+                if (base_len > 0)
+                {
+                    p_sum->sz_path[p_sum->path_len++] = '/';
+                }
+                memcpy(&p_sum->sz_path[p_sum->path_len], sz_name, name_len);
+                p_sum->path_len += name_len;
+            }
+            p_sum->sz_path[p_sum->path_len] = '\0';
+
+            if (unlinkat(dirfd, sz_name, 0) == 0)
+            {
+                p_sum->files++;
+                again = SSH_TRUE;
+                continue;
+            }
+            if (errno != EISDIR && errno != EPERM)
+            {
+                remove_note_error(p_sum, errno);
+                continue;
+            }
+
+            fd = openat(dirfd, sz_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (fd < 0)
+            {
+                /* Not a directory after all - unlinkat() said EPERM and meant it */
+                remove_note_error(p_sum, errno == ENOTDIR ? EPERM : errno);
+                continue;
+            }
+            remove_dir_contents(fd, p_sum);
+            if (unlinkat(dirfd, sz_name, AT_REMOVEDIR) == 0)
+            {
+                p_sum->dirs++;
+                again = SSH_TRUE;
+            }
+            else
+            {
+                remove_note_error(p_sum, errno);
+            }
+        }
+        if (again)
+        {
+            rewinddir(p_dir);
+        }
+    } while (again);
+
+    p_sum->path_len = base_len;
+    p_sum->sz_path[base_len] = '\0';
+    closedir(p_dir);
+}
+
+static void remove_note_error(remove_summary_t *p_sum, int unix_error)
+{
+    if (p_sum->first_status == SSH_FX_OK)
+    {
+        p_sum->first_status = errno_to_sftp(unix_error);
+        if (p_sum->first_status == SSH_FX_OK)
+        {
+            p_sum->first_status = SSH_FX_FAILURE;
+        }
+        memcpy(p_sum->sz_first_path, p_sum->sz_path, p_sum->path_len);
+        p_sum->sz_first_path[p_sum->path_len] = '\0';
+    }
+}
+
+/* mkdir-parents@eddylangley.net: string path, ATTRS attrs
+Like SSH_FXP_MKDIR but also creates missing parent directories (with default
+permissions), and an existing directory is not an error, as with mkdir -p */
+static void ext_mkdir_parents(uint32_t id)
+{
+    sv_t path;
+    char sz_copy[PATH_MAX];
+    attrs_t attr;
+    mode_t mode;
+    int unix_error;
+
+    get_view(&path);
+    get_attrs(&attr);
+    if (bad_message(id))
+    {
+        return;
+    }
+    mode = (attr.flags & SSH_FILEXFER_ATTR_PERMISSIONS) ? attr.permissions & PERM_MASK : DEFAULT_DIR_PERM;
+    if (path.len >= sizeof(sz_copy))
+    {
+        put_status(id, errno_to_sftp(ENAMETOOLONG));
+        return;
+    }
+    /* mkdir_parents() temporarily truncates the path in place, so it gets a
+    copy of its own rather than one from the arena */
+    memcpy(sz_copy, path.p_data, path.len);
+    sz_copy[path.len] = '\0';
+    unix_error = mkdir_parents(sz_copy, strlen(sz_copy), mode);
+    put_status(id, errno_to_sftp(unix_error));
+}
+
+/* Optimistically create the whole path, working back towards the root only
+when a parent is missing. Returns 0 or an errno value */
+static int mkdir_parents(char *sz_path, size_t len, mode_t mode)
+{
+    struct stat st;
+    char *p_slash;
+
+    /* Ignore trailing slashes */
+    while (len > 1 && sz_path[len - 1] == '/')
+    {
+        sz_path[--len] = '\0';
+    }
+    if (mkdir(sz_path, mode) == 0)
+    {
+        return 0;
+    }
+    if (errno == EEXIST)
+    {
+        /* Fine as long as it's a directory (or a symlink to one) */
+        if (stat(sz_path, &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            return 0;
+        }
+        return EEXIST;
+    }
+    if (errno != ENOENT)
+    {
+        return errno;
+    }
+
+    /* Parent is missing. Create it then try again */
+    p_slash = strrchr(sz_path, '/');
+    if (!p_slash || p_slash == sz_path)
+    {
+        return ENOENT;
+    }
+    *p_slash = '\0';
+    {
+        int unix_error = mkdir_parents(sz_path, p_slash - sz_path, DEFAULT_DIR_PERM);
+        *p_slash = '/';
+        if (unix_error != 0)
+        {
+            return unix_error;
+        }
+    }
+    if (mkdir(sz_path, mode) == 0 || (errno == EEXIST && stat(sz_path, &st) == 0 && S_ISDIR(st.st_mode)))
+    {
+        return 0;
+    }
+    return errno;
+}
+
+/* expand-path@openssh.com: string path
+As REALPATH, but a leading ~ or ~user is first replaced by that user's home
+directory */
+static void ext_expand_path(uint32_t id)
+{
+#if (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L) || defined(__ANDROID__)
+    const char *sz_path = get_string(NULL);
+    char sz_expanded[PATH_MAX];
+    char sz_fullname[PATH_MAX];
+    int unix_error;
+
+    if (bad_message(id))
+    {
+        return;
+    }
+    if (sz_path[0] == '~')
+    {
+        const char *sz_rest = strchr(sz_path, '/');
+        struct passwd *p_pw;
+        size_t user_len = sz_rest ? (size_t)(sz_rest - sz_path - 1) : strlen(sz_path) - 1;
+
+        if (user_len == 0)
+        {
+            p_pw = getpwuid(getuid());
+        }
+        else if (user_len < sizeof(sz_expanded))
+        {
+            memcpy(sz_expanded, sz_path + 1, user_len);
+            sz_expanded[user_len] = '\0';
+            p_pw = getpwnam(sz_expanded);
+        }
+        else
+        {
+            p_pw = NULL;
+        }
+        if (!p_pw)
+        {
+            put_status(id, SSH_FX_NO_SUCH_FILE);
+            return;
+        }
+        if ((size_t)snprintf(sz_expanded, sizeof(sz_expanded), "%s%s", p_pw->pw_dir, sz_rest ? sz_rest : "") >= sizeof(sz_expanded))
+        {
+            put_status(id, errno_to_sftp(ENAMETOOLONG));
+            return;
+        }
+        sz_path = sz_expanded;
+    }
+
+    unix_error = resolve_path(sz_path, sz_fullname);
+    if (unix_error != 0)
+    {
+        put_status(id, errno_to_sftp(unix_error));
+        return;
+    }
+    put_realpath_name(id, sz_fullname, NULL);
+#else
+    put_status(id, SSH_FX_OP_UNSUPPORTED);
+#endif
+}
+
+/* statvfs@openssh.com: string path
+Replies with the filesystem's statvfs as an EXTENDED_REPLY. Clients poll this
+for df, so answers are shared between sessions for a couple of seconds */
+static void ext_statvfs(uint32_t id)
+{
+    const char *sz_path = get_string(NULL);
+    struct statvfs st;
+
+    if (bad_message(id))
+    {
+        return;
+    }
+    if (statvfs_cached(sz_path, &st) < 0)
+    {
+        put_status(id, errno_to_sftp(errno));
+        return;
+    }
+    put_statvfs(id, &st);
+}
+
+/* fstatvfs@openssh.com: string handle */
+static void ext_fstatvfs(uint32_t id)
+{
+    fxp_handle_t *p_handle = get_handle();
+    struct statvfs st;
+
+    if (bad_message(id))
+    {
+        return;
+    }
+    if (!p_handle)
+    {
+        put_status(id, SSH_FX_FAILURE);
+        return;
+    }
+    if (fstatvfs(p_handle->fd, &st) < 0)
+    {
+        put_status(id, errno_to_sftp(errno));
+        return;
+    }
+    put_statvfs(id, &st);
+}
+
+/* limits@openssh.com: no arguments
+Replies with uint64 max packet length, max read length, max write length and
+max open handles, so clients can make full use of -P */
+static void ext_limits(uint32_t id)
+{
+    put_byte(SSH_FXP_EXTENDED_REPLY);
+    put_uint32(id);
+    put_uint64(max_packet);
+    put_uint64(max_packet - PACKET_HEADROOM);
+    put_uint64(max_packet - PACKET_HEADROOM);
+    put_uint64(MAX_HANDLES);
+}
+
+/* times-ns@eddylangley.net: no arguments
+From now on version 3 ATTRS replies carry the nanoseconds of their times as
+an NIH_ATTR_TIMES_NS extended attribute, so sync tools comparing mtimes see
+what is really on disk */
+static void ext_times_ns(uint32_t id)
+{
+    v3_times_ns = SSH_TRUE;
+    put_status(id, SSH_FX_OK);
+}
+
+/* lsetstat@openssh.com: string path, ATTRS attrs
+As SETSTAT, but a symlink's own attributes are set rather than its target's */
+static void ext_lsetstat(uint32_t id)
+{
+    const char *sz_path = get_string(NULL);
+    const char *sz_base;
+    attrs_t attr;
+    uint32_t status;
+    int dirfd;
+
+    get_attrs(&attr);
+    if (bad_message(id))
+    {
+        return;
+    }
+    dirfd = path_at(sz_path, &sz_base);
+    status = attrs_resolve_owner(&attr);
+    if (status == SSH_FX_OK)
+    {
+        status = attrs_apply(dirfd, sz_base, AT_SYMLINK_NOFOLLOW, &attr);
+    }
+    put_status(id, status);
+}
+
+/* data-ranges@eddylangley.net: string handle, uint64 offset, uint64 length
+Replies with uint64 end, uint32 count and count pairs of uint64 offset,
+uint64 length: the ranges of the file from offset holding data, as opposed to
+holes, which a client can skip reading. A length of 0 means to the end of the
+file. The ranges are complete up to end; if that is short of where the
+client asked for, it asks again from there. Without hole support everything
+up to the end of the file is data */
+static void ext_data_ranges(uint32_t id)
+{
+    fxp_handle_t *p_handle = get_handle();
+    uint64_t offset = get_uint64();
+    uint64_t length = get_uint64();
+    uint64_t end, pos;
+    uint32_t count = 0;
+    buff_save_t save;
+    struct stat st;
+
+    if (bad_message(id))
+    {
+        return;
+    }
+    if (!p_handle || p_handle->use != HANDLE_FILE)
+    {
+        put_status(id, SSH_FX_FAILURE);
+        return;
+    }
+    if (fstat(p_handle->fd, &st) < 0)
+    {
+        put_status(id, errno_to_sftp(errno));
+        return;
+    }
+    end = (uint64_t)st.st_size;
+    if (length != 0 && offset < end && length < end - offset)
+    {
+        end = offset + length;
+    }
+
+    put_byte(SSH_FXP_EXTENDED_REPLY);
+    put_uint32(id);
+    buff_save(&save);
+    put_uint64(0);
+    put_uint32(0);
+    for (pos = offset; pos < end && count < DATA_RANGES_MAX; count++)
+    {
+        uint64_t data = pos;
+        uint64_t hole = end;
+#ifdef SEEK_DATA
+        off_t ret = lseek(p_handle->fd, pos, SEEK_DATA);
+
+        STATS_ADD(sys_file_seek, 1);
+        if (ret < 0 && errno == ENXIO)
+        {
+            /* Only a hole from here on */
+            pos = end;
+            break;
+        }
+        if (ret >= 0)
+        {
+            data = ret;
+            ret = lseek(p_handle->fd, data, SEEK_HOLE);
+            STATS_ADD(sys_file_seek, 1);
+            if (ret >= 0 && (uint64_t)ret < end)
+            {
+                hole = ret;
+            }
+        }
+        /* Otherwise the filesystem can't tell us, so it's all data */
+#endif
+        if (data >= end)
+        {
+            pos = end;
+            break;
+        }
+        put_uint64(data);
+        put_uint64(hole - data);
+        pos = hole;
+    }
+    buff_swap(&save);
+    put_uint64(pos);
+    put_uint32(count);
+    buff_swap(&save);
+}
+
+/* preallocate@eddylangley.net: string handle, uint64 offset, uint64 length
+Reserves space for that much of the file without changing its size, so an
+upload whose size is known lands contiguously */
+static void ext_preallocate(uint32_t id)
+{
+    fxp_handle_t *p_handle = get_handle();
+    uint64_t offset = get_uint64();
+    uint64_t length = get_uint64();
+
+    if (bad_message(id))
+    {
+        return;
+    }
+    if (!p_handle || p_handle->use != HANDLE_FILE)
+    {
+        put_status(id, SSH_FX_FAILURE);
+        return;
+    }
+    if (length > 0 && preallocate(p_handle->fd, offset, length) < 0)
+    {
+        put_status(id, errno_to_sftp(errno));
+        return;
+    }
+    put_status(id, SSH_FX_OK);
+}
+
+static void put_statvfs(uint32_t id, const struct statvfs *p_st)
+{
+    /* Flag values defined by the OpenSSH extension */
+    uint64_t flags = ((p_st->f_flag & ST_RDONLY) ? 0x1 : 0) | ((p_st->f_flag & ST_NOSUID) ? 0x2 : 0);
+
+    put_byte(SSH_FXP_EXTENDED_REPLY);
+    put_uint32(id);
+    put_uint64(p_st->f_bsize);
+    put_uint64(p_st->f_frsize);
+    put_uint64(p_st->f_blocks);
+    put_uint64(p_st->f_bfree);
+    put_uint64(p_st->f_bavail);
+    put_uint64(p_st->f_files);
+    put_uint64(p_st->f_ffree);
+    put_uint64(p_st->f_favail);
+    put_uint64(p_st->f_fsid);
+    put_uint64(flags);
+    put_uint64(p_st->f_namemax);
+}
+
+static void put_status(uint32_t id, uint32_t status)
+{
+    /* Indexed by status. SSH_FX_NO_CONNECTION and SSH_FX_CONNECTION_LOST MUST
+    NOT be returned by servers */
+    static const char *const messages[] =
+    {
+        "Success", "End of file", "No such file", "Permission denied", "Failure",
+        "Bad message", NULL, NULL, "Operation unsupported", "Invalid handle",
+        "No such path", "File already exists", "Write protected", "No media",
+        "No space on filesystem", "Quota exceeded", "Unknown principal", "Lock conflict",
+        "Directory not empty", "Not a directory", "Invalid filename", "Too many symbolic links",
+        "Cannot delete", "Invalid parameter", "File is a directory", "Byte range lock conflict",
+        "Byte range lock refused", "Delete pending", "File corrupt", "Owner invalid",
+        "Group invalid", "No matching byte range lock"
+    };
+
+    put_byte(SSH_FXP_STATUS);
+    put_uint32(id);
+    put_uint32(status);
+    put_cstring(status < elemof(messages) && messages[status] ? messages[status] : "Unknown error");
+    /* Language tag */
+    put_cstring("en");
+}
+
+/* If decoding the request failed, answer it with SSH_FX_BAD_MESSAGE and
+return SSH_TRUE */
+static ssh_bool_t bad_message(uint32_t id)
+{
+    if (!decode_error)
+    {
+        return SSH_FALSE;
+    }
+    put_status(id, SSH_FX_BAD_MESSAGE);
+    return SSH_TRUE;
+}
+
+/* If the reply overflowed its buffer, answer with SSH_FX_FAILURE instead -
+which always fits - rather than send what there was room for */
+static void reply_check(uint32_t id)
+{
+    if (!encode_error)
+    {
+        return;
+    }
+    obuff.p_data = obuff.data + 4;
+    obuff.count = obuff.size - 4;
+    encode_error = SSH_FALSE;
+    put_status(id, SSH_FX_FAILURE);
+}
+
+static void put_handle(uint32_t id, unsigned long handle)
+{
+    char buff[MAX_HANDLE_DIGITS + 1];
+    assert(handle > 0);
+    assert(handle <= elemof(handles));
+
+    put_byte(SSH_FXP_HANDLE);
+    put_uint32(id);
+    sprintf(buff,"%0" STREXPAND(MAX_HANDLE_DIGITS) "lu", handle);
+    put_cstring(buff);
+}
+
+/* Obtains a handle string from the input buffer and returns either a
+pointer to a handle if the handle was valid, or NULL otherwise */
+static fxp_handle_t *get_handle(void)
+{
+    sv_t handle;
+
+    get_view(&handle);
+    return handle_lookup(&handle);
+}
+
+/* Handles are MAX_HANDLE_DIGITS decimal digits, 1..elemof(handles) */
+static fxp_handle_t *handle_lookup(const sv_t *p_handle)
+{
+    unsigned long handle = 0;
+    uint32_t i;
+
+    if (p_handle->len != MAX_HANDLE_DIGITS)
+    {
+        return NULL;
+    }
+    for (i = 0; i < p_handle->len; i++)
+    {
+        if (p_handle->p_data[i] < '0' || p_handle->p_data[i] > '9')
+        {
+            return NULL;
+        }
+        handle = handle * 10 + (p_handle->p_data[i] - '0');
+    }
+    if (handle == 0)
+    {
+        /* Zero isn't a valid handle */
+        return NULL;
+    }
+    if (handle > elemof(handles))
+    {
+        /* Out of range */
+        return NULL;
+    }
+    if (handles[handle - 1].use == HANDLE_FREE)
+    {
+        /* Not allocated */
+        return NULL;
+    }
+    return &handles[handle - 1];
+}
+
+static void buff_save(buff_save_t *p_buff)
+{
+    p_buff->count = obuff.count;
+    p_buff->p_data = obuff.p_data;
+}
+
+static void buff_swap(buff_save_t *p_buff)
+{
+    uint32_t temp = obuff.count;
+    uint8_t *p_temp = obuff.p_data;
+
+    obuff.count = p_buff->count;
+    obuff.p_data = p_buff->p_data;
+    p_buff->count = temp;
+    p_buff->p_data = p_temp;
+}
+
+/* The request was cut short. Note it and consume the rest, so everything
+decoded from here on is empty. Returns zero for the caller to use */
+static uint32_t decode_fail(void)
+{
+    decode_error = SSH_TRUE;
+    ibuff.p_data += ibuff.count;
+    ibuff.count = 0;
+    return 0;
+}
+
+/* RFC4251 byte
+      A byte represents an arbitrary 8-bit value (octet).  Fixed length
+      data is sometimes represented as an array of bytes, written
+      byte[n], where n is the number of bytes in the array.*/
+static uint8_t get_byte(void)
+{
+    uint8_t data;
+
+    /* Check we're safe */
+    if (ibuff.count < 1)
+    {
+        return (uint8_t)decode_fail();
+    }
+    data = *ibuff.p_data;
+
+    /* Adjust pointers */
+    ibuff.count--;
+    ibuff.p_data++;
+
+    return data;
+}
+
+static void put_byte(uint8_t data)
+{
+    if (obuff.count < 1)
+    {
+        encode_error = SSH_TRUE;
+        return;
+    }
+
+    *obuff.p_data = data;
+
+    /* Adjust pointers */
+    obuff.count--;
+    obuff.p_data++;
+}
+
+/* RFC4251
+      A boolean value is stored as a single byte.  The value 0
+      represents FALSE, and the value 1 represents TRUE.  All non-zero
+      values MUST be interpreted as TRUE; however, applications MUST NOT
+      store values other than 0 and 1. */
+/* Not needed static ssh_bool_t get_bool(void)
+{
+    uint8_t data = get_byte();
+    return data == 0 ? SSH_FALSE : SSH_TRUE;
+} */
+
+/* RFC4251 uint32
+Represents a 32-bit unsigned integer.  Stored as four bytes in the
+      order of decreasing significance (network byte order).  For
+      example: the value 699921578 (0x29b7f4aa) is stored as 29 b7 f4
+      aa.*/
+static uint32_t get_uint32(void)
+{
+    uint32_t data;
+
+    /* Check we're safe */
+    if (ibuff.count < 4)
+    {
+        return decode_fail();
+    }
+
+    /* Obtain uint32_t in network byte order (big-endian) */
+    data = load_uint32(ibuff.p_data);
+
+    /* Update buffer deteails */
+    ibuff.count -= 4;
+    ibuff.p_data += 4;
+
+    return data;
+}
+
+
+static uint64_t get_uint64(void)
+{
+    uint64_t data;
+
+    if (ibuff.count < 8)
+    {
+        return decode_fail();
+    }
+    data = load_uint64(ibuff.p_data);
+    ibuff.count -= 8;
+    ibuff.p_data += 8;
+    return data;
+}
+
+static void put_uint32(uint32_t data)
+{
+    /* Check for space */
+    if (obuff.count < 4)
+    {
+        encode_error = SSH_TRUE;
+        return;
+    }
+
+    /* Write in network byte order (big-endian) */
+    store_uint32(obuff.p_data, data);
+
+    /* Accounting */
+    obuff.count -= 4;
+    obuff.p_data += 4;
+}
+
+static void put_uint64(uint64_t data)
+{
+    if (obuff.count < 8)
+    {
+        encode_error = SSH_TRUE;
+        return;
+    }
+    store_uint64(obuff.p_data, data);
+    obuff.count -= 8;
+    obuff.p_data += 8;
+}
+
+static uint32_t load_uint32(const uint8_t *p_data)
+{
+#ifdef WIRE_BSWAP
+    uint32_t data;
+
+    memcpy(&data, p_data, sizeof(data));
+    return __builtin_bswap32(data);
+#else
+    return (((uint32_t)p_data[0]) << 24) |
+           (((uint32_t)p_data[1]) << 16) |
+           (((uint32_t)p_data[2]) <<  8) |
+           (((uint32_t)p_data[3])      );
+#endif
+}
+
+static uint64_t load_uint64(const uint8_t *p_data)
+{
+#ifdef WIRE_BSWAP
+    uint64_t data;
+
+    memcpy(&data, p_data, sizeof(data));
+    return __builtin_bswap64(data);
+#else
+    return ((uint64_t)load_uint32(p_data) << 32) | load_uint32(p_data + 4);
+#endif
+}
+
+static uint8_t *store_uint32(uint8_t *p_out, uint32_t data)
+{
+#ifdef WIRE_BSWAP
+    data = __builtin_bswap32(data);
+    memcpy(p_out, &data, sizeof(data));
+#else
+    p_out[0] = (uint8_t)(data >> 24);
+    p_out[1] = (uint8_t)(data >> 16);
+    p_out[2] = (uint8_t)(data >>  8);
+    p_out[3] = (uint8_t)(data      );
+#endif
+    return p_out + 4;
+}
+
+static uint8_t *store_uint64(uint8_t *p_out, uint64_t data)
+{
+#ifdef WIRE_BSWAP
+    data = __builtin_bswap64(data);
+    memcpy(p_out, &data, sizeof(data));
+    return p_out + 8;
+#else
+    p_out = store_uint32(p_out, (uint32_t)(data >> 32));
+    return store_uint32(p_out, (uint32_t)data);
+#endif
+}
+
+static uint8_t *store_string(uint8_t *p_out, const char *p_str, uint32_t len)
+{
+    p_out = store_uint32(p_out, len);
+    memcpy(p_out, p_str, len);
+    return p_out + len;
+}
+
+/* RC4251 string
+      Arbitrary length binary string.  Strings are allowed to contain
+      arbitrary binary data, including null characters and 8-bit
+      characters.  They are stored as a uint32 containing its length
+      (number of bytes that follow) and zero (= empty string) or more
+      bytes that are the value of the string.  Terminating null
+      characters are not used.
+
+      Strings are also used to store text.  In that case, US-ASCII is
+      used for internal names, and ISO-10646 UTF-8 for text that might
+      be displayed to the user.  The terminating null character SHOULD
+      NOT normally be stored in the string.  For example: the US-ASCII
+      string "testing" is represented as 00 00 00 07 t e s t i n g.  The
+      UTF-8 mapping does not alter the encoding of US-ASCII characters.
+
+      Views returned here are only valid until the next input packet
+      is received; they must be copied if they are needed for longer
+      than this. The input packet is never modified.
+*/
+static void get_view(sv_t *p_sv)
+{
+    /* Obtain length of string and check it is inside the packet */
+    p_sv->len = get_uint32();
+    p_sv->p_data = ibuff.p_data;
+    if (p_sv->len > ibuff.count)
+    {
+        p_sv->len = decode_fail();
+        return;
+    }
+
+    /* Consume the string */
+    ibuff.count -= p_sv->len;
+    ibuff.p_data += p_sv->len;
+}
+
+/* A handle followed by fixed_len bytes of fixed size fields, as READ and
+WRITE start, checked against the packet in one go. Returns the fixed fields,
+consumed, or NULL if the packet is too short */
+static const uint8_t *get_handle_fixed(sv_t *p_handle, uint32_t fixed_len)
+{
+    const uint8_t *p_fixed;
+
+    if (ibuff.count < 4 || (p_handle->len = load_uint32(ibuff.p_data)) > ibuff.count - 4
+        || fixed_len > ibuff.count - 4 - p_handle->len)
+    {
+        p_handle->len = decode_fail();
+        return NULL;
+    }
+    p_handle->p_data = ibuff.p_data + 4;
+    p_fixed = p_handle->p_data + p_handle->len;
+    ibuff.count -= 4 + p_handle->len + fixed_len;
+    ibuff.p_data += 4 + p_handle->len + fixed_len;
+    return p_fixed;
+}
+
+/* Get a string as a NUL terminated copy, valid until the next request. An
+embedded NUL ends the string early, as it would for the system calls the
+copy is passed to */
+static const char *get_string(uint32_t *p_sz_len)
+{
+    sv_t view;
+    const char *sz_copy;
+
+    get_view(&view);
+    sz_copy = sv_cstr(&view);
+    if (p_sz_len)
+    {
+        *p_sz_len = view.len;
+    }
+    return sz_copy;
+}
+
+/* NUL terminated copy of a request string, from the arena */
+static const char *sv_cstr(const sv_t *p_sv)
+{
+    char *sz_copy;
+
+    assert(arena.size - arena.used > p_sv->len);
+    sz_copy = &arena.data[arena.used];
+    memcpy(sz_copy, p_sv->p_data, p_sv->len);
+    sz_copy[p_sv->len] = '\0';
+    arena.used += p_sv->len + 1;
+    return sz_copy;
+}
+
+/* Write a C string. We trust this to be a properly null terminated string
+i.e. originates in our code or an OS call, not from the client */
+static void put_cstring(const char *sz_str)
+{
+    put_string(sz_str, strlen(sz_str));
+}
+
+/* As put_cstring() when the length is already known */
+static void put_string(const char *p_str, uint32_t len)
+{
+    if (obuff.count < 4 || len > obuff.count - 4)
+    {
+        encode_error = SSH_TRUE;
+        return;
+    }
+    put_uint32(len);
+    memcpy(obuff.p_data, p_str, len);
+
+    obuff.count -= len;
+    obuff.p_data += len;
+}
+
+/* Get ATTRs, in the encoding of the negotiated version. Fields we have no use
+for are decoded and dropped */
+static void get_attrs(attrs_t *p_attrs)
+{
+    uint32_t flags;
+
+    memset(p_attrs, 0, sizeof(*p_attrs));
+
+    flags = get_uint32();
+    if (sftp_version == 3)
+    {
+        p_attrs->flags = flags & (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID
+            | SSH_FILEXFER_ATTR_PERMISSIONS);
+        if (flags & SSH_FILEXFER_ATTR_SIZE)
+        {
+            p_attrs->size = get_uint64();
+        }
+        if (flags & SSH_FILEXFER_ATTR_UIDGID)
+        {
+            p_attrs->uid = get_uint32();
+            p_attrs->gid = get_uint32();
+        }
+        if (flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+        {
+            p_attrs->permissions = get_uint32();
+        }
+        if (flags & SSH_FILEXFER_ATTR_ACMODTIME)
+        {
+            p_attrs->flags |= SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_MODIFYTIME;
+            p_attrs->atime = get_uint32();
+            p_attrs->mtime = get_uint32();
+        }
+    }
+    else
+    {
+        ssh_bool_t subsecond = (flags & SSH_FILEXFER_ATTR_SUBSECOND_TIMES) != 0;
+        sv_t discard;
+
+        p_attrs->flags = flags & (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_OWNERGROUP
+            | SSH_FILEXFER_ATTR_PERMISSIONS | SSH_FILEXFER_ATTR_ACCESSTIME
+            | SSH_FILEXFER_ATTR_MODIFYTIME | SSH_FILEXFER_ATTR_SUBSECOND_TIMES);
+        p_attrs->type = get_byte();
+        if (flags & SSH_FILEXFER_ATTR_SIZE)
+        {
+            p_attrs->size = get_uint64();
+        }
+        if (sftp_version >= 6 && (flags & SSH_FILEXFER_ATTR_ALLOCATION_SIZE))
+        {
+            (void)get_uint64();
+        }
+        if (flags & SSH_FILEXFER_ATTR_OWNERGROUP)
+        {
+            get_view(&p_attrs->owner);
+            get_view(&p_attrs->group);
+        }
+        if (flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+        {
+            p_attrs->permissions = get_uint32();
+        }
+        if (flags & SSH_FILEXFER_ATTR_ACCESSTIME)
+        {
+            p_attrs->atime = (int64_t)get_uint64();
+            p_attrs->atime_ns = subsecond ? get_uint32() : 0;
+        }
+        if (flags & SSH_FILEXFER_ATTR_CREATETIME)
+        {
+            (void)get_uint64();
+            (void)(subsecond ? get_uint32() : 0);
+        }
+        if (flags & SSH_FILEXFER_ATTR_MODIFYTIME)
+        {
+            p_attrs->mtime = (int64_t)get_uint64();
+            p_attrs->mtime_ns = subsecond ? get_uint32() : 0;
+        }
+        if (sftp_version >= 6 && (flags & SSH_FILEXFER_ATTR_CTIME))
+        {
+            (void)get_uint64();
+            (void)(subsecond ? get_uint32() : 0);
+        }
+        if (flags & SSH_FILEXFER_ATTR_ACL)
+        {
+            get_view(&discard);
+        }
+        if (sftp_version >= 5 && (flags & SSH_FILEXFER_ATTR_BITS))
+        {
+            (void)get_uint32();
+            if (sftp_version >= 6)
+            {
+                (void)get_uint32();     /* attrib-bits-valid */
+            }
+        }
+        if (sftp_version >= 6)
+        {
+            if (flags & SSH_FILEXFER_ATTR_TEXT_HINT)
+            {
+                (void)get_byte();
+            }
+            if (flags & SSH_FILEXFER_ATTR_MIME_TYPE)
+            {
+                get_view(&discard);
+            }
+            if (flags & SSH_FILEXFER_ATTR_LINK_COUNT)
+            {
+                (void)get_uint32();
+            }
+            if (flags & SSH_FILEXFER_ATTR_UNTRANSLATED_NAME)
+            {
+                get_view(&discard);
+            }
+        }
+    }
+    if (flags & SSH_FILEXFER_ATTR_EXTENDED)
+    {
+        /* Note: ATTRs appears to be always at the end of the input packet so it
+        is probably safe to ignore extensions. Consuming the infromation we don't
+        want is however safer */
+        uint32_t count = get_uint32();
+
+        /* A bogus count runs out of packet first */
+        while (count-- && !decode_error)
+        {
+            /* Discard extended_type, extended_data pairs, except for a
+            version 3 client's nanoseconds */
+            sv_t type, data;
+
+            get_view(&type);
+            get_view(&data);
+            if (sftp_version == 3 && type.len == sizeof(NIH_ATTR_TIMES_NS) - 1
+                && memcmp(type.p_data, NIH_ATTR_TIMES_NS, type.len) == 0 && data.len == 8)
+            {
+                uint32_t atime_ns = load_uint32(data.p_data);
+                uint32_t mtime_ns = load_uint32(data.p_data + 4);
+
+                if (atime_ns < 1000000000 && mtime_ns < 1000000000)
+                {
+                    p_attrs->flags |= SSH_FILEXFER_ATTR_SUBSECOND_TIMES;
+                    p_attrs->atime_ns = atime_ns;
+                    p_attrs->mtime_ns = mtime_ns;
+                }
+            }
+        }
+    }
+
+}
+
+/* Put ATTRs in the encoding of the negotiated version, with whichever of the
+attributes it can carry */
+static void put_attrs(const attrs_t *p_attrs)
+{
+    uint8_t *p_end;
+
+    if (obuff.count < MAX_ATTRS_BYTES)
+    {
+        encode_error = SSH_TRUE;
+        return;
+    }
+    p_end = attrs_encode(obuff.p_data, p_attrs);
+    obuff.count -= p_end - obuff.p_data;
+    obuff.p_data = p_end;
+}
+
+/* Store ATTRs, at most MAX_ATTRS_BYTES of them, and return the end */
+static uint8_t *attrs_encode(uint8_t *p_out, const attrs_t *p_attrs)
+{
+    uint32_t flags = p_attrs->flags;
+
+    if (sftp_version == 3)
+    {
+        flags &= SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID | SSH_FILEXFER_ATTR_PERMISSIONS;
+        if ((p_attrs->flags & SSH_FILEXFER_ATTR_ACCESSTIME) && (p_attrs->flags & SSH_FILEXFER_ATTR_MODIFYTIME))
+        {
+            flags |= SSH_FILEXFER_ATTR_ACMODTIME;
+            if (v3_times_ns && (p_attrs->flags & SSH_FILEXFER_ATTR_SUBSECOND_TIMES))
+            {
+                flags |= SSH_FILEXFER_ATTR_EXTENDED;
+            }
+        }
+        p_out = store_uint32(p_out, flags);
+        if (flags & SSH_FILEXFER_ATTR_SIZE)
+        {
+            p_out = store_uint64(p_out, p_attrs->size);
+        }
+        if (flags & SSH_FILEXFER_ATTR_UIDGID)
+        {
+            p_out = store_uint32(p_out, p_attrs->uid);
+            p_out = store_uint32(p_out, p_attrs->gid);
+        }
+        if (flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+        {
+            p_out = store_uint32(p_out, p_attrs->permissions);
+        }
+        if (flags & SSH_FILEXFER_ATTR_ACMODTIME)
+        {
+            p_out = store_uint32(p_out, (uint32_t)p_attrs->atime);
+            p_out = store_uint32(p_out, (uint32_t)p_attrs->mtime);
+        }
+        if (flags & SSH_FILEXFER_ATTR_EXTENDED)
+        {
+            p_out = store_uint32(p_out, 1);
+            p_out = store_string(p_out, NIH_ATTR_TIMES_NS, sizeof(NIH_ATTR_TIMES_NS) - 1);
+            p_out = store_uint32(p_out, 8);
+            p_out = store_uint32(p_out, p_attrs->atime_ns);
+            p_out = store_uint32(p_out, p_attrs->mtime_ns);
+        }
+    }
+    else
+    {
+        uint8_t type = p_attrs->type ? p_attrs->type : SSH_FILEXFER_TYPE_UNKNOWN;
+        ssh_bool_t subsecond;
+
+        flags &= sftp_version >= 6 ? SUPPORTED_ATTRS_V6 : SUPPORTED_ATTRS;
+        flags &= ~SSH_FILEXFER_ATTR_OWNERGROUP;
+        if (p_attrs->flags & SSH_FILEXFER_ATTR_UIDGID)
+        {
+            flags |= SSH_FILEXFER_ATTR_OWNERGROUP;
+        }
+        if (!(flags & (SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_CREATETIME
+            | SSH_FILEXFER_ATTR_MODIFYTIME | SSH_FILEXFER_ATTR_CTIME)))
+        {
+            flags &= ~SSH_FILEXFER_ATTR_SUBSECOND_TIMES;
+        }
+        subsecond = (flags & SSH_FILEXFER_ATTR_SUBSECOND_TIMES) != 0;
+        if (sftp_version == 4 && type > SSH_FILEXFER_TYPE_UNKNOWN)
+        {
+            /* Sockets, devices and FIFOs came with version 5 */
+            type = SSH_FILEXFER_TYPE_SPECIAL;
+        }
+        p_out = store_uint32(p_out, flags);
+        *p_out++ = type;
+        if (flags & SSH_FILEXFER_ATTR_SIZE)
+        {
+            p_out = store_uint64(p_out, p_attrs->size);
+        }
+        if (flags & SSH_FILEXFER_ATTR_OWNERGROUP)
+        {
+            char sz_name[OWNER_NAME_MAX + 1];
+
+            name_lookup(p_attrs->uid, SSH_FALSE, sz_name);
+            p_out = store_string(p_out, sz_name, strlen(sz_name));
+            name_lookup(p_attrs->gid, SSH_TRUE, sz_name);
+            p_out = store_string(p_out, sz_name, strlen(sz_name));
+        }
+        if (flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+        {
+            /* The file type has its own field */
+            p_out = store_uint32(p_out, p_attrs->permissions & 07777);
+        }
+        if (flags & SSH_FILEXFER_ATTR_ACCESSTIME)
+        {
+            p_out = store_uint64(p_out, (uint64_t)p_attrs->atime);
+            if (subsecond)
+            {
+                p_out = store_uint32(p_out, p_attrs->atime_ns);
+            }
+        }
+        if (flags & SSH_FILEXFER_ATTR_CREATETIME)
+        {
+            p_out = store_uint64(p_out, (uint64_t)p_attrs->createtime);
+            if (subsecond)
+            {
+                p_out = store_uint32(p_out, p_attrs->createtime_ns);
+            }
+        }
+        if (flags & SSH_FILEXFER_ATTR_MODIFYTIME)
+        {
+            p_out = store_uint64(p_out, (uint64_t)p_attrs->mtime);
+            if (subsecond)
+            {
+                p_out = store_uint32(p_out, p_attrs->mtime_ns);
+            }
+        }
+        if (flags & SSH_FILEXFER_ATTR_CTIME)
+        {
+            p_out = store_uint64(p_out, (uint64_t)p_attrs->ctime);
+            if (subsecond)
+            {
+                p_out = store_uint32(p_out, p_attrs->ctime_ns);
+            }
+        }
+        if (flags & SSH_FILEXFER_ATTR_LINK_COUNT)
+        {
+            p_out = store_uint32(p_out, p_attrs->link_count);
+        }
+    }
+    return p_out;
+}
+
+/* NAME reply for REALPATH and friends. Without p_attr the attributes are
+empty, as most clients expect */
+static void put_realpath_name(uint32_t id, const char *sz_path, const attrs_t *p_attr)
+{
+    attrs_t attr;
+
+    put_byte(SSH_FXP_NAME);
+    put_uint32(id);
+    put_uint32(1);  /* 1 name */
+    put_cstring(sz_path);
+    if (sftp_version == 3)
+    {
+        put_cstring(sz_path);
+    }
+    if (!p_attr)
+    {
+        memset(&attr, 0, sizeof(attr));
+        p_attr = &attr;
+    }
+    put_attrs(p_attr);
+}
+
+/* Canonicalise a path as realpath() would, into a PATH_MAX buffer, returning 0
+or an errno value. realpath() lstat()s every component on every call; instead
+we start from the longest prefix of the path whose resolution we remember and
+lstat() only the components after it, falling back to realpath() when we meet a
+symlink. Directories resolved along the way are remembered. Because the result
+so far is always canonical, "." and ".." can be handled lexically.
+
+The cache only knows about changes made through this server, so anything
+that could change how a remembered directory resolves (rename, rmdir, symlink,
+or remove once a symlink has been resolved) forgets what depends on it. Changes
+made behind our back by other processes are not seen until then */
+static int resolve_path(const char *sz_path, char *sz_resolved)
+{
+#if (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L) || defined(__ANDROID__)
+    char sz_work[PATH_MAX];
+    size_t len = strlen(sz_path);
+    size_t posn, out_len;
+    ssh_bool_t want_dir = SSH_FALSE;
+    const char *sz_cached = NULL;
+
+    if (len == 0)
+    {
+        sz_path = ".";
+        len = 1;
+    }
+    if (len >= sizeof(sz_work))
+    {
+        return ENAMETOOLONG;
+    }
+    memcpy(sz_work, sz_path, len + 1);
+
+    /* A trailing slash means the result must be a directory */
+    while (len > 1 && sz_work[len - 1] == '/')
+    {
+        sz_work[--len] = '\0';
+        want_dir = SSH_TRUE;
+    }
+
+    /* Find the longest remembered prefix, ending at a component boundary */
+    posn = len;
+    for (;;)
+    {
+        char saved = sz_work[posn];
+
+        sz_work[posn] = '\0';
+        sz_cached = realpath_cache_lookup(sz_work);
+        sz_work[posn] = saved;
+        if (sz_cached)
+        {
+            break;
+        }
+        while (posn > 0 && sz_work[posn - 1] != '/')
+        {
+            posn--;
+        }
+        while (posn > 0 && sz_work[posn - 1] == '/')
+        {
+            posn--;
+        }
+        if (posn == 0)
+        {
+            break;
+        }
+    }
+
+    if (sz_cached)
+    {
+        out_len = strlen(sz_cached);
+        memcpy(sz_resolved, sz_cached, out_len + 1);
+    }
+    else if (sz_work[0] == '/')
+    {
+        strcpy(sz_resolved, "/");
+        out_len = 1;
+    }
+    else if ((sz_cached = realpath_cache_lookup(".")) != NULL)
+    {
+        out_len = strlen(sz_cached);
+        memcpy(sz_resolved, sz_cached, out_len + 1);
+    }
+    else
+    {
+        /* Our working directory never changes so resolve it once */
+        char *sz_cwd = realpath(".", NULL);
+
+        if (!sz_cwd)
+        {
+            return errno;
+        }
+        out_len = strlen(sz_cwd);
+        if (out_len >= PATH_MAX)
+        {
+            free(sz_cwd);
+            return ENAMETOOLONG;
+        }
+        memcpy(sz_resolved, sz_cwd, out_len + 1);
+        free(sz_cwd);
+        realpath_cache_insert(".", sz_resolved);
+    }
+
+    /* Walk the remaining components */
+    while (posn < len)
+    {
+        size_t start, comp_len;
+        struct stat st;
+
+        while (posn < len && sz_work[posn] == '/')
+        {
+            posn++;
+        }
+        start = posn;
+        while (posn < len && sz_work[posn] != '/')
+        {
+            posn++;
+        }
+        comp_len = posn - start;
 
-            /* If the entry will fit in the buffer */
-            if (((strlen(p_entry->d_name) + strlen(longname) + 2 * sizeof(uint32_t)) + MAX_ATTRS_BYTES) <= obuff.count)
+        if (comp_len == 0 || (comp_len == 1 && sz_work[start] == '.'))
+        {
+            continue;
+        }
+        if (comp_len == 2 && sz_work[start] == '.' && sz_work[start + 1] == '.')
+        {
+            /* Strip the last component; ".." of the root is the root */
+            realpath_indirect = SSH_TRUE;
+            while (out_len > 1 && sz_resolved[out_len - 1] != '/')
             {
-                put_cstring(p_entry->d_name);
-                put_cstring(longname);
-                stat_to_attr(&st, &attr);
-                put_attrs(&attr);
-                count++;
+                out_len--;
             }
-            else if (count > 0)
+            if (out_len > 1)
             {
-                /* We couldn't write the name to the buffer and it's not the only 
-                name in the buffer - rewind the dir pointer and leave it to next time */
-                seekdir(p_handle->p_dir, dir_posn);
+                out_len--;
+            }
+            sz_resolved[out_len] = '\0';
+            continue;
+        }
+
+        if (out_len + 1 + comp_len >= PATH_MAX)
+        {
+            return ENAMETOOLONG;
+        }
+        if (out_len > 1)
+        {
+            sz_resolved[out_len++] = '/';
+        }
+        memcpy(&sz_resolved[out_len], &sz_work[start], comp_len);
+        out_len += comp_len;
+        sz_resolved[out_len] = '\0';
+
+        if (lstat(sz_resolved, &st) < 0)
+        {
+            return errno;
+        }
+        if (S_ISLNK(st.st_mode))
+        {
+            char *sz_target = realpath(sz_resolved, NULL);
+
+            realpath_indirect = SSH_TRUE;
+            if (!sz_target)
+            {
+                return errno;
+            }
+            out_len = strlen(sz_target);
+            if (out_len >= PATH_MAX || stat(sz_target, &st) < 0)
+            {
+                free(sz_target);
+                return out_len >= PATH_MAX ? ENAMETOOLONG : errno;
+            }
+            memcpy(sz_resolved, sz_target, out_len + 1);
+            free(sz_target);
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            char saved = sz_work[posn];
+
+            sz_work[posn] = '\0';
+            realpath_cache_insert(sz_work, sz_resolved);
+            sz_work[posn] = saved;
+        }
+        else if (posn < len || want_dir)
+        {
+            return ENOTDIR;
+        }
+    }
+    return 0;
+#else
+    (void)sz_path;
+    (void)sz_resolved;
+    return ENOSYS;
+#endif
+}
+
+/* FNV-1a */
+static uint32_t hash_bytes(const void *p_data, size_t len)
+{
+    const uint8_t *p_byte = p_data;
+    uint32_t hash = 2166136261u;
+
+    while (len--)
+    {
+        hash = (hash ^ *p_byte++) * 16777619u;
+    }
+    return hash;
+}
+
+static unsigned realpath_cache_slot(const char *sz_key)
+{
+    return hash_bytes(sz_key, strlen(sz_key)) & (REALPATH_CACHE_SIZE - 1);
+}
+
+static const char *realpath_cache_lookup(const char *sz_key)
+{
+    realpath_entry_t *p_entry = &realpath_cache[realpath_cache_slot(sz_key)];
+
+    if (p_entry->sz_key && strcmp(p_entry->sz_key, sz_key) == 0)
+    {
+        return p_entry->sz_resolved;
+    }
+    return NULL;
+}
+
+static void realpath_cache_insert(const char *sz_key, const char *sz_resolved)
+{
+    realpath_entry_t *p_entry = &realpath_cache[realpath_cache_slot(sz_key)];
+    size_t key_len = strlen(sz_key) + 1;
+    size_t resolved_len = strlen(sz_resolved) + 1;
+
+    /* Evict whatever was there. Key and value share one allocation */
+    free(p_entry->sz_key);
+    p_entry->sz_key = malloc(key_len + resolved_len);
+    if (!p_entry->sz_key)
+    {
+        p_entry->sz_resolved = NULL;
+        return;
+    }
+    memcpy(p_entry->sz_key, sz_key, key_len);
+    p_entry->sz_resolved = p_entry->sz_key + key_len;
+    memcpy(p_entry->sz_resolved, sz_resolved, resolved_len);
+}
+
+static void realpath_cache_flush(void)
+{
+    size_t i;
+
+    realpath_indirect = SSH_FALSE;
+    for (i = 0; i < elemof(realpath_cache); i++)
+    {
+        free(realpath_cache[i].sz_key);
+        realpath_cache[i].sz_key = NULL;
+        realpath_cache[i].sz_resolved = NULL;
+    }
+}
+
+/* Forget what the realpath cache knows about sz_path and anything under it,
+after a request of ours renamed, removed or created it. Cached values are
+canonical, so unless a symlink or ".." was resolved along the way anything
+that depends on sz_path has a value under its canonical path; otherwise
+there's no telling, and everything goes */
+static void realpath_cache_forget(const char *sz_path)
+{
+    const char *p_slash = strrchr(sz_path, '/');
+    const char *sz_base = p_slash ? p_slash + 1 : sz_path;
+    char sz_parent[PATH_MAX];
+    char sz_resolved[PATH_MAX];
+    size_t len, base_len = strlen(sz_base);
+    size_t i;
+
+    if (realpath_indirect || base_len == 0 || strcmp(sz_base, ".") == 0 || strcmp(sz_base, "..") == 0)
+    {
+        realpath_cache_flush();
+        return;
+    }
+    if (!p_slash)
+    {
+        strcpy(sz_parent, ".");
+    }
+    else
+    {
+        len = (p_slash == sz_path) ? 1 : (size_t)(p_slash - sz_path);
+        if (len >= sizeof(sz_parent))
+        {
+            realpath_cache_flush();
+            return;
+        }
+        memcpy(sz_parent, sz_path, len);
+        sz_parent[len] = '\0';
+    }
+    if (resolve_path(sz_parent, sz_resolved) != 0 || realpath_indirect)
+    {
+        realpath_cache_flush();
+        return;
+    }
+    len = strlen(sz_resolved);
+    if (len + 1 + base_len >= sizeof(sz_resolved))
+    {
+        realpath_cache_flush();
+        return;
+    }
+    if (len > 1)
+    {
+        sz_resolved[len++] = '/';
+    }
+    memcpy(&sz_resolved[len], sz_base, base_len + 1);
+    len += base_len;
+
+    for (i = 0; i < elemof(realpath_cache); i++)
+    {
+        realpath_entry_t *p_entry = &realpath_cache[i];
+
+        if (p_entry->sz_key && (!p_entry->sz_resolved
+            || path_under(p_entry->sz_resolved, strlen(p_entry->sz_resolved), sz_resolved, len)))
+        {
+            free(p_entry->sz_key);
+            p_entry->sz_key = NULL;
+            p_entry->sz_resolved = NULL;
+        }
+    }
+}
+
+/* Whether the first len bytes of sz_path name the directory in the first
+dir_len bytes of sz_dir, or something under it. "." is the parent of every
+relative path */
+static ssh_bool_t path_under(const char *sz_path, size_t len, const char *sz_dir, size_t dir_len)
+{
+    if (dir_len == 1 && sz_dir[0] == '.')
+    {
+        return sz_path[0] != '/';
+    }
+    if (dir_len == 1 && sz_dir[0] == '/')
+    {
+        return sz_path[0] == '/';
+    }
+    return len >= dir_len && memcmp(sz_path, sz_dir, dir_len) == 0
+        && (len == dir_len || sz_path[dir_len] == '/');
+}
+
+/* Split a client path into a directory descriptor and the final component so
+that handlers can use the *at() functions. The kernel then only looks up one
+component per request rather than walking the whole path from the root; the
+directory descriptors are cached keyed by the directory part of the path.
+
+Returns AT_FDCWD and the whole path if there is no directory part, or if
+anything goes wrong - the handler's own call then reports the error. The
+descriptor remains valid at least until the next call to path_at(), so two
+paths may be resolved for one request.
+
+A hit costs no system calls. Instead every directory above one is watched by
+inotify before it's opened, and its descriptor is forgotten when any of them
+reports the next one down renamed or removed - straight away for our own
+requests, from the next batch for other processes. Directory parts with
+symlinks, "." or ".." aren't cached since what they name could change unseen,
+and nothing is without inotify. One found to go through a symlink is cached
+as AT_FDCWD, so that it isn't tried again on every request */
+static int path_at(const char *sz_path, const char **p_sz_base)
+{
+    const char *p_slash = strrchr(sz_path, '/');
+    char sz_dir[PATH_MAX];
+    dirfd_entry_t *p_victim = &dirfd_cache[0];
+    size_t dir_len;
+    uint32_t hash;
+    size_t i;
+    int fd;
+
+    *p_sz_base = sz_path;
+    if (!p_slash || p_slash[1] == '\0')
+    {
+        /* Plain name, or a trailing slash which only the full path can check */
+        return AT_FDCWD;
+    }
+    dir_len = p_slash - sz_path;
+    if (dir_len == 0)
+    {
+        /* Root directory */
+        dir_len = 1;
+    }
+    if (dir_len >= sizeof(sz_dir))
+    {
+        return AT_FDCWD;
+    }
+
+    hash = hash_bytes(sz_path, dir_len);
+    for (i = 0; i < elemof(dirfd_cache); i++)
+    {
+        dirfd_entry_t *p_entry = &dirfd_cache[i];
+
+        if (p_entry->sz_dir && p_entry->hash == hash && p_entry->dir_len == dir_len
+            && memcmp(p_entry->sz_dir, sz_path, dir_len) == 0)
+        {
+            p_entry->last_use = ++dirfd_clock;
+            p_dirfd_last = p_entry;
+            if (p_entry->fd != AT_FDCWD)
+            {
+                *p_sz_base = p_slash + 1;
+            }
+            return p_entry->fd;
+        }
+        if (!p_entry->sz_dir || (p_victim->sz_dir && p_entry->last_use < p_victim->last_use))
+        {
+            p_victim = p_entry;
+        }
+    }
+
+    errno = 0;
+    fd = AT_FDCWD;
+    if (dir_watch_chain(sz_path, dir_len))
+    {
+        memcpy(sz_dir, sz_path, dir_len);
+        sz_dir[dir_len] = '\0';
+#ifdef O_PATH
+        /* Only usable as a directory for *at(), but needs no read permission */
+        fd = open(sz_dir, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+#else
+        fd = open(sz_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+#endif
+    }
+    if (fd < 0 && errno != ENOTDIR && errno != ELOOP)
+    {
+        /* Missing, not allowed or out of watches: maybe not next time */
+        return AT_FDCWD;
+    }
+
+    if (p_victim->sz_dir)
+    {
+        if (p_victim->fd != AT_FDCWD)
+        {
+            close(p_victim->fd);
+        }
+        free(p_victim->sz_dir);
+    }
+    p_victim->sz_dir = malloc(dir_len);
+    if (!p_victim->sz_dir)
+    {
+        if (fd != AT_FDCWD)
+        {
+            close(fd);
+        }
+        return AT_FDCWD;
+    }
+    memcpy(p_victim->sz_dir, sz_path, dir_len);
+    p_victim->dir_len = dir_len;
+    p_victim->hash = hash;
+    p_victim->last_use = ++dirfd_clock;
+    p_victim->fd = fd;
+    p_dirfd_last = p_victim;
+    if (fd != AT_FDCWD)
+    {
+        *p_sz_base = p_slash + 1;
+    }
+    return fd;
+}
+
+/* Set up the inotify instance path_at() relies on to cache anything */
+static void dirfd_cache_init(void)
+{
+#ifdef __linux__
+    dir_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dir_inotify_fd >= 0)
+    {
+        ev_set(dir_inotify_fd, EV_READ, dir_on_inotify);
+    }
+#endif
+}
+
+/* Watch the directories above the one named by the first dir_len bytes of
+sz_path - "/" or "." and each one on the way down. Returns SSH_FALSE if
+it can't be cached: a component is empty, "." or "..", or isn't a real
+directory, or there's no inotify */
+static ssh_bool_t dir_watch_chain(const char *sz_path, size_t dir_len)
+{
+#ifdef __linux__
+    uint32_t chain_start = dirfd_clock + 1;
+    size_t posn = (sz_path[0] == '/') ? 1 : 0;
+
+    if (dir_inotify_fd < 0 || dir_watch_add(posn ? "/" : ".", 1, chain_start) < 0)
+    {
+        return SSH_FALSE;
+    }
+    while (posn < dir_len)
+    {
+        size_t start = posn;
+
+        while (posn < dir_len && sz_path[posn] != '/')
+        {
+            posn++;
+        }
+        if (posn == start || (posn - start == 1 && sz_path[start] == '.')
+            || (posn - start == 2 && sz_path[start] == '.' && sz_path[start + 1] == '.'))
+        {
+            return SSH_FALSE;
+        }
+        if (posn < dir_len && dir_watch_add(sz_path, posn, chain_start) < 0)
+        {
+            return SSH_FALSE;
+        }
+        posn++;
+    }
+    return SSH_TRUE;
+#else
+    (void)sz_path;
+    (void)dir_len;
+    return SSH_FALSE;
+#endif
+}
+
+#ifdef __linux__
+/* Watch the directory named by the first dir_len bytes of sz_dir unless it's
+watched already, evicting the least recently used watch not used since
+chain_start, nor relied on by the descriptor the last path_at() returned.
+Returns -1 if it can't be watched - it isn't a directory, it's a symlink, or
+every watch is in use */
+static int dir_watch_add(const char *sz_dir, size_t dir_len, uint32_t chain_start)
+{
+    dir_watch_t *p_victim = NULL;
+    char sz_name[PATH_MAX];
+    size_t i;
+    int wd;
+
+    for (i = 0; i < elemof(dir_watches); i++)
+    {
+        dir_watch_t *p_watch = &dir_watches[i];
+
+        if (p_watch->sz_dir && p_watch->dir_len == dir_len && memcmp(p_watch->sz_dir, sz_dir, dir_len) == 0)
+        {
+            p_watch->last_use = ++dirfd_clock;
+            return 0;
+        }
+        if (!p_watch->sz_dir)
+        {
+            if (!p_victim || p_victim->sz_dir)
+            {
+                p_victim = p_watch;
+            }
+        }
+        else if (p_watch->last_use < chain_start
+            && (!p_victim || (p_victim->sz_dir && p_watch->last_use < p_victim->last_use))
+            && !(p_dirfd_last && p_dirfd_last->sz_dir
+                && path_under(p_dirfd_last->sz_dir, p_dirfd_last->dir_len, p_watch->sz_dir, p_watch->dir_len)))
+        {
+            p_victim = p_watch;
+        }
+    }
+    if (!p_victim)
+    {
+        return -1;
+    }
+    if (p_victim->sz_dir)
+    {
+        dir_watch_drop(p_victim);
+    }
+
+    memcpy(sz_name, sz_dir, dir_len);
+    sz_name[dir_len] = '\0';
+    wd = inotify_add_watch(dir_inotify_fd, sz_name, IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0)
+    {
+        return -1;
+    }
+    p_victim->sz_dir = malloc(dir_len);
+    if (!p_victim->sz_dir)
+    {
+        dir_watch_unwatch(wd);
+        return -1;
+    }
+    memcpy(p_victim->sz_dir, sz_dir, dir_len);
+    p_victim->dir_len = dir_len;
+    p_victim->last_use = ++dirfd_clock;
+    p_victim->wd = wd;
+    return 0;
+}
+
+/* Remove watch wd unless another entry still uses it - two paths naming the
+same directory share one */
+static void dir_watch_unwatch(int wd)
+{
+    size_t i;
+
+    for (i = 0; i < elemof(dir_watches); i++)
+    {
+        if (dir_watches[i].sz_dir && dir_watches[i].wd == wd)
+        {
+            return;
+        }
+    }
+    inotify_rm_watch(dir_inotify_fd, wd);
+}
+
+/* Stop watching a directory, forgetting the descriptors that relied on it */
+static void dir_watch_drop(dir_watch_t *p_watch)
+{
+    dirfd_forget(p_watch->sz_dir, p_watch->dir_len);
+    free(p_watch->sz_dir);
+    p_watch->sz_dir = NULL;
+    dir_watch_unwatch(p_watch->wd);
+}
+
+/* Close the cached descriptors for the directory named by the first dir_len
+bytes of sz_dir and everything under it */
+static void dirfd_forget(const char *sz_dir, size_t dir_len)
+{
+    size_t i;
+
+    for (i = 0; i < elemof(dirfd_cache); i++)
+    {
+        dirfd_entry_t *p_entry = &dirfd_cache[i];
+
+        if (p_entry->sz_dir && path_under(p_entry->sz_dir, p_entry->dir_len, sz_dir, dir_len))
+        {
+            if (p_entry->fd != AT_FDCWD)
+            {
+                close(p_entry->fd);
+            }
+            free(p_entry->sz_dir);
+            p_entry->sz_dir = NULL;
+        }
+    }
+}
+
+/* Forget the descriptors and watches under directories inotify reports
+renamed or removed */
+static void dir_on_inotify(int fd, unsigned events)
+{
+    union
+    {
+        struct inotify_event ev;
+        char bytes[4096];
+    } buf;
+    ssize_t len;
+
+    (void)events;
+    while ((len = read(fd, buf.bytes, sizeof(buf.bytes))) > 0)
+    {
+        ssize_t posn = 0;
+
+        while (posn < len)
+        {
+            const struct inotify_event *p_ev = (const struct inotify_event *)&buf.bytes[posn];
+            size_t i, j;
+
+            if (p_ev->mask & IN_Q_OVERFLOW)
+            {
+                /* Something was missed */
+                dirfd_forget("/", 1);
+                dirfd_forget(".", 1);
+            }
+            for (i = 0; i < elemof(dir_watches); i++)
+            {
+                dir_watch_t *p_watch = &dir_watches[i];
+                char sz_child[PATH_MAX];
+                size_t child_len = 0;
+                size_t name_len;
+
+                if (!p_watch->sz_dir || p_watch->wd != p_ev->wd)
+                {
+                    continue;
+                }
+                if (p_ev->mask & IN_IGNORED)
+                {
+                    /* Gone already, with the directory */
+                    dirfd_forget(p_watch->sz_dir, p_watch->dir_len);
+                    free(p_watch->sz_dir);
+                    p_watch->sz_dir = NULL;
+                    continue;
+                }
+                if (!(p_ev->mask & IN_ISDIR) || p_ev->len == 0)
+                {
+                    continue;
+                }
+
+                name_len = strlen(p_ev->name);
+                if (!(p_watch->dir_len == 1 && p_watch->sz_dir[0] == '.'))
+                {
+                    memcpy(sz_child, p_watch->sz_dir, p_watch->dir_len);
+                    child_len = p_watch->dir_len;
+                    if (child_len > 1)
+                    {
+                        sz_child[child_len++] = '/';
+                    }
+                }
+                if (child_len + name_len >= sizeof(sz_child))
+                {
+                    dirfd_forget(p_watch->sz_dir, p_watch->dir_len);
+                    continue;
+                }
+                memcpy(&sz_child[child_len], p_ev->name, name_len);
+                child_len += name_len;
+                for (j = 0; j < elemof(dir_watches); j++)
+                {
+                    if (dir_watches[j].sz_dir
+                        && path_under(dir_watches[j].sz_dir, dir_watches[j].dir_len, sz_child, child_len))
+                    {
+                        dir_watch_drop(&dir_watches[j]);
+                    }
+                }
+                dirfd_forget(sz_child, child_len);
             }
-            /* else - we skip entries too long to ever report! This seems more helpful than
-            returning an error and refusing to read anything. */
+            posn += sizeof(struct inotify_event) + p_ev->len;
         }
-    } while (p_entry);
-
-    if (count > 0)
-    {
-        buff_swap(&save2);
-        put_uint32(count);
-        buff_swap(&save2);
     }
-    else
+}
+#endif
+
+/* Bring the path caches up to date after a request of ours renamed, removed
+or created sz_path */
+static void path_caches_changed(const char *sz_path)
+{
+    realpath_cache_forget(sz_path);
+#ifdef __linux__
+    if (dir_inotify_fd >= 0)
     {
-        buff_swap(&save1);
-        put_status(id, SSH_FX_EOF);
+        /* The events are queued by the time the request's call returns */
+        dir_on_inotify(dir_inotify_fd, EV_READ);
     }
+#endif
 }
 
-static void sftp_remove(void)
+/* Close any kept descriptors for sz_path or files under it, once removed or
+replaced, so that they aren't kept from being freed */
+static void fd_cache_forget(const char *sz_path)
 {
-    uint32_t id = get_uint32();
-    const char *sz_filename = get_string(NULL);
+    size_t len = strlen(sz_path);
+    size_t i;
 
-    if (-1 == remove(sz_filename))
-    {
-        put_status(id, errno_to_sftp(errno));
-    }
-    else
+    for (i = 0; i < elemof(fd_cache); i++)
     {
-        put_status(id, SSH_FX_OK);
+        if (fd_cache[i].sz_path && path_under(fd_cache[i].sz_path, strlen(fd_cache[i].sz_path), sz_path, len))
+        {
+            close(fd_cache[i].fd);
+            free(fd_cache[i].sz_path);
+            fd_cache[i].sz_path = NULL;
+        }
     }
 }
 
-static void sftp_mkdir(void)
+/* Clients like sshfs open and close a file for every small access. Read-only
+descriptors are kept open after CLOSE, keyed by the client's path and open
+flags, and handed out again by the next OPEN of that path. A kept descriptor
+is only reused if the path still names the same inode with the same ctime -
+so the file hasn't been replaced, written or had its permissions changed.
+With the directory's descriptor cached by path_at(), which costs nothing,
+that's one fstatat() in place of openat(), and CLOSE is an fstat() in place
+of close(); the first OPEN in a directory still pays for its watches.
+
+Returns the descriptor and passes back the path's copy for the new handle to
+own, or returns -1 if there's nothing usable */
+static int fd_cache_take(const char *sz_path, int flags, int dirfd, const char *sz_base, char **p_sz_path)
 {
-    uint32_t id = get_uint32();
-    const char *sz_path = get_string(NULL);
-    attrs_t attr;
-    mode_t mode;
+    uint32_t hash = hash_bytes(sz_path, strlen(sz_path));
+    struct stat st;
+    size_t i;
 
-    get_attrs(&attr);
-    if (attr.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+    for (i = 0; i < elemof(fd_cache); i++)
     {
-        mode = attr.permissions & PERM_MASK;
+        fd_entry_t *p_entry = &fd_cache[i];
+
+        if (p_entry->sz_path && p_entry->hash == hash && p_entry->flags == flags
+            && strcmp(p_entry->sz_path, sz_path) == 0)
+        {
+            int fd = p_entry->fd;
+            ssh_bool_t same = fstatat(dirfd, sz_base, &st, (flags & O_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0) == 0
+                && st.st_dev == p_entry->dev && st.st_ino == p_entry->ino
+                && st.ST_CTIM.tv_sec == p_entry->ctime.tv_sec && st.ST_CTIM.tv_nsec == p_entry->ctime.tv_nsec;
+
+            *p_sz_path = p_entry->sz_path;
+            p_entry->sz_path = NULL;
+            if (same)
+            {
+                return fd;
+            }
+            close(fd);
+            free(*p_sz_path);
+            *p_sz_path = NULL;
+            return -1;
+        }
     }
-    else
+    return -1;
+}
+
+/* Keep a closing handle's descriptor, taking over its path, in place of an
+older one for the same path or else the least recently used. Returns SSH_FALSE
+if it can't be kept - files already removed aren't - leaving the caller to
+close it */
+static ssh_bool_t fd_cache_put(fxp_handle_t *p_handle)
+{
+    fd_entry_t *p_victim = NULL;
+    uint32_t hash = hash_bytes(p_handle->sz_path, strlen(p_handle->sz_path));
+    struct stat st;
+    size_t i;
+
+    if (fstat(p_handle->fd, &st) < 0 || st.st_nlink == 0)
     {
-        mode = DEFAULT_DIR_PERM;
+        return SSH_FALSE;
     }
-    /* Ignore other attrs */
-    if (-1 == mkdir(sz_path, mode))
+    for (i = 0; i < elemof(fd_cache); i++)
     {
-        put_status(id, errno_to_sftp(errno));
+        fd_entry_t *p_entry = &fd_cache[i];
+
+        if (p_entry->sz_path && p_entry->hash == hash && p_entry->flags == p_handle->flags
+            && strcmp(p_entry->sz_path, p_handle->sz_path) == 0)
+        {
+            p_victim = p_entry;
+            break;
+        }
+        if (!p_victim || (p_victim->sz_path && (!p_entry->sz_path || p_entry->last_use < p_victim->last_use)))
+        {
+            p_victim = p_entry;
+        }
     }
-    else
+    if (p_victim->sz_path)
     {
-        put_status(id, SSH_FX_OK);
+        close(p_victim->fd);
+        free(p_victim->sz_path);
     }
+    p_victim->sz_path = p_handle->sz_path;
+    p_victim->hash = hash;
+    p_victim->last_use = ++fd_clock;
+    p_victim->flags = p_handle->flags;
+    p_victim->fd = p_handle->fd;
+    p_victim->dev = st.st_dev;
+    p_victim->ino = st.st_ino;
+    p_victim->ctime = st.ST_CTIM;
+    p_handle->sz_path = NULL;
+    return SSH_TRUE;
 }
 
-static void sftp_rmdir(void)
+/* Times for utimensat(). A time the client didn't send is left alone */
+static void attrs_to_ts(const attrs_t *p_attr, struct timespec ts[2])
 {
-    uint32_t id = get_uint32();
-    const char *sz_path = get_string(NULL);
+    ts[0].tv_sec = p_attr->atime;
+    ts[0].tv_nsec = (p_attr->flags & SSH_FILEXFER_ATTR_ACCESSTIME) ? p_attr->atime_ns : UTIME_OMIT;
+    ts[1].tv_sec = p_attr->mtime;
+    ts[1].tv_nsec = (p_attr->flags & SSH_FILEXFER_ATTR_MODIFYTIME) ? p_attr->mtime_ns : UTIME_OMIT;
+}
+
+/* Daemon mode. sshd runs us with -C as a shim which passes its stdin, stdout
+and working directory to the daemon over a UNIX socket, then waits for the
+daemon to close the connection. The daemon forks a process per session - this
+is cheap compared to exec, keeps sessions of different users isolated, and
+the process inherits the shared caches. Run as root, the daemon serves each
+session as the user the shim is running as; otherwise it only accepts
+connections from its own user */
+static void daemon_run(const char *sz_socket)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    int listen_sock;
 
-    if (-1 == rmdir(sz_path))
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sz_socket) >= sizeof(addr.sun_path))
     {
-        put_status(id, errno_to_sftp(errno));
+        fprintf(stderr, "Socket path too long\n");
+        exit(EXIT_FAILURE);
     }
-    else
+    strcpy(addr.sun_path, sz_socket);
+
+    /* Reap session processes automatically. SIGUSR1 asks sessions for their
+    statistics, so it mustn't kill the daemon if sent to the whole group */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGUSR1, SIG_IGN);
+
+    listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_sock < 0)
     {
-        put_status(id, SSH_FX_OK);
+        perror("socket()");
+        exit(EXIT_FAILURE);
     }
-}
-
-static void sftp_realpath(void)
-{
-#if (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L) || defined(__ANDROID__)
-    uint32_t id = get_uint32();
-    const char *sz_path = get_string(NULL);
-    char *sz_fullname;
-    attrs_t attr;
-
-    sz_fullname = realpath(sz_path, NULL);
-    if (!sz_fullname)
+    unlink(sz_socket);
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(listen_sock, DAEMON_BACKLOG) < 0)
     {
-        put_status(id, errno_to_sftp(errno));
-        return;
+        perror("bind()");
+        exit(EXIT_FAILURE);
     }
+    /* Anyone may connect; who they are decides whether they get a session */
+    chmod(sz_socket, 0666);
 
-    put_byte(SSH_FXP_NAME);
-    put_uint32(id);
-    put_uint32(1);  /* 1 name */
-    put_cstring(sz_fullname);
-    put_cstring(sz_fullname);
-    free(sz_fullname);  /* Storage is malloc'd by C library or OS */
-    memset(&attr, 0, sizeof(attr));
-    put_attrs(&attr);/* dummy attributes - why does SFTP specify this? Why not real attributes?*/
-#else
-    put_status(get_uint32(), SSH_FX_OP_UNSUPPORTED);    
-#endif
+    for (;;)
+    {
+        int sock = accept(listen_sock, NULL, NULL);
+        uid_t uid;
+        gid_t gid;
+
+        if (sock < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                perror("accept()");
+            }
+            continue;
+        }
+        /* Turn strangers away before forking for them */
+        if (peer_ids(sock, &uid, &gid) < 0)
+        {
+            close(sock);
+            continue;
+        }
+        if (geteuid() != 0 && uid != geteuid())
+        {
+            fprintf(stderr, "Refusing session for uid %lu\n", (unsigned long)uid);
+            close(sock);
+            continue;
+        }
+        switch (fork())
+        {
+        case -1:
+            perror("fork()");
+            break;
+
+        case 0:
+            close(listen_sock);
+            sa.sa_flags = 0;
+            sigaction(SIGCHLD, &sa, NULL);
+            daemon_session(sock, uid, gid);
+            break;
+
+        default:
+            break;
+        }
+        close(sock);
+    }
 }
 
-static void sftp_rename(void)
+/* Session process: receive the shim's descriptors and serve. The connection is
+left open so the shim exits when we do */
+static void daemon_session(int sock, uid_t uid, gid_t gid)
 {
-    uint32_t id = get_uint32();
-    const char *sz_old_path = get_string(NULL);
-    const char *sz_new_path = get_string(NULL);
+    int fds[3];
+    uint32_t mask;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *p_cmsg;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &mask;
+    iov.iov_len = sizeof(mask);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &msg, 0) != sizeof(mask))
+    {
+        exit(EXIT_FAILURE);
+    }
+    p_cmsg = CMSG_FIRSTHDR(&msg);
+    if (!p_cmsg || p_cmsg->cmsg_level != SOL_SOCKET || p_cmsg->cmsg_type != SCM_RIGHTS
+        || p_cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        fprintf(stderr, "Bad descriptors from shim\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(fds, CMSG_DATA(p_cmsg), sizeof(fds));
 
-    if (rename(sz_old_path, sz_new_path) == -1)
+    if (daemon_switch_user(uid, gid) < 0)
     {
-        put_status(id, errno_to_sftp(errno));
+        exit(EXIT_FAILURE);
     }
-    else
+    if (dup2(fds[0], STDIN_FILENO) < 0 || dup2(fds[1], STDOUT_FILENO) < 0 || fchdir(fds[2]) < 0)
     {
-        put_status(id, SSH_FX_OK);
+        perror("session setup");
+        exit(EXIT_FAILURE);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    close(fds[2]);
+    umask(mask);
+    if (sz_trace_file)
+    {
+        /* One trace per session */
+        static char sz_session_trace[PATH_MAX];
+
+        snprintf(sz_session_trace, sizeof(sz_session_trace), "%s.%ld", sz_trace_file, (long)getpid());
+        sz_trace_file = sz_session_trace;
     }
+    serve();
 }
 
-static void sftp_readlink(void)
+/* Become the user at the other end of the socket, unless we aren't root and
+so already are - daemon_run() turns anyone else away */
+static int daemon_switch_user(uid_t uid, gid_t gid)
 {
-    uint32_t id = get_uint32();
-    const char *sz_path = get_string(NULL);
-    buff_save_t save;
-    attrs_t attr;
-    char *p_target;
-    uint32_t space;
-    int len;
-
-    /* Save the buffer position in case we come back and write status instead */
-    buff_save(&save);
+    struct passwd *p_pw;
 
-    /* Proceed as if readlink will succeed, read directly into the output buffer. */
-    put_byte(SSH_FXP_NAME);
-    put_uint32(id);
-    put_uint32(1);  /* 1 name */
-    
-    /* After attrs, space is two names - two SSH strings with 4-byte length fields. */
-    space = (obuff.count - MAX_ATTRS_BYTES)/2 - sizeof(uint32_t);
-    p_target = (char *)obuff.p_data + sizeof(uint32_t);
-    len = readlink(sz_path, p_target, space);
-    if (len == -1)
+    if (geteuid() != 0)
     {
-        buff_swap(&save);
-        put_status(id, errno_to_sftp(errno));
+        return 0;
     }
-    else
+    p_pw = getpwuid(uid);
+    if (!p_pw || initgroups(p_pw->pw_name, gid) < 0 || setgid(gid) < 0 || setuid(uid) < 0)
     {
-        put_uint32(len);
-        obuff.count -= len;
-        obuff.p_data += len;
-        p_target[len] = '\0'; 
-        put_cstring(p_target);
-        memset(&attr, 0, sizeof(attr));
-        put_attrs(&attr);/* dummy attributes - why does SFTP specify this? Why not real attributes?*/
+        fprintf(stderr, "Can't become uid %lu\n", (unsigned long)uid);
+        return -1;
     }
+    return 0;
 }
 
-static void sftp_symlink(void)
+/* The user and group of the process at the other end of a UNIX socket */
+static int peer_ids(int sock, uid_t *p_uid, gid_t *p_gid)
 {
-    uint32_t id = get_uint32();
-    const char *sz_link_path = get_string(NULL);
-    const char *sz_target_path = get_string(NULL);
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
 
-    if (symlink(sz_target_path, sz_link_path) == -1) /* !!! TODO Other implementations have these the other way around */
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
     {
-        put_status(id, errno_to_sftp(errno));
+        perror("SO_PEERCRED");
+        return -1;
     }
-    else
+    *p_uid = cred.uid;
+    *p_gid = cred.gid;
+#else
+    if (getpeereid(sock, p_uid, p_gid) < 0)
     {
-        put_status(id, SSH_FX_OK);
+        perror("getpeereid()");
+        return -1;
     }
+#endif
+    return 0;
 }
 
-static void put_status(uint32_t id, uint32_t status)
+/* Hand our stdin, stdout and working directory to the daemon and wait for the
+session to end. If the daemon isn't there, or the socket is held by someone
+other than root or our own user, return and serve the session ourselves */
+static void shim_run(const char *sz_socket)
 {
-    put_byte(SSH_FXP_STATUS);
-    put_uint32(id);
-    put_uint32(status);
-
-    switch (status)
+    struct sockaddr_un addr;
+    int fds[3];
+    uint32_t mask;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *p_cmsg;
+    union
     {
-    case SSH_FX_OK:
-        put_cstring("Success");
-        break;
-
-    case SSH_FX_EOF:
-        put_cstring("End of file");
-        break;
-
-    case SSH_FX_NO_SUCH_FILE:
-        put_cstring("No such file");
-        break;
-
-    case SSH_FX_PERMISSION_DENIED:
-        put_cstring("Permission denied");
-        break;
-
-    case SSH_FX_FAILURE:
-        put_cstring("Failure");
-        break;
-
-    case SSH_FX_BAD_MESSAGE:
-        put_cstring("Bad message");
-        break;
-
-    /* case SSH_FX_NO_CONNECTION, SSH_FX_CONNECTION_LOST MUST NOT be returned by servers */
-
-    case SSH_FX_OP_UNSUPPORTED:
-        put_cstring("Operation unsupported");
-        break;
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    char dummy;
+    uid_t uid;
+    gid_t gid;
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sz_socket) >= sizeof(addr.sun_path))
+    {
+        return;
+    }
+    strcpy(addr.sun_path, sz_socket);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        return;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return;
+    }
+    /* Anyone else could have bound the path and would get our session */
+    if (peer_ids(sock, &uid, &gid) < 0 || (uid != 0 && uid != geteuid()))
+    {
+        close(sock);
+        return;
+    }
+    fds[0] = STDIN_FILENO;
+    fds[1] = STDOUT_FILENO;
+    fds[2] = open(".", O_RDONLY | O_DIRECTORY);
+    if (fds[2] < 0)
+    {
+        close(sock);
+        return;
+    }
+    mask = umask(0);
+    umask(mask);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &mask;
+    iov.iov_len = sizeof(mask);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    p_cmsg = CMSG_FIRSTHDR(&msg);
+    p_cmsg->cmsg_level = SOL_SOCKET;
+    p_cmsg->cmsg_type = SCM_RIGHTS;
+    p_cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(p_cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, 0) != sizeof(mask))
+    {
+        /* Nothing was handed over */
+        close(fds[2]);
+        close(sock);
+        return;
+    }
 
-    default:
-        put_cstring("Unknown error");
-        break;
+    /* The daemon has the session now */
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(fds[2]);
+    while (read(sock, &dummy, 1) < 0 && errno == EINTR)
+    {
     }
-    /* Language tag */
-    put_cstring("en");
+    exit(EXIT_SUCCESS);
 }
 
-static void put_handle(uint32_t id, unsigned long handle)
+/* Set up the shared caches. The memory is shared with any processes we fork;
+if we can't get it the caches are simply not used */
+static void shared_init(void)
 {
-    char buff[MAX_HANDLE_DIGITS + 1];
-    assert(handle > 0);
-    assert(handle <= elemof(handles));
+    void *p_mem = mmap(NULL, sizeof(shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-    put_byte(SSH_FXP_HANDLE);
-    put_uint32(id);
-    sprintf(buff,"%0" STREXPAND(MAX_HANDLE_DIGITS) "lu", handle);
-    put_cstring(buff);
+    /* Zero-filled, which makes every entry empty */
+    p_shared = (p_mem == MAP_FAILED) ? NULL : p_mem;
 }
 
-/* Obtains a handle string from the input buffer and returns either a
-pointer to a handle if the handle was valid, or NULL otherwise */
-static fxp_handle_t *get_handle(void)
+/* Look up a user or group name, falling back to the number as ls does. sz_name
+must hold OWNER_NAME_MAX + 1 characters. Names too long for the shared cache
+are looked up every time; names too long for sz_name go as the number too,
+since a truncated one would name someone else or no one */
+static const char *name_lookup(uint32_t id, ssh_bool_t is_group, char *sz_name)
 {
-    const char *sz_handle;
-    uint32_t handle_len;
-    unsigned long handle;
-    char *ep;
+    name_entry_t *p_entry = NULL;
+    time_t now = time(NULL);
+    const char *sz_found = NULL;
 
-    sz_handle = get_string(&handle_len);
-
-    if (handle_len != MAX_HANDLE_DIGITS)
+    if (p_shared)
     {
-        return NULL;
+        uint32_t seq;
+
+        p_entry = &p_shared->names[(id * 2654435761u + is_group) & (NAME_CACHE_SIZE - 1)];
+        seq = p_entry->seq;
+        __sync_synchronize();
+        if (!(seq & 1) && p_entry->expires > now && p_entry->id == id && p_entry->is_group == is_group)
+        {
+            memcpy(sz_name, p_entry->sz_name, sizeof(p_entry->sz_name));
+            __sync_synchronize();
+            if (p_entry->seq == seq)
+            {
+                return sz_name;
+            }
+        }
     }
-    handle = strtoul(sz_handle, &ep, 10);
-    if (*ep != '\0')
+
+    if (is_group)
     {
-        /* Didn't convert all characters */
-        return NULL;
+        struct group *p_gr = getgrgid(id);
+        sz_found = p_gr ? p_gr->gr_name : NULL;
     }
-    if (handle == 0)
+    else
     {
-        /* Didn't convert string (or was zero which isn't a valid handle) */
-        return NULL;
+        struct passwd *p_pw = getpwuid(id);
+        sz_found = p_pw ? p_pw->pw_name : NULL;
     }
-    if (handle > elemof(handles))
+    if (sz_found && strlen(sz_found) <= OWNER_NAME_MAX)
     {
-        /* Out of range */
-        return NULL;
+        strcpy(sz_name, sz_found);
     }
-    if (handles[handle - 1].use == HANDLE_FREE)
+    else
     {
-        /* Not allocated */
-        return NULL;
+        snprintf(sz_name, OWNER_NAME_MAX + 1, "%lu", (unsigned long)id);
     }
-    return &handles[handle - 1];
-}
 
-static void buff_save(buff_save_t *p_buff)
-{
-    p_buff->count = obuff.count;
-    p_buff->p_data = obuff.p_data;
+    if (p_entry && strlen(sz_name) <= NAME_CACHE_LEN && seq_write_begin(&p_entry->seq))
+    {
+        p_entry->id = id;
+        p_entry->is_group = is_group;
+        p_entry->expires = now + NAME_CACHE_TTL;
+        strcpy(p_entry->sz_name, sz_name);
+        seq_write_end(&p_entry->seq);
+    }
+    return sz_name;
 }
 
-static void buff_swap(buff_save_t *p_buff)
+/* statvfs() through the shared cache. Sessions differ in working directory
+and user, so entries are keyed by the canonical path and uid - resolving the
+path also checks that this user can reach it. Paths which don't resolve, or
+are too long for the cache, aren't cached */
+static int statvfs_cached(const char *sz_path, struct statvfs *p_st)
 {
-    uint32_t temp = obuff.count;
-    uint8_t *p_temp = obuff.p_data;
+    char sz_resolved[PATH_MAX];
+    size_t len = 0;
+    statvfs_entry_t *p_entry = NULL;
+    time_t now = time(NULL);
+    uid_t uid = getuid();
+
+    if (p_shared && resolve_path(sz_path, sz_resolved) == 0
+        && (len = strlen(sz_resolved)) <= STATVFS_CACHE_LEN)
+    {
+        uint32_t seq;
+
+        sz_path = sz_resolved;
+        p_entry = &p_shared->statvfs[(hash_bytes(sz_path, len) + uid) & (STATVFS_CACHE_SIZE - 1)];
+        seq = p_entry->seq;
+        __sync_synchronize();
+        if (!(seq & 1) && p_entry->expires > now && p_entry->uid == uid
+            && strcmp(p_entry->sz_path, sz_path) == 0)
+        {
+            *p_st = p_entry->st;
+            __sync_synchronize();
+            if (p_entry->seq == seq)
+            {
+                return 0;
+            }
+        }
+    }
 
-    obuff.count = p_buff->count;
-    obuff.p_data = p_buff->p_data;
-    p_buff->count = temp;
-    p_buff->p_data = p_temp;
+    if (statvfs(sz_path, p_st) < 0)
+    {
+        return -1;
+    }
+    if (p_entry && seq_write_begin(&p_entry->seq))
+    {
+        p_entry->uid = uid;
+        memcpy(p_entry->sz_path, sz_path, len + 1);
+        p_entry->st = *p_st;
+        p_entry->expires = now + STATVFS_CACHE_TTL;
+        seq_write_end(&p_entry->seq);
+    }
+    return 0;
 }
 
-/* RFC4251 byte
-      A byte represents an arbitrary 8-bit value (octet).  Fixed length
-      data is sometimes represented as an array of bytes, written
-      byte[n], where n is the number of bytes in the array.*/
-static uint8_t get_byte(void)
+/* Claim a shared cache entry for writing; fails if another process has it */
+static ssh_bool_t seq_write_begin(volatile uint32_t *p_seq)
 {
-    uint8_t data;
-
-    /* Check we're safe */
-    assert(ibuff.count > 0);
-    data = *ibuff.p_data;
-
-    /* Adjust pointers */
-    ibuff.count--;
-    ibuff.p_data++;
+    uint32_t seq = *p_seq;
 
-    return data;
+    if ((seq & 1) || !__sync_bool_compare_and_swap(p_seq, seq, seq + 1))
+    {
+        return SSH_FALSE;
+    }
+    return SSH_TRUE;
 }
 
-static void put_byte(uint8_t data)
+static void seq_write_end(volatile uint32_t *p_seq)
 {
-    assert(obuff.count > 0);
+    /* Full barrier - the entry must be written before it becomes readable */
+    __sync_fetch_and_add(p_seq, 1);
+}
 
-    *obuff.p_data = data;
+/* Statistics. Collection costs two clock_gettime() calls (no system call on
+most platforms) and a few additions per request. The statistics are appended
+to the file as one line of JSON on SIGUSR1 and at the end of the session */
+static void stats_init(void)
+{
+    struct sigaction sa;
 
-    /* Adjust pointers */
-    obuff.count--;
-    obuff.p_data++;
+    p_stats = calloc(1, sizeof(*p_stats));
+    if (!p_stats)
+    {
+        fprintf(stderr, "No memory for statistics\n");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &p_stats->start);
+
+    /* No SA_RESTART - the signal should interrupt the event loop's wait */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    atexit(stats_dump_at_exit);
 }
 
-/* RFC4251
-      A boolean value is stored as a single byte.  The value 0
-      represents FALSE, and the value 1 represents TRUE.  All non-zero
-      values MUST be interpreted as TRUE; however, applications MUST NOT
-      store values other than 0 and 1. */
-/* Not needed static ssh_bool_t get_bool(void)
+static void stats_on_signal(int sig)
 {
-    uint8_t data = get_byte();
-    return data == 0 ? SSH_FALSE : SSH_TRUE;
-} */
+    (void)sig;
+    stats_requested = 1;
+}
 
-/* RFC4251 uint32
-Represents a 32-bit unsigned integer.  Stored as four bytes in the
-      order of decreasing significance (network byte order).  For
-      example: the value 699921578 (0x29b7f4aa) is stored as 29 b7 f4
-      aa.*/
-static uint32_t get_uint32(void)
+static void stats_dump_at_exit(void)
 {
-    uint32_t data;
+    stats_dump("exit");
+}
 
-    /* Check we're safe */
-    assert(ibuff.count >= 4);
+/* Account for one request, given how long it took to handle. The reply is
+still in the output buffer so we can see whether it reported an error */
+static void stats_request(uint8_t opcode, uint64_t ns)
+{
+    op_stats_t *p_op = &p_stats->ops[opcode];
 
-    /* Obtain uint32_t in network byte order (big-endian) */
-    data = (((uint32_t)ibuff.p_data[0]) << 24) |
-           (((uint32_t)ibuff.p_data[1]) << 16) |
-           (((uint32_t)ibuff.p_data[2]) <<  8) |
-           (((uint32_t)ibuff.p_data[3])      );
+    if (p_op->count == 0 || ns < p_op->min_ns)
+    {
+        p_op->min_ns = ns;
+    }
+    if (ns > p_op->max_ns)
+    {
+        p_op->max_ns = ns;
+    }
+    p_op->count++;
+    p_op->total_ns += ns;
+    p_op->hist[stats_bucket(ns)]++;
 
-    /* Update buffer deteails */
-    ibuff.count -= 4;
-    ibuff.p_data += 4;
+    /* STATUS reply: 4 length, 1 type, 4 id, 4 status */
+    if (obuff.size - obuff.count >= 13 && obuff.data[4] == SSH_FXP_STATUS)
+    {
+        uint32_t status = ((uint32_t)obuff.data[9] << 24) | ((uint32_t)obuff.data[10] << 16)
+            | ((uint32_t)obuff.data[11] << 8) | obuff.data[12];
 
-    return data;
+        if (status != SSH_FX_OK && status != SSH_FX_EOF)
+        {
+            p_op->errors++;
+        }
+    }
 }
 
-static uint64_t get_uint64(void)
+/* Log-linear bucket: values below STATS_SUB_BUCKETS have their own bucket,
+above that each power of 2 is split into STATS_SUB_BUCKETS */
+static unsigned stats_bucket(uint64_t ns)
 {
-    uint64_t data;
+    unsigned magnitude;
 
-    data = get_uint32();
-    data = (data << 32) | get_uint32();
-    return data;
+    if (ns < STATS_SUB_BUCKETS)
+    {
+        return (unsigned)ns;
+    }
+    magnitude = 63 - __builtin_clzll(ns);
+    if (magnitude >= STATS_MAX_MAGNITUDE)
+    {
+        return STATS_HIST_BUCKETS - 1;
+    }
+    return (magnitude - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS
+        + (unsigned)((ns >> (magnitude - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
 }
 
-static void put_uint32(uint32_t data)
+/* Smallest value that falls in a bucket */
+static uint64_t stats_bucket_low(unsigned bucket)
 {
-    /* Check for space */
-    assert(obuff.count >= 4);
-
-    /* Write in network byte order (big-endian) */
-    obuff.p_data[0] = (uint8_t)(data >> 24);
-    obuff.p_data[1] = (uint8_t)(data >> 16);
-    obuff.p_data[2] = (uint8_t)(data >>  8);
-    obuff.p_data[3] = (uint8_t)(data      );
+    unsigned magnitude;
 
-    /* Accounting */
-    obuff.count -= 4;
-    obuff.p_data += 4;
+    if (bucket < STATS_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    magnitude = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    return ((uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS)) << (magnitude - STATS_SUB_BITS);
 }
 
-static void put_uint64(uint64_t data)
+/* Lower bound of the bucket holding the given percentile */
+static uint64_t stats_percentile(const op_stats_t *p_op, unsigned percent)
 {
-    put_uint32((uint32_t)(data >> 32));
-    put_uint32((uint32_t)data);
-}
-
-/* RC4251 string
-      Arbitrary length binary string.  Strings are allowed to contain
-      arbitrary binary data, including null characters and 8-bit
-      characters.  They are stored as a uint32 containing its length
-      (number of bytes that follow) and zero (= empty string) or more
-      bytes that are the value of the string.  Terminating null
-      characters are not used.
+    uint64_t target = (p_op->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    unsigned i;
 
-      Strings are also used to store text.  In that case, US-ASCII is
-      used for internal names, and ISO-10646 UTF-8 for text that might
-      be displayed to the user.  The terminating null character SHOULD
-      NOT normally be stored in the string.  For example: the US-ASCII
-      string "testing" is represented as 00 00 00 07 t e s t i n g.  The
-      UTF-8 mapping does not alter the encoding of US-ASCII characters.
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+        seen += p_op->hist[i];
+        if (seen >= target && seen > 0)
+        {
+            return stats_bucket_low(i);
+        }
+    }
+    return p_op->max_ns;
+}
 
-      Strings returned here are only valid until the next input packet
-      is received; they must be copied if they are needed for longer
-      than this.
-*/
-static const char *get_string(uint32_t *p_sz_len)
+/* Append the statistics to the statistics file as a single write() so dumps
+from concurrent sessions don't interleave. Histograms are given as
+[bucket lower bound ns, count] pairs for non-empty buckets */
+static void stats_dump(const char *sz_reason)
 {
-    uint32_t len_bytes;
-    uint8_t *p_sz;
-
-    /* Obtain a pointer to where the length field currently is */
-    p_sz = ibuff.p_data;
+    char *p_buf, *p_out, *p_end;
+    struct timespec now;
+    unsigned op, i;
+    const char *sz_sep = "";
+    int fd;
 
-    /* Obtain length of string and check it is inside the packet*/
-    len_bytes = get_uint32();
-    assert(len_bytes <= ibuff.count);
+    if (!p_stats || !(p_buf = malloc(STATS_DUMP_SIZE)))
+    {
+        return;
+    }
+    p_out = p_buf;
+    p_end = p_buf + STATS_DUMP_SIZE;
+#define STATS_PRINT(...) do { if (p_out < p_end) { \
+        p_out += snprintf(p_out, p_end - p_out, __VA_ARGS__); } } while (0)
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    STATS_PRINT("{\"pid\":%ld,\"time\":%ld,\"reason\":\"%s\",\"uptime_ns\":%llu,",
+        (long)getpid(), (long)time(NULL), sz_reason,
+        (unsigned long long)((uint64_t)(now.tv_sec - p_stats->start.tv_sec) * 1000000000u
+            + now.tv_nsec - p_stats->start.tv_nsec));
+    STATS_PRINT("\"packets_in\":%llu,\"packets_out\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+        "\"file_bytes_read\":%llu,\"file_bytes_written\":%llu,\"mapped_reads\":%llu,\"attr_hits\":%llu,",
+        (unsigned long long)p_stats->packets_in, (unsigned long long)p_stats->packets_out,
+        (unsigned long long)p_stats->bytes_in, (unsigned long long)p_stats->bytes_out,
+        (unsigned long long)p_stats->file_bytes_read, (unsigned long long)p_stats->file_bytes_written,
+        (unsigned long long)p_stats->mapped_reads, (unsigned long long)p_stats->attr_hits);
+    STATS_PRINT("\"syscalls\":{\"read\":%llu,\"write\":%llu,\"wait\":%llu,"
+        "\"file_read\":%llu,\"file_write\":%llu,\"file_seek\":%llu},",
+        (unsigned long long)p_stats->sys_read, (unsigned long long)p_stats->sys_write,
+        (unsigned long long)p_stats->sys_wait, (unsigned long long)p_stats->sys_file_read,
+        (unsigned long long)p_stats->sys_file_write, (unsigned long long)p_stats->sys_file_seek);
+    STATS_PRINT("\"handles\":{\"open\":%lu,\"peak\":%lu},"
+        "\"queues\":{\"input_peak_bytes\":%lu,\"output_peak_bytes\":%lu,\"batch_peak_packets\":%lu,"
+        "\"buffers_allocated\":%llu},"
+        "\"ops\":{",
+        (unsigned long)p_stats->handles_open, (unsigned long)p_stats->handles_peak,
+        (unsigned long)p_stats->input_peak, (unsigned long)p_stats->output_peak,
+        (unsigned long)p_stats->batch_peak, (unsigned long long)p_stats->buffers_allocated);
+
+    for (op = 0; op < STATS_MAX_OPCODES; op++)
+    {
+        const op_stats_t *p_op = &p_stats->ops[op];
+        const char *sz_hist_sep = "";
+        const char *sz_name = opcode_name(op);
+        char sz_number[8];
 
-    /* Move the string earlier in memory by 4 bytes and append null terminator */
-    memmove(p_sz, ibuff.p_data, len_bytes);
-    p_sz[len_bytes] = '\0';
+        if (p_op->count == 0)
+        {
+            continue;
+        }
+        if (!sz_name)
+        {
+            sprintf(sz_number, "%u", op);
+            sz_name = sz_number;
+        }
+        STATS_PRINT("%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"total_ns\":%llu,\"min_ns\":%llu,"
+            "\"max_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"hist\":[",
+            sz_sep, sz_name, (unsigned long long)p_op->count, (unsigned long long)p_op->errors,
+            (unsigned long long)p_op->total_ns, (unsigned long long)p_op->min_ns,
+            (unsigned long long)p_op->max_ns, (unsigned long long)stats_percentile(p_op, 50),
+            (unsigned long long)stats_percentile(p_op, 90), (unsigned long long)stats_percentile(p_op, 99));
+        for (i = 0; i < STATS_HIST_BUCKETS; i++)
+        {
+            if (p_op->hist[i])
+            {
+                STATS_PRINT("%s[%llu,%lu]", sz_hist_sep, (unsigned long long)stats_bucket_low(i),
+                    (unsigned long)p_op->hist[i]);
+                sz_hist_sep = ",";
+            }
+        }
+        STATS_PRINT("]}");
+        sz_sep = ",";
+    }
+    STATS_PRINT("}}\n");
+#undef STATS_PRINT
 
-    /* Consume the length of the string */
-    ibuff.count -= len_bytes;
-    ibuff.p_data += len_bytes;
+    if (p_out < p_end)
+    {
+        fd = open(sz_stats_file, O_WRONLY | O_APPEND | O_CREAT, 0600);
+        if (fd >= 0)
+        {
+            if (write(fd, p_buf, p_out - p_buf) < 0)
+            {
+                perror("write(stats)");
+            }
+            close(fd);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Statistics too large to dump\n");
+    }
+    free(p_buf);
+}
 
-    /* Return the length if required */
-    if (p_sz_len)
+static const char *opcode_name(uint8_t opcode)
+{
+    switch (opcode)
     {
-        *p_sz_len = len_bytes;
+    case SSH_FXP_INIT:      return "INIT";
+    case SSH_FXP_OPEN:      return "OPEN";
+    case SSH_FXP_CLOSE:     return "CLOSE";
+    case SSH_FXP_READ:      return "READ";
+    case SSH_FXP_WRITE:     return "WRITE";
+    case SSH_FXP_LSTAT:     return "LSTAT";
+    case SSH_FXP_FSTAT:     return "FSTAT";
+    case SSH_FXP_SETSTAT:   return "SETSTAT";
+    case SSH_FXP_FSETSTAT:  return "FSETSTAT";
+    case SSH_FXP_OPENDIR:   return "OPENDIR";
+    case SSH_FXP_READDIR:   return "READDIR";
+    case SSH_FXP_REMOVE:    return "REMOVE";
+    case SSH_FXP_MKDIR:     return "MKDIR";
+    case SSH_FXP_RMDIR:     return "RMDIR";
+    case SSH_FXP_REALPATH:  return "REALPATH";
+    case SSH_FXP_STAT:      return "STAT";
+    case SSH_FXP_RENAME:    return "RENAME";
+    case SSH_FXP_READLINK:  return "READLINK";
+    case SSH_FXP_SYMLINK:   return "SYMLINK";
+    case SSH_FXP_EXTENDED:  return "EXTENDED";
+    default:                return NULL;
     }
-    /* The cast to const adds a small amount of safety... once
-    we've messed with a string in this manner it shouldn't be used
-    where it might be modified */
-    return (const char*)p_sz;
 }
 
-/* Return data string (i.e. not null terminated, may contain arbitrary bytes
-including zeros). Only valid while the input packet hangs around */
-static const uint8_t *get_data(uint32_t *p_len)
+/* Request tracing. Every request is written to the trace file with when it
+was handled, how long that took and what the reply was (see
+nih-sftp-server.h), so a session can be replayed by nih-sftp-replay. Records
+go through stdio's buffer; exit() flushes it */
+static void trace_init(void)
 {
-    const uint8_t *p_data;
-    uint32_t len_bytes = get_uint32();
-    assert(len_bytes <= ibuff.count);
+    uint8_t header[TRACE_HEADER_LEN];
+    char sz_cwd[PATH_MAX];
+    int fd;
 
-    p_data = ibuff.p_data;
-    if (p_len)
+    /* WRITE records hold file contents, so only we may read it */
+    fd = open(sz_trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    p_trace = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (!p_trace)
     {
-        *p_len = len_bytes;
+        perror(sz_trace_file);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
     }
+    if (!getcwd(sz_cwd, sizeof(sz_cwd)))
+    {
+        sz_cwd[0] = '\0';
+    }
+    memcpy(header, TRACE_MAGIC, 8);
+    trace_put_uint32(&header[8], TRACE_VERSION);
+    trace_put_uint32(&header[12], strlen(sz_cwd));
+    fwrite(header, sizeof(header), 1, p_trace);
+    fwrite(sz_cwd, strlen(sz_cwd), 1, p_trace);
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+}
 
-    ibuff.count -= len_bytes;
-    ibuff.p_data += len_bytes;
-
-    return p_data;
+/* Record a request as we start handling it */
+static void trace_request(const uint8_t *p_packet, uint32_t len, const struct timespec *p_start)
+{
+    uint8_t record[12];
+    uint64_t arrival = (uint64_t)(p_start->tv_sec - trace_start.tv_sec) * 1000000000u
+        + p_start->tv_nsec - trace_start.tv_nsec;
+
+    trace_put_uint32(&record[0], (uint32_t)(arrival >> 32));
+    trace_put_uint32(&record[4], (uint32_t)arrival);
+    trace_put_uint32(&record[8], len);
+    fwrite(record, sizeof(record), 1, p_trace);
+    fwrite(p_packet, len, 1, p_trace);
 }
 
-/* Write a C string. We trust this to be a properly null terminated string
-i.e. originates in our code or an OS call, not from the client */
-static void put_cstring(const char *sz_str)
+/* Complete the record with how long the request took and the reply, which is
+still in the output buffer */
+static void trace_reply(uint64_t ns)
 {
-    size_t len = strlen(sz_str);
+    uint8_t record[9];
+    uint32_t reply_len = obuff.size - obuff.count;
 
-    put_uint32(len);
-    assert(len  <= obuff.count);
-    memcpy(obuff.p_data, sz_str, len);
+    trace_put_uint32(&record[0], ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns);
+    record[4] = reply_len > 4 ? obuff.data[4] : 0;
+    /* STATUS reply: 4 length, 1 type, 4 id, 4 status */
+    if (reply_len >= 13 && obuff.data[4] == SSH_FXP_STATUS)
+    {
+        memcpy(&record[5], &obuff.data[9], 4);
+    }
+    else
+    {
+        trace_put_uint32(&record[5], 0);
+    }
+    if (fwrite(record, sizeof(record), 1, p_trace) != 1 || ferror(p_trace))
+    {
+        perror(sz_trace_file);
+        fclose(p_trace);
+        p_trace = NULL;
+    }
+}
 
-    obuff.count -= len;
-    obuff.p_data += len;
+static void trace_put_uint32(uint8_t *p_out, uint32_t data)
+{
+    p_out[0] = (uint8_t)(data >> 24);
+    p_out[1] = (uint8_t)(data >> 16);
+    p_out[2] = (uint8_t)(data >> 8);
+    p_out[3] = (uint8_t)data;
 }
 
-/* Get ATTRs */
-static void get_attrs(attrs_t *p_attrs)
+/* Event loop. Each watched descriptor has a source giving the events of
+interest and a handler. On Linux the sources are registered with epoll, and
+only changes in interest cost a system call; elsewhere poll() is given the
+whole table each time. epoll refuses descriptors which poll() would always
+report ready, such as regular files and /dev/null, so those are treated as
+ready without asking */
+static void ev_init(void)
 {
-    memset(p_attrs, 0, sizeof(*p_attrs));
+    size_t i;
 
-    p_attrs->flags = get_uint32();
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_SIZE)
+    for (i = 0; i < elemof(ev_sources); i++)
     {
-        p_attrs->size = get_uint64();
+        ev_sources[i].fd = -1;
     }
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_UIDGID)
+#ifdef __linux__
+    epoll_fd = epoll_create(MAX_EV_SOURCES);
+    if (epoll_fd < 0)
     {
-        p_attrs->uid = get_uint32();
-        p_attrs->gid = get_uint32();
+        perror("epoll_create()");
+        exit(EXIT_FAILURE);
     }
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+#endif
+}
+
+/* Set the events we're interested in for fd. Zero events removes the source */
+static void ev_set(int fd, unsigned events, ev_handler_t handler)
+{
+    ev_source_t *p_source = NULL;
+    ev_source_t *p_free = NULL;
+    size_t i;
+#ifdef __linux__
+    struct epoll_event ev;
+    int op;
+#endif
+
+    for (i = 0; i < elemof(ev_sources); i++)
     {
-        p_attrs->permissions = get_uint32();
+        if (ev_sources[i].fd == fd)
+        {
+            p_source = &ev_sources[i];
+            break;
+        }
+        if (!p_free && ev_sources[i].fd == -1)
+        {
+            p_free = &ev_sources[i];
+        }
     }
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_ACMODTIME)
+    if (p_source && p_source->events == events)
     {
-        p_attrs->atime = get_uint32();
-        p_attrs->mtime = get_uint32();
+        p_source->handler = handler;
+        return;
     }
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_EXTENDED)
+    if (!p_source)
     {
-        /* Note: ATTRs appears to be always at the end of the input packet so it
-        is probably safe to ignore extensions. Consuming the infromation we don't
-        want is however safer */
-        uint32_t count = get_uint32();
-
-        while(count--)
+        if (events == 0)
         {
-            /* Discard extended_type, extended_data pairs */
-            get_string(NULL);
-            get_string(NULL);
+            return;
         }
+        assert(p_free);
+        p_source = p_free;
+        p_source->always_ready = SSH_FALSE;
     }
 
+#ifdef __linux__
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & EV_READ) ? EPOLLIN : 0) | ((events & EV_WRITE) ? EPOLLOUT : 0);
+    ev.data.u32 = p_source - ev_sources;
+    op = events == 0 ? EPOLL_CTL_DEL : p_source->fd == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (!p_source->always_ready && epoll_ctl(epoll_fd, op, fd, &ev) < 0)
+    {
+        if (errno != EPERM || op != EPOLL_CTL_ADD)
+        {
+            perror("epoll_ctl()");
+            exit(EXIT_FAILURE);
+        }
+        p_source->always_ready = SSH_TRUE;
+    }
+#endif
+    p_source->fd = events == 0 ? -1 : fd;
+    p_source->events = events;
+    p_source->handler = handler;
 }
 
-static void put_attrs(attrs_t *p_attrs)
+/* Wait for events (or the timeout, -1 for none) and call their handlers */
+static void ev_wait(int timeout_ms)
 {
-    put_uint32(p_attrs->flags);
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_SIZE)
+#ifdef __linux__
+    struct epoll_event evs[MAX_EV_SOURCES];
+    ssh_bool_t any_ready = SSH_FALSE;
+    int count;
+    int i;
+
+    for (i = 0; i < (int)elemof(ev_sources); i++)
     {
-        put_uint64(p_attrs->size);
+        if (ev_sources[i].fd != -1 && ev_sources[i].always_ready)
+        {
+            any_ready = SSH_TRUE;
+        }
     }
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_UIDGID)
+    count = epoll_wait(epoll_fd, evs, elemof(evs), any_ready ? 0 : timeout_ms);
+    STATS_ADD(sys_wait, 1);
+    if (count < 0 && errno != EINTR)
     {
-        put_uint32(p_attrs->uid);
-        put_uint32(p_attrs->gid);
+        perror("epoll_wait()");
+        exit(EXIT_FAILURE);
     }
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+    for (i = 0; i < count; i++)
     {
-        put_uint32(p_attrs->permissions);
+        ev_source_t *p_source = &ev_sources[evs[i].data.u32];
+        /* Errors and hangups are reported to whoever is waiting, whose
+        read() or write() will then find out what happened */
+        unsigned events = ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? EV_READ : 0)
+            | ((evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) ? EV_WRITE : 0);
+
+        events &= p_source->events;
+        if (p_source->fd != -1 && events)
+        {
+            p_source->handler(p_source->fd, events);
+        }
     }
-    if (p_attrs->flags & SSH_FILEXFER_ATTR_ACMODTIME)
+    for (i = 0; any_ready && i < (int)elemof(ev_sources); i++)
     {
-        put_uint32(p_attrs->atime);
-        put_uint32(p_attrs->mtime);
+        if (ev_sources[i].fd != -1 && ev_sources[i].always_ready)
+        {
+            ev_sources[i].handler(ev_sources[i].fd, ev_sources[i].events);
+        }
     }
-}
+#else
+    struct pollfd pfds[MAX_EV_SOURCES];
+    ev_source_t *p_sources[MAX_EV_SOURCES];
+    nfds_t count = 0;
+    nfds_t i;
 
-static void attrs_to_tv(attrs_t *p_attr, struct timeval tv[2])
-{
-    tv[0].tv_sec = p_attr->atime;
-    tv[0].tv_usec = 0;
-    tv[1].tv_sec = p_attr->mtime;
-    tv[1].tv_usec = 0;
+    for (i = 0; i < elemof(ev_sources); i++)
+    {
+        if (ev_sources[i].fd != -1)
+        {
+            pfds[count].fd = ev_sources[i].fd;
+            pfds[count].events = ((ev_sources[i].events & EV_READ) ? POLLIN : 0)
+                | ((ev_sources[i].events & EV_WRITE) ? POLLOUT : 0);
+            pfds[count].revents = 0;
+            p_sources[count++] = &ev_sources[i];
+        }
+    }
+    STATS_ADD(sys_wait, 1);
+    if (poll(pfds, count, timeout_ms) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror("poll()");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    for (i = 0; i < count; i++)
+    {
+        unsigned events = ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) ? EV_READ : 0)
+            | ((pfds[i].revents & (POLLOUT | POLLHUP | POLLERR)) ? EV_WRITE : 0);
+
+        events &= p_sources[i]->events;
+        if (p_sources[i]->fd == pfds[i].fd && events)
+        {
+            p_sources[i]->handler(pfds[i].fd, events);
+        }
+    }
+#endif
 }
 
 /* Map portable flags to unix flags */
@@ -1536,7 +7169,99 @@ static int pflags_to_unix(uint32_t pflags)
     return flags;
 }
 
-/* Map errno() to SFTP error code */
+/* Map version 5+ desired access and flags to unix flags, or -1 if there are
+flags we can't honour. Text mode needs no translation as our newlines are
+already the protocol's. The BLOCK flags are dealt with after opening */
+static int open_flags_to_unix(uint32_t access, uint32_t flags)
+{
+    int unix_flags;
+
+    if (flags & ~SUPPORTED_OPEN_FLAGS)
+    {
+        return -1;
+    }
+    if ((access & ACE4_READ_DATA) && (access & (ACE4_WRITE_DATA | ACE4_APPEND_DATA)))
+    {
+        unix_flags = O_RDWR;
+    }
+    else if (access & (ACE4_WRITE_DATA | ACE4_APPEND_DATA))
+    {
+        unix_flags = O_WRONLY;
+    }
+    else
+    {
+        unix_flags = O_RDONLY;
+    }
+    switch (flags & SSH_FXF_ACCESS_DISPOSITION)
+    {
+    case SSH_FXF_CREATE_NEW:
+        unix_flags |= O_CREAT | O_EXCL;
+        break;
+
+    case SSH_FXF_CREATE_TRUNCATE:
+        unix_flags |= O_CREAT | O_TRUNC;
+        break;
+
+    case SSH_FXF_OPEN_EXISTING:
+        break;
+
+    case SSH_FXF_OPEN_OR_CREATE:
+        unix_flags |= O_CREAT;
+        break;
+
+    case SSH_FXF_TRUNCATE_EXISTING:
+        unix_flags |= O_TRUNC;
+        break;
+
+    default:
+        return -1;
+    }
+    if (flags & (SSH_FXF_APPEND_DATA | SSH_FXF_APPEND_DATA_ATOMIC))
+    {
+        unix_flags |= O_APPEND;
+    }
+    if (flags & SSH_FXF_NOFOLLOW)
+    {
+        unix_flags |= O_NOFOLLOW;
+    }
+    return unix_flags;
+}
+
+/* renameat() which fails with EEXIST rather than replace the target. Where
+the kernel can't do that atomically, files are linked then unlinked, and
+directories checked for first, which leaves a small race */
+static int rename_noreplace(int old_dirfd, const char *sz_old, int new_dirfd, const char *sz_new)
+{
+    struct stat st;
+
+#ifdef RENAME_NOREPLACE
+    if (renameat2(old_dirfd, sz_old, new_dirfd, sz_new, RENAME_NOREPLACE) == 0)
+    {
+        return 0;
+    }
+    if (errno != EINVAL && errno != ENOSYS)
+    {
+        return -1;
+    }
+#endif
+    if (linkat(old_dirfd, sz_old, new_dirfd, sz_new, 0) == 0)
+    {
+        return unlinkat(old_dirfd, sz_old, 0);
+    }
+    if (errno == EEXIST)
+    {
+        return -1;
+    }
+    if (fstatat(new_dirfd, sz_new, &st, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+    return renameat(old_dirfd, sz_old, new_dirfd, sz_new);
+}
+
+/* Map errno() to SFTP error code. Later versions have more specific codes,
+which earlier clients wouldn't understand */
 static uint32_t errno_to_sftp(int unix_error)
 {
     switch (unix_error)
@@ -1545,10 +7270,17 @@ static uint32_t errno_to_sftp(int unix_error)
         return SSH_FX_OK;
 
     case ENOENT:
+        return SSH_FX_NO_SUCH_FILE;
+
     case ENOTDIR:
+        return sftp_version >= 6 ? SSH_FX_NOT_A_DIRECTORY
+            : sftp_version >= 4 ? SSH_FX_NO_SUCH_PATH : SSH_FX_NO_SUCH_FILE;
+
     case EBADF:
+        return sftp_version >= 4 ? SSH_FX_INVALID_HANDLE : SSH_FX_NO_SUCH_FILE;
+
     case ELOOP:
-        return SSH_FX_NO_SUCH_FILE;
+        return sftp_version >= 6 ? SSH_FX_LINK_LOOP : SSH_FX_NO_SUCH_FILE;
 
     case EPERM:
     case EACCES:
@@ -1556,8 +7288,34 @@ static uint32_t errno_to_sftp(int unix_error)
         return SSH_FX_PERMISSION_DENIED;
 
     case ENAMETOOLONG:
+        return sftp_version >= 6 ? SSH_FX_INVALID_FILENAME : SSH_FX_BAD_MESSAGE;
+
     case EINVAL:
-        return SSH_FX_BAD_MESSAGE;
+        return sftp_version >= 6 ? SSH_FX_INVALID_PARAMETER : SSH_FX_BAD_MESSAGE;
+
+    case EEXIST:
+        return sftp_version >= 4 ? SSH_FX_FILE_ALREADY_EXISTS : SSH_FX_FAILURE;
+
+    case EROFS:
+        return sftp_version >= 4 ? SSH_FX_WRITE_PROTECT : SSH_FX_FAILURE;
+
+    case ENOSPC:
+        return sftp_version >= 5 ? SSH_FX_NO_SPACE_ON_FILESYSTEM : SSH_FX_FAILURE;
+
+    case EDQUOT:
+        return sftp_version >= 5 ? SSH_FX_QUOTA_EXCEEDED : SSH_FX_FAILURE;
+
+    case ENOTEMPTY:
+        return sftp_version >= 6 ? SSH_FX_DIR_NOT_EMPTY : SSH_FX_FAILURE;
+
+    case EISDIR:
+        return sftp_version >= 6 ? SSH_FX_FILE_IS_A_DIRECTORY : SSH_FX_FAILURE;
+
+    case ENOTSUP:
+#if EOPNOTSUPP != ENOTSUP
+    case EOPNOTSUPP:
+#endif
+        return SSH_FX_OP_UNSUPPORTED;
     }
     return SSH_FX_FAILURE;
 }
@@ -1571,8 +7329,14 @@ static unsigned long handle_alloc_file(int fd)
     {
         if (handles[handle].use == HANDLE_FREE)
         {
+            memset(&handles[handle], 0, sizeof(handles[handle]));
             handles[handle].use = HANDLE_FILE;
             handles[handle].fd = fd;
+            STATS_ADD(handles_open, 1);
+            if (p_stats && p_stats->handles_open > p_stats->handles_peak)
+            {
+                p_stats->handles_peak = p_stats->handles_open;
+            }
             return handle + 1;
         }
     }
@@ -1589,6 +7353,11 @@ static unsigned long handle_alloc_dir(int fd, DIR *p_dir)
         {
             handles[handle].use = HANDLE_DIR;
             handles[handle].fd = fd;
+            STATS_ADD(handles_open, 1);
+            if (p_stats && p_stats->handles_open > p_stats->handles_peak)
+            {
+                p_stats->handles_peak = p_stats->handles_open;
+            }
             handles[handle].p_dir = p_dir;
             return handle + 1;
         }
@@ -1,4 +1,162 @@
 #ifndef _NIH_SFTP_SERVER_H_
 #define _NIH_SFTP_SERVER_H_
 
+/* Protocol constants, shared by the server and the tools which drive it */
+
+/* draft-ietf-secsh-filexfer-02 */
+#define SSH_FXP_INIT                1
+#define SSH_FXP_VERSION             2
+#define SSH_FXP_OPEN                3
+#define SSH_FXP_CLOSE               4
+#define SSH_FXP_READ                5
+#define SSH_FXP_WRITE               6
+#define SSH_FXP_LSTAT               7
+#define SSH_FXP_FSTAT               8
+#define SSH_FXP_SETSTAT             9
+#define SSH_FXP_FSETSTAT           10
+#define SSH_FXP_OPENDIR            11
+#define SSH_FXP_READDIR            12
+#define SSH_FXP_REMOVE             13
+#define SSH_FXP_MKDIR              14
+#define SSH_FXP_RMDIR              15
+#define SSH_FXP_REALPATH           16
+#define SSH_FXP_STAT               17
+#define SSH_FXP_RENAME             18
+#define SSH_FXP_READLINK           19
+#define SSH_FXP_SYMLINK            20
+/* draft-ietf-secsh-filexfer-13 (version 6) */
+#define SSH_FXP_LINK               21
+#define SSH_FXP_BLOCK              22
+#define SSH_FXP_UNBLOCK            23
+#define SSH_FXP_STATUS            101
+#define SSH_FXP_HANDLE            102
+#define SSH_FXP_DATA              103
+#define SSH_FXP_NAME              104
+#define SSH_FXP_ATTRS             105
+#define SSH_FXP_EXTENDED          200
+#define SSH_FXP_EXTENDED_REPLY    201
+
+#define SSH_FX_OK                            0
+#define SSH_FX_EOF                           1
+#define SSH_FX_NO_SUCH_FILE                  2
+#define SSH_FX_PERMISSION_DENIED             3
+#define SSH_FX_FAILURE                       4
+#define SSH_FX_BAD_MESSAGE                   5
+#define SSH_FX_NO_CONNECTION                 6
+#define SSH_FX_CONNECTION_LOST               7
+#define SSH_FX_OP_UNSUPPORTED                8
+/* Version 4 */
+#define SSH_FX_INVALID_HANDLE                9
+#define SSH_FX_NO_SUCH_PATH                 10
+#define SSH_FX_FILE_ALREADY_EXISTS          11
+#define SSH_FX_WRITE_PROTECT                12
+#define SSH_FX_NO_MEDIA                     13
+/* Version 5 */
+#define SSH_FX_NO_SPACE_ON_FILESYSTEM       14
+#define SSH_FX_QUOTA_EXCEEDED               15
+#define SSH_FX_UNKNOWN_PRINCIPAL            16
+#define SSH_FX_LOCK_CONFLICT                17
+/* Version 6 */
+#define SSH_FX_DIR_NOT_EMPTY                18
+#define SSH_FX_NOT_A_DIRECTORY              19
+#define SSH_FX_INVALID_FILENAME             20
+#define SSH_FX_LINK_LOOP                    21
+#define SSH_FX_CANNOT_DELETE                22
+#define SSH_FX_INVALID_PARAMETER            23
+#define SSH_FX_FILE_IS_A_DIRECTORY          24
+#define SSH_FX_BYTE_RANGE_LOCK_CONFLICT     25
+#define SSH_FX_BYTE_RANGE_LOCK_REFUSED      26
+#define SSH_FX_DELETE_PENDING               27
+#define SSH_FX_FILE_CORRUPT                 28
+#define SSH_FX_OWNER_INVALID                29
+#define SSH_FX_GROUP_INVALID                30
+#define SSH_FX_NO_MATCHING_BYTE_RANGE_LOCK  31
+
+#define SSH_FILEXFER_ATTR_SIZE          0x00000001
+#define SSH_FILEXFER_ATTR_UIDGID        0x00000002  /* Version 3 only */
+#define SSH_FILEXFER_ATTR_PERMISSIONS   0x00000004
+#define SSH_FILEXFER_ATTR_ACMODTIME     0x00000008  /* Version 3 only */
+#define SSH_FILEXFER_ATTR_EXTENDED      0x80000000
+/* Version 4 onwards. ACCESSTIME takes the place of ACMODTIME */
+#define SSH_FILEXFER_ATTR_ACCESSTIME        0x00000008
+#define SSH_FILEXFER_ATTR_CREATETIME        0x00000010
+#define SSH_FILEXFER_ATTR_MODIFYTIME        0x00000020
+#define SSH_FILEXFER_ATTR_ACL               0x00000040
+#define SSH_FILEXFER_ATTR_OWNERGROUP        0x00000080
+#define SSH_FILEXFER_ATTR_SUBSECOND_TIMES   0x00000100
+#define SSH_FILEXFER_ATTR_BITS              0x00000200  /* Version 5 */
+#define SSH_FILEXFER_ATTR_ALLOCATION_SIZE   0x00000400  /* Version 6 */
+#define SSH_FILEXFER_ATTR_TEXT_HINT         0x00000800
+#define SSH_FILEXFER_ATTR_MIME_TYPE         0x00001000
+#define SSH_FILEXFER_ATTR_LINK_COUNT        0x00002000
+#define SSH_FILEXFER_ATTR_UNTRANSLATED_NAME 0x00004000
+#define SSH_FILEXFER_ATTR_CTIME             0x00008000
+
+/* ATTRS type byte, version 4 onwards. Types after UNKNOWN are version 5 */
+#define SSH_FILEXFER_TYPE_REGULAR       1
+#define SSH_FILEXFER_TYPE_DIRECTORY     2
+#define SSH_FILEXFER_TYPE_SYMLINK       3
+#define SSH_FILEXFER_TYPE_SPECIAL       4
+#define SSH_FILEXFER_TYPE_UNKNOWN       5
+#define SSH_FILEXFER_TYPE_SOCKET        6
+#define SSH_FILEXFER_TYPE_CHAR_DEVICE   7
+#define SSH_FILEXFER_TYPE_BLOCK_DEVICE  8
+#define SSH_FILEXFER_TYPE_FIFO          9
+
+#define SSH_FXF_READ            0x00000001
+#define SSH_FXF_WRITE           0x00000002
+#define SSH_FXF_APPEND          0x00000004
+#define SSH_FXF_CREAT           0x00000008
+#define SSH_FXF_TRUNC           0x00000010
+#define SSH_FXF_EXCL            0x00000020
+
+/* OPEN flags from version 5, which also sends an ACE4 desired access mask */
+#define SSH_FXF_ACCESS_DISPOSITION      0x00000007
+#define SSH_FXF_CREATE_NEW              0x00000000
+#define SSH_FXF_CREATE_TRUNCATE         0x00000001
+#define SSH_FXF_OPEN_EXISTING           0x00000002
+#define SSH_FXF_OPEN_OR_CREATE          0x00000003
+#define SSH_FXF_TRUNCATE_EXISTING       0x00000004
+#define SSH_FXF_APPEND_DATA             0x00000008
+#define SSH_FXF_APPEND_DATA_ATOMIC      0x00000010
+#define SSH_FXF_TEXT_MODE               0x00000020
+#define SSH_FXF_BLOCK_READ              0x00000040
+#define SSH_FXF_BLOCK_WRITE             0x00000080
+#define SSH_FXF_BLOCK_DELETE            0x00000100
+#define SSH_FXF_BLOCK_ADVISORY          0x00000200  /* Version 6 */
+#define SSH_FXF_NOFOLLOW                0x00000400
+#define SSH_FXF_DELETE_ON_CLOSE         0x00000800
+
+#define ACE4_READ_DATA          0x00000001
+#define ACE4_WRITE_DATA         0x00000002
+#define ACE4_APPEND_DATA        0x00000004
+#define ACE4_READ_ATTRIBUTES    0x00000080
+#define ACE4_WRITE_ATTRIBUTES   0x00000100
+
+/* RENAME flags, version 5 onwards */
+#define SSH_FXF_RENAME_OVERWRITE    0x00000001
+#define SSH_FXF_RENAME_ATOMIC       0x00000002
+#define SSH_FXF_RENAME_NATIVE       0x00000004
+
+/* REALPATH control byte, version 6 */
+#define SSH_FXP_REALPATH_NO_CHECK       0x00000001
+#define SSH_FXP_REALPATH_STAT_IF        0x00000002
+#define SSH_FXP_REALPATH_STAT_ALWAYS    0x00000003
+
+/* Request trace file written by "nih-sftp-server -T" and read by
+nih-sftp-replay. All integers are big endian, as in the protocol.
+
+Header: TRACE_MAGIC (8 bytes), uint32 TRACE_VERSION, uint32 length and
+the bytes of the server's working directory.
+
+Then one record per request: uint64 arrival time ns (from the start of the
+session), uint32 length and the bytes of the request packet (without its
+length field), uint32 time taken to handle it ns, uint8 reply type (0 for
+none) and uint32 reply status (STATUS replies only, else 0). The request is
+written before it is handled, so the last record of a trace may be cut short */
+#define TRACE_MAGIC "NIHTRACE"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_LEN 16
+#define TRACE_RECORD_LEN 21
+
 #endif // _NIH_SFTP_SERVER_H_